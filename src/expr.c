@@ -0,0 +1,322 @@
+/* NetPrinters - Expression matching
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* This file is included by libnetprinters.c and by nptest, which builds it on
+ * the build machine, so it mustn't use any Windows APIs. The including file
+ * must define allocate().
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Expression prepared by expr_prepare() for matching against many strings
+ *
+ * The literal text which must appear in any matching string (the literal
+ * prefix and suffix, and the longest literal run between wildcards) is kept
+ * lowercased so most non-matching strings are rejected without running the
+ * full expr_compare().
+*/
+struct expr_filter {
+	char const *expr;
+	
+	size_t min_len;		/* Characters matched by everything but '*' */
+	int exact_len;		/* No '*', so the length must be min_len */
+	
+	char *prefix;
+	size_t prefix_len;
+	char *suffix;
+	size_t suffix_len;
+	char *middle;
+	size_t middle_len;
+};
+
+static int expr_compare(char const *str, char const *expr);
+static void expr_prepare(struct expr_filter *filter, char const *expr);
+static int expr_match(struct expr_filter const *filter, char const *str);
+static void expr_free(struct expr_filter *filter);
+static char *fold_copy(char const *str, size_t len);
+static int ncase_prefix(char const *str, char const *lower, size_t len);
+static char const *ncase_find(char const *str, size_t slen, char const *lower, size_t len);
+static int ncase_match(char const *str1, char const *str2);
+static void *allocate(unsigned int size);
+
+/* Compare the supplied string and expression
+ * Returns 1 upon match, zero otherwise.
+ *
+ * When a literal character or wildcard fails to match, the expression restarts
+ * after the last '*' with the string advanced by one character from where that
+ * '*' started matching, so each '*' can consume as much of the string as it
+ * needs without recursion. A '#' matches a digit or a literal '#'.
+*/
+static int expr_compare(char const *str, char const *expr) {
+	char const *star_expr = NULL, *star_str = NULL;
+	
+	while(str[0] != '\0') {
+		if(expr[0] == '*') {
+			star_expr = ++expr;
+			star_str = str;
+			
+			continue;
+		}
+		if(expr[0] == '?') {
+			expr++;
+			str++;
+			
+			continue;
+		}
+		if(expr[0] == '#' && (isdigit((unsigned char)str[0]) || str[0] == '#')) {
+			expr++;
+			str++;
+			
+			continue;
+		}
+		if(expr[0] != '\0' && tolower((unsigned char)expr[0]) == tolower((unsigned char)str[0])) {
+			expr++;
+			str++;
+			
+			continue;
+		}
+		
+		if(star_expr) {
+			expr = star_expr;
+			str = ++star_str;
+			
+			continue;
+		}
+		
+		return 0;
+	}
+	
+	while(expr[0] == '*') {
+		expr++;
+	}
+	
+	return expr[0] == '\0';
+}
+
+/* Prepare an expression for matching against many strings with expr_match(),
+ * the expression must remain valid until expr_free() is called.
+*/
+static void expr_prepare(struct expr_filter *filter, char const *expr) {
+	size_t pos, len = strlen(expr), plen = strcspn(expr, "*?#"), slen = 0;
+	
+	memset(filter, 0, sizeof(*filter));
+	filter->expr = expr;
+	filter->exact_len = !strchr(expr, '*');
+	
+	for(pos = 0; pos < len; pos++) {
+		if(expr[pos] != '*') {
+			filter->min_len++;
+		}
+	}
+	
+	if(plen == len) {
+		filter->prefix = fold_copy(expr, (filter->prefix_len = len));
+		return;
+	}
+	
+	if(plen) {
+		filter->prefix = fold_copy(expr, (filter->prefix_len = plen));
+	}
+	
+	while(slen < len && !strchr("*?#", expr[len-slen-1])) {
+		slen++;
+	}
+	
+	if(slen) {
+		filter->suffix = fold_copy(expr+len-slen, (filter->suffix_len = slen));
+	}
+	
+	/* Longest literal run between the prefix and suffix */
+	
+	for(pos = plen; pos < len-slen; ) {
+		size_t run = strcspn(expr+pos, "*?#");
+		
+		if(pos+run > len-slen) {
+			run = len-slen-pos;
+		}
+		
+		if(run > filter->middle_len) {
+			free(filter->middle);
+			filter->middle = fold_copy(expr+pos, (filter->middle_len = run));
+		}
+		
+		pos += run ? run : 1;
+	}
+}
+
+/* Compare a string with an expression prepared by expr_prepare()
+ * Returns 1 upon match, zero otherwise.
+*/
+static int expr_match(struct expr_filter const *filter, char const *str) {
+	size_t len = strlen(str);
+	
+	if(len < filter->min_len || (filter->exact_len && len != filter->min_len)) {
+		return 0;
+	}
+	
+	if(filter->prefix_len && !ncase_prefix(str, filter->prefix, filter->prefix_len)) {
+		return 0;
+	}
+	
+	if(filter->suffix_len && !ncase_prefix(str+len-filter->suffix_len, filter->suffix, filter->suffix_len)) {
+		return 0;
+	}
+	
+	if(filter->middle_len && !ncase_find(str+filter->prefix_len, len-filter->prefix_len-filter->suffix_len, filter->middle, filter->middle_len)) {
+		return 0;
+	}
+	
+	return expr_compare(str, filter->expr);
+}
+
+/* Free the buffers allocated by expr_prepare() */
+static void expr_free(struct expr_filter *filter) {
+	free(filter->prefix);
+	free(filter->suffix);
+	free(filter->middle);
+}
+
+/* Returns a lowercased copy of the first len characters of a string */
+static char *fold_copy(char const *str, size_t len) {
+	char *ret = allocate(len+1);
+	size_t pos;
+	
+	for(pos = 0; pos < len; pos++) {
+		ret[pos] = tolower((unsigned char)str[pos]);
+	}
+	
+	ret[len] = '\0';
+	return ret;
+}
+
+#ifdef __SSE2__
+/* Lowercase the ASCII letters in a vector of 16 characters */
+static __m128i fold16(__m128i chars) {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('Z'+1)));
+	return _mm_or_si128(chars, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/* Check if a string starts with len characters matching a lowercased string,
+ * ignoring case. The string must have at least len characters.
+*/
+static int ncase_prefix(char const *str, char const *lower, size_t len) {
+	size_t pos = 0;
+	
+#ifdef __SSE2__
+	for(; pos+16 <= len; pos += 16) {
+		__m128i chars = fold16(_mm_loadu_si128((__m128i const*)(str+pos)));
+		
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_loadu_si128((__m128i const*)(lower+pos)))) != 0xFFFF) {
+			return 0;
+		}
+	}
+#endif
+	
+	for(; pos < len; pos++) {
+		if(tolower((unsigned char)str[pos]) != (unsigned char)lower[pos]) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/* Find the first occurence of a lowercased string within the first slen
+ * characters of a string, ignoring case.
+ *
+ * Returns a pointer to the occurence, or NULL if there isn't one.
+*/
+static char const *ncase_find(char const *str, size_t slen, char const *lower, size_t len) {
+	size_t pos = 0;
+	
+	if(len > slen) {
+		return NULL;
+	}
+	
+#ifdef __SSE2__
+	/* Compare the first and last characters at 16 positions at once and
+	 * only check the rest at positions where both match.
+	*/
+	
+	__m128i first = _mm_set1_epi8(lower[0]), last = _mm_set1_epi8(lower[len-1]);
+	
+	for(; pos+len-1+16 <= slen; pos += 16) {
+		__m128i fchars = fold16(_mm_loadu_si128((__m128i const*)(str+pos)));
+		__m128i lchars = fold16(_mm_loadu_si128((__m128i const*)(str+pos+len-1)));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(fchars, first), _mm_cmpeq_epi8(lchars, last)));
+		
+		while(mask) {
+			unsigned int bit = 0;
+			
+			while(!(mask & (1U << bit))) {
+				bit++;
+			}
+			
+			if(ncase_prefix(str+pos+bit, lower, len)) {
+				return str+pos+bit;
+			}
+			
+			mask &= mask - 1;
+		}
+	}
+#endif
+	
+	for(; pos+len <= slen; pos++) {
+		if(ncase_prefix(str+pos, lower, len)) {
+			return str+pos;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Compare two strings, ignoring case
+ * Returns 1 if they match, zero otherwise.
+*/
+static int ncase_match(char const *str1, char const *str2) {
+	size_t pos = 0;
+	
+	while(tolower((unsigned char)str1[pos]) == tolower((unsigned char)str2[pos])) {
+		if(str1[pos] == '\0') {
+			return 1;
+		}
+		
+		pos++;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,6594 @@
+/* NetPrinters - Library
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define SECURITY_WIN32
+
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <lm.h>
+#include <dsgetdc.h>
+#include <security.h>
+#include <wtsapi32.h>
+#include <userenv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "libnetprinters.h"
+
+#define WHITESPACE "\r\n\t "
+
+/* The expression matching, script parsing and block index functions are shared
+ * with nptest.
+*/
+#include "expr.c"
+#include "script.c"
+
+/* Maximum number of threads used by parallel_for() */
+#define MAX_WORKERS 8
+
+/* Interval between snapshots when watching without change notifications, and
+ * time to wait for a burst of changes to finish before re-applying.
+*/
+#define WATCH_POLL_MS 60000
+#define WATCH_SETTLE_MS 500
+
+/* Maximum number of threads started by probe_start() at once, and time to
+ * wait for the status of DefaultPrinter candidates.
+*/
+#define MAX_PROBES 32
+#define DEFAULT_PROBE_MS 3000
+
+/* Time to wait for the status of each printer listed by -l */
+#define LIST_PROBE_MS 5000
+
+/* Fields which can be listed by -l, see list_field_names */
+#define FIELD_NAME	0
+#define FIELD_SERVER	1
+#define FIELD_SHARE	2
+#define FIELD_DRIVER	3
+#define FIELD_STATUS	4
+#define FIELD_JOBS	5
+#define FIELD_PORT	6
+#define FIELD_MAX	7
+
+/* Printer status flags which make a printer unusable */
+#define PRINTER_STATUS_UNUSABLE (PRINTER_STATUS_PAUSED | PRINTER_STATUS_ERROR | PRINTER_STATUS_PENDING_DELETION \
+	| PRINTER_STATUS_PAPER_JAM | PRINTER_STATUS_PAPER_OUT | PRINTER_STATUS_PAPER_PROBLEM | PRINTER_STATUS_OFFLINE \
+	| PRINTER_STATUS_NOT_AVAILABLE | PRINTER_STATUS_NO_TONER | PRINTER_STATUS_USER_INTERVENTION \
+	| PRINTER_STATUS_DOOR_OPEN | PRINTER_STATUS_SERVER_UNKNOWN)
+
+/* Number of latency histogram buckets kept for each server and operation,
+ * bucket n counts durations of 2^(n-1) to 2^n-1 milliseconds (bucket 0 is
+ * under 1ms) and the last bucket also counts anything longer.
+*/
+#define STATS_BUCKETS 18
+#define STATS_FILE "stats.dat"
+#define STATS_MAGIC "netprinters-stats 1"
+
+/* File the average connect duration of each printer is kept in */
+#define HISTORY_FILE "history.dat"
+#define HISTORY_MAGIC "netprinters-history 1"
+
+/* Time to wait for each server of a ServerGroup to accept a connection, and
+ * the port connected to (SMB).
+*/
+#define GROUP_PROBE_MS 1000
+#define GROUP_PROBE_PORT 445
+
+/* First line of a file written by -record */
+#define RECORD_MAGIC "netprinters-recording 1"
+
+/* Longest time to wait for another run of the same script to finish before
+ * executing it anyway.
+*/
+#define SCRIPT_LOCK_MS 300000
+
+/* Longest time the agent waits for a client to send its command */
+#define AGENT_READ_MS 5000
+
+/* Types of directive planned for each session by -batch */
+#define BATCH_ADD	0
+#define BATCH_DEFAULT	1
+#define BATCH_DELETE	2
+
+/* Priority classes of the directives scheduled by a time budget, in the order
+ * they're carried out.
+*/
+#define PRIORITY_DEFAULT	0	/* DefaultPrinter and the printers it names */
+#define PRIORITY_CRITICAL	1	/* CriticalPrinter */
+#define PRIORITY_NORMAL		2	/* AddPrinter */
+#define PRIORITY_CLEANUP	3	/* DeletePrinter */
+
+/* Spooler calls counted by -explain, see explain_call() */
+#define EXPLAIN_ENUM	0
+#define EXPLAIN_DRIVERS	1
+#define EXPLAIN_GET	2
+#define EXPLAIN_ADD	3
+#define EXPLAIN_DELETE	4
+#define EXPLAIN_DEFAULT	5
+#define EXPLAIN_CALLS	6
+
+/* Properties of script directives, see struct directive */
+#define DIRECTIVE_SPOOLER	1	/* Changes connections, planned by -batch and scheduled by Budget */
+#define DIRECTIVE_PARALLEL	2	/* Connections are queued and made in parallel */
+#define DIRECTIVE_FLUSH		4	/* Queued connections are made first */
+#define DIRECTIVE_FILTER	8	/* Evaluates true or false, may be negated with ! */
+#define DIRECTIVE_EXIT		16	/* Stops the script */
+
+#define DIRECTIVE_HASH_SIZE 32
+
+/* WTSQueryUserToken() isn't available before Windows XP, so it's looked up at
+ * run time by run_batch().
+*/
+typedef BOOL (WINAPI *wts_query_user_token)(ULONG session, PHANDLE token);
+
+/* GetVersionEx() reports Windows 8 (6.2.9200) on later versions to programs
+ * without a compatibility manifest, so env_osver() uses RtlGetVersion() from
+ * ntdll.dll, which always gives the real version.
+*/
+typedef LONG (WINAPI *rtl_get_version)(OSVERSIONINFOW *info);
+
+/* Growable list of strings, see list_add() */
+struct str_list {
+	char **items;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* Source of printer change events for watch mode, wait() blocks until the
+ * connections may have changed and returns zero if the source has failed.
+*/
+struct change_source {
+	char const *name;
+	
+	int (*open)(struct change_source *src);
+	int (*wait)(struct change_source *src);
+	void (*close)(struct change_source *src);
+	
+	HANDLE server;
+	HANDLE change;
+};
+
+/* Equivalent print servers declared by a ServerGroup directive, printers on
+ * \\<name>\<share> are connected through the fastest server that responds.
+ * The servers are put in order of their latency when first used.
+*/
+struct server_group {
+	char *name;
+	struct str_list servers;
+	int measured;
+};
+
+/* Addresses of a print server, see server_addrs() */
+struct server_alias {
+	char *name;		/* Lowercase, as written */
+	char **addrs;		/* NULL until resolved */
+};
+
+/* Latency of a server measured by group_measure() */
+struct replica_probe {
+	char const *server;
+	int ok;
+	DWORD latency;
+	unsigned int index;
+};
+
+/* Implementation of the print spooler calls which read or change printer
+ * connections, either the real spooler or a recording being replayed. The
+ * functions set the last error when they fail, returned lists and printer
+ * details are freed by the caller.
+*/
+struct spooler_backend {
+	char const *name;
+	
+	char **(*enum_connections)(void);
+	char **(*enum_drivers)(void);
+	PRINTER_INFO_2 *(*get_printer)(char const *printer);
+	BOOL (*add_connection)(char const *printer);
+	BOOL (*delete_connection)(char const *printer);
+	BOOL (*set_default)(char const *printer);
+};
+
+/* Call read from a recording by replay_load() */
+struct replay_call {
+	char *op;
+	char *arg;
+	BOOL ok;
+	DWORD error;
+	DWORD duration;
+	char **values;
+	int used;
+};
+
+/* Node in the binary prefix tree which Subnet directives are compiled into,
+ * nodes are indexed by address bits, most significant first.
+*/
+struct subnet_node {
+	struct subnet_node *child[2];
+	int terminal;	/* A Subnet directive ends here */
+	int matched;	/* A local address is within this subnet */
+};
+
+/* Entry in the table of script directives, which is looked up by name through
+ * directive_find(). The handler returns 1 or zero for a filter and -1 for
+ * anything else.
+*/
+struct directive {
+	char const *name;
+	int (*handler)(struct script *script, struct script_line const *line);
+	int flags;
+	int priority;	/* Scheduling priority of a DIRECTIVE_SPOOLER directive */
+	int batch_type;	/* Type of a DIRECTIVE_SPOOLER directive in a -batch plan */
+	int fact;	/* Index into userenv of the fact tested, or -1 */
+	
+	struct directive *next;
+};
+
+/* Counters and latency histogram for one operation on one print server */
+struct server_stats {
+	char server[256];
+	char op[16];
+	
+	unsigned long ok;
+	unsigned long fail;
+	unsigned long buckets[STATS_BUCKETS];
+};
+
+struct stats_table {
+	struct server_stats *entries;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* Connect durations of a printer, see history_load() */
+struct printer_history {
+	char *printer;		/* Lowercase */
+	unsigned long average;	/* Milliseconds */
+	unsigned long samples;
+	int updated;		/* Connected during this run */
+};
+
+struct history_table {
+	struct printer_history *entries;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* Status of a printer fetched by a probe_start() thread */
+struct printer_probe {
+	char *printer;
+	
+	volatile LONG started;
+	DWORD start;
+	int replaced;		/* Another thread was started to take over */
+	
+	volatile LONG done;
+	PRINTER_INFO_2 *info;	/* NULL on error */
+	DWORD error;
+};
+
+/* Set of probes shared between the caller of probe_start() and its threads,
+ * freed by whichever of them calls probe_unref() last so a thread stuck on
+ * an unresponsive server can be abandoned.
+*/
+struct probe_set {
+	volatile LONG refs;
+	volatile LONG next;
+	volatile LONG cancelled;
+	volatile LONG threads;	/* Threads which haven't exited */
+	
+	DWORD start;
+	HANDLE event;		/* Set whenever a probe finishes */
+	
+	unsigned int count;
+	struct printer_probe *probes;
+};
+
+/* Printer connected by at least one session in batch mode, which is probed
+ * once on behalf of all of them.
+*/
+struct batch_printer {
+	char *printer;
+	
+	int reachable;
+	DWORD error;		/* Why the printer isn't reachable */
+	int usable;		/* Reachable and printer_usable() */
+	int needs_driver;	/* Driver isn't installed locally */
+	
+	CRITICAL_SECTION install;	/* Held while the driver is downloaded */
+	volatile LONG installed;
+};
+
+/* Directive planned for a session by run_script() in batch mode */
+struct batch_action {
+	unsigned int lnum;
+	int type;
+	char *target;
+	
+	struct str_list done;	/* Printers deleted, or set as default */
+	int downloaded;		/* This session downloaded the driver */
+	int enum_failed;	/* The connections couldn't be enumerated */
+	DWORD enum_error;
+	BOOL ok;
+	DWORD error;
+	DWORD duration;
+};
+
+/* Session of a logged on user, see run_batch() */
+struct batch_session {
+	DWORD id;
+	char *user;
+	HANDLE token;
+	
+	struct str_list env;	/* The user's environment, as NAME=value */
+	
+	struct batch_action *actions;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* Command directive scheduled by run_script() when a time budget is set */
+struct sched_action {
+	unsigned int seq;
+	unsigned int lnum;
+	struct directive const *directive;
+	char *value;
+	int priority;
+};
+
+static void stats_record(char const *printer, char const *op, int ok, DWORD duration);
+static void stats_server(char const *printer, char *server, size_t size);
+static struct server_stats *stats_find(struct stats_table *table, char const *server, char const *op);
+static int stats_load(struct stats_table *table);
+static void stats_save(void);
+static void stats_print(void);
+static unsigned long stats_percentile(struct server_stats const *entry, unsigned int percent);
+static struct printer_history *history_find(struct history_table *table, char const *printer, int add);
+static int history_load(struct history_table *table);
+static void history_record(char const *printer, DWORD duration);
+static void history_save(void);
+static char **get_printers(void);
+static char *win32_strerr(DWORD errnum);
+static void list_printers(char const *expr);
+static int set_list_fields(char const *spec);
+static char *list_field(char const *printer, struct printer_probe *probe, int responded, int field);
+static char *status_string(PRINTER_INFO_2 const *info);
+static void list_row(char **cells, unsigned int *widths, unsigned int count);
+static void connect_printer(char *printer);
+static void flush_connections(void);
+static void probe_driver(void *item);
+static void add_connection(void *item);
+static int pending_cmp(void const *a, void const *b);
+static void load_local_drivers(void);
+static int have_driver(char const *driver);
+static void default_printer(char *printer);
+static void default_first_available(char *candidates);
+static struct probe_set *probe_start(char **printers, unsigned int count);
+static DWORD WINAPI probe_worker(LPVOID arg);
+static int probe_wait(struct probe_set *set, unsigned int pnum, DWORD timeout);
+static void probe_release(struct probe_set *set);
+static void probe_unref(struct probe_set *set);
+static int printer_usable(PRINTER_INFO_2 const *info);
+static int is_pattern(char const *expr);
+static void disconnect_printer(char *printer);
+static void disconnect_by_expr(char *expr);
+static void want_printer(char const *printer);
+static void unwant_expr(char const *expr);
+static int is_wanted(char const *printer);
+static void watch_printers(void);
+static int watch_reconcile(void);
+static int spooler_source_open(struct change_source *src);
+static int spooler_source_wait(struct change_source *src);
+static void spooler_source_close(struct change_source *src);
+static int poll_source_open(struct change_source *src);
+static int poll_source_wait(struct change_source *src);
+static void poll_source_close(struct change_source *src);
+static void snapshot_update(char const *printer, int connected);
+static void agent_pipe_name(char *buf);
+static ACL *agent_pipe_acl(SECURITY_DESCRIPTOR *sd);
+static int agent_read(HANDLE pipe, char *buf, DWORD size);
+static void run_agent(char const *filename);
+static DWORD WINAPI agent_watcher(LPVOID arg);
+static void agent_command(char *cmd);
+static int agent_query(char const *cmd);
+static void run_batch(char const *filename);
+static int batch_plan(struct script *script, struct batch_session *session);
+static void batch_add_action(struct directive const *directive, char const *value);
+static void batch_probe(struct batch_session *sessions, unsigned int count);
+static struct batch_printer *batch_find_printer(char const *printer);
+static void batch_apply(void *item);
+static void batch_default(struct batch_action *action);
+static char **batch_get_printers(struct batch_action *action);
+static void batch_report(struct batch_session *session);
+static char const *batch_getenv(char const *name);
+static void reset_user_facts(void);
+static char **spool_enum_connections(void);
+static char **spool_enum_drivers(void);
+static PRINTER_INFO_2 *spool_get_printer(char const *printer);
+static BOOL spool_add_connection(char const *printer);
+static BOOL spool_delete_connection(char const *printer);
+static BOOL spool_set_default(char const *printer);
+static char **live_enum_connections(void);
+static char **registry_connections(void);
+static char **live_enum_drivers(void);
+static PRINTER_INFO_2 *live_get_printer(char const *printer);
+static BOOL live_add_connection(char const *printer);
+static BOOL live_delete_connection(char const *printer);
+static BOOL live_set_default(char const *printer);
+static char **replay_enum_connections(void);
+static char **replay_enum_drivers(void);
+static PRINTER_INFO_2 *replay_get_printer(char const *printer);
+static BOOL replay_add_connection(char const *printer);
+static BOOL replay_delete_connection(char const *printer);
+static BOOL replay_set_default(char const *printer);
+static char **explain_enum_connections(void);
+static char **explain_enum_drivers(void);
+static PRINTER_INFO_2 *explain_get_printer(char const *printer);
+static BOOL explain_add_connection(char const *printer);
+static BOOL explain_delete_connection(char const *printer);
+static BOOL explain_set_default(char const *printer);
+static int record_open(char const *filename);
+static void record_call(char const *op, char const *arg, BOOL ok, DWORD error, DWORD start, char **values);
+static void record_string(char const *str);
+static void record_unescape(char *str);
+static int replay_load(char const *filename);
+static int replaying(void);
+static struct replay_call *replay_find(char const *op, char const *arg);
+static char **replay_values(char const *op, char const *arg);
+static char **printer_values(PRINTER_INFO_2 const *info);
+static PRINTER_INFO_2 *printer_from_values(char **values);
+static char *state_path(char const *name);
+static HANDLE state_lock(char const *name);
+static void state_unlock(HANDLE lock);
+static char *cached_script(char const *filename);
+static struct script *load_script(char const *filename);
+static void free_script(struct script *script);
+static int exec_script(char const *filename);
+static int explain_script(char const *filename);
+static void explain_call(int call, char const *target, int measured, unsigned long ms, char const *source);
+static char const *explain_estimate(char const *printer, char const *op, unsigned long *ms);
+static void explain_parallel(void *items, size_t size, unsigned int count, void (*func)(void*));
+static int script_lock(char const *filename, HANDLE *lock, char **result);
+static int script_result(char const *path, FILETIME const *since);
+static int run_script(struct script *script);
+static int run_block(struct script *script, struct script_block *block);
+static void set_budget(char const *value);
+static DWORD budget_left(void);
+static void sched_add(struct directive const *directive, char const *value);
+static void run_schedule(void);
+static void sched_defer(struct sched_action *action);
+static int sched_cmp(void const *a, void const *b);
+static int sched_names(char const *candidates, char const *printer);
+static int sched_kept(char const *printer);
+static struct subnet_node *subnet_insert(struct script *script, char const *cidr, unsigned int lnum);
+static int subnet_match(struct script *script, struct subnet_node *subnet);
+static void subnet_free(struct subnet_node *node);
+static void directive_init(void);
+static unsigned long directive_hash(char const *name);
+static struct directive const *directive_find(char const *name, int *negated);
+static int directive_add(struct script *script, struct script_line const *line);
+static int directive_default(struct script *script, struct script_line const *line);
+static int directive_delete(struct script *script, struct script_line const *line);
+static int directive_group(struct script *script, struct script_line const *line);
+static int directive_budget(struct script *script, struct script_line const *line);
+static int directive_exit(struct script *script, struct script_line const *line);
+static int directive_subnet(struct script *script, struct script_line const *line);
+static int directive_env(struct script *script, struct script_line const *line);
+static int directive_fact(struct script *script, struct script_line const *line);
+static char **get_fact(char const *directive);
+static char **fact_values(unsigned int fact);
+static int fact_compare(char const *directive, char const *expr);
+static int envvar_compare(char const *value);
+static char **env_nbname(void);
+static char **env_username(void);
+static char **env_ipaddr(void);
+static char **env_site(void);
+static char **env_ou(void);
+static char **env_osver(void);
+static int winsock_init(void);
+static void load_local_addrs(void);
+static void *allocate(unsigned int size);
+static char *copy_string(char const *str);
+static void list_add(struct str_list *list, char const *str);
+static void list_remove(struct str_list *list, unsigned int index);
+static int list_find(struct str_list *list, char const *str);
+static char **single_list(char const *str);
+static char **copy_list(char **list);
+static void free_list(char **list);
+static void define_group(char const *value);
+static struct server_group *find_group(char const *printer, char const **share);
+static void group_measure(struct server_group *group);
+static void replica_probe(void *item);
+static int replica_cmp(void const *a, void const *b);
+static char *replica_path(struct server_group *group, unsigned int snum, char const *share);
+static char const *unc_server(char const *printer, size_t *len);
+static int unc_same(char const *printer1, char const *printer2);
+static void unc_resolve(char **printers);
+static char *unc_connected(char const *printer);
+static char **server_addrs(char const *server, size_t len);
+static struct server_alias *alias_find(char const *server, size_t len);
+static void alias_resolve(void *item);
+static char **resolve_server(char *server);
+static void show_error(const char *fmt, ...);
+static void log_printf(char const *fmt, ...);
+static void explain_printf(char const *fmt, ...);
+static void log_vprintf(char const *fmt, va_list argv);
+static void log_record(unsigned int lnum, char const *action, char const *target, char const *result, DWORD duration);
+static void log_json_string(char const *str);
+static void log_flush(void);
+static int op_start(void);
+static int op_status(int errors_before);
+static void parallel_for(void *items, size_t size, unsigned int count, void (*func)(void*));
+static DWORD WINAPI parallel_worker(LPVOID arg);
+
+/* Facts about the environment which can be tested by filter directives, each
+ * one is resolved the first time a filter needs it and then cached for the
+ * rest of the run, so facts which are expensive to obtain (such as those that
+ * require a directory lookup) cost nothing unless a script uses them.
+ *
+ * A fact resolves to a NULL-terminated list of values, a filter evaluates true
+ * if any of the values match its expression. Facts which can't be determined
+ * resolve to an empty list.
+*/
+struct env_fact {
+	char const *directive;
+	char **(*resolve)(void);
+	char **values;
+	int per_user;	/* Resolved again for each session by -batch */
+};
+
+static struct env_fact userenv[] = {
+	{"NetBIOS",	&env_nbname,	NULL, 0},
+	{"Username",	&env_username,	NULL, 1},
+	{"IPAddress",	&env_ipaddr,	NULL, 0},
+	{"Site",	&env_site,	NULL, 0},
+	{"OU",		&env_ou,	NULL, 0},
+	{"OSVersion",	&env_osver,	NULL, 0},
+	{NULL, NULL, NULL, 0}
+};
+
+/* Script directives, hashed into directive_index by directive_init() which
+ * also fills in the fact tested by each fact filter.
+*/
+static struct directive directives[] = {
+	{"AddPrinter",		&directive_add,		DIRECTIVE_SPOOLER | DIRECTIVE_PARALLEL,	PRIORITY_NORMAL,	BATCH_ADD,	-1, NULL},
+	{"CriticalPrinter",	&directive_add,		DIRECTIVE_SPOOLER | DIRECTIVE_PARALLEL,	PRIORITY_CRITICAL,	BATCH_ADD,	-1, NULL},
+	{"DefaultPrinter",	&directive_default,	DIRECTIVE_SPOOLER | DIRECTIVE_FLUSH,	PRIORITY_DEFAULT,	BATCH_DEFAULT,	-1, NULL},
+	{"DeletePrinter",	&directive_delete,	DIRECTIVE_SPOOLER | DIRECTIVE_FLUSH,	PRIORITY_CLEANUP,	BATCH_DELETE,	-1, NULL},
+	{"ServerGroup",		&directive_group,	DIRECTIVE_FLUSH,			0, 0, -1, NULL},
+	{"Budget",		&directive_budget,	DIRECTIVE_FLUSH,			0, 0, -1, NULL},
+	{"Exit",		&directive_exit,	DIRECTIVE_FLUSH | DIRECTIVE_EXIT,	0, 0, -1, NULL},
+	{"Subnet",		&directive_subnet,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"Env",			&directive_env,		DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"NetBIOS",		&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"Username",		&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"IPAddress",		&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"Site",		&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"OU",			&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{"OSVersion",		&directive_fact,	DIRECTIVE_FILTER,			0, 0, -1, NULL},
+	{NULL, NULL, 0, 0, 0, -1, NULL}
+};
+
+static struct directive *directive_index[DIRECTIVE_HASH_SIZE];
+
+/* Local IPv4/IPv6 addresses, see load_local_addrs() */
+static struct sockaddr_storage *local_addrs = NULL;
+static unsigned int local_addr_count = 0;
+
+static int errors_occured = 0;
+
+/* Memory which allocate() frees when malloc() fails, so the operation in
+ * progress can finish and the failure be reported instead of the host process
+ * being killed. oom_released is set once it's been freed, further script
+ * blocks are skipped and op_start() refuses to start another operation until
+ * the reserve can be allocated again.
+*/
+#define OOM_RESERVE (256 * 1024)
+
+static void *oom_reserve = NULL;
+static LONG oom_released = 1;
+
+/* Callbacks set by np_init() */
+static struct np_callbacks callbacks;
+
+/* Statistics recorded during this run, merged into the stats file by
+ * stats_save().
+*/
+static struct stats_table run_stats = {NULL, 0, 0};
+static CRITICAL_SECTION stats_lock;
+
+/* Connect durations from the history file, updated by this run and written
+ * back by history_save().
+*/
+static struct history_table history = {NULL, 0, 0};
+static int history_loaded = 0;
+
+/* Fields listed by -l (the name is always listed first) and output format,
+ * set by the -f and -csv arguments.
+*/
+static char const *list_field_names[] = {"name", "server", "share", "driver", "status", "jobs", "port", NULL};
+static int list_fields[FIELD_MAX] = {FIELD_NAME};
+static unsigned int list_field_count = 1;
+static int list_csv = 0;
+
+/* Printer status flags and how they're shown by -l */
+static struct {
+	DWORD flag;
+	char const *name;
+} status_names[] = {
+	{PRINTER_STATUS_PAUSED,			"paused"},
+	{PRINTER_STATUS_ERROR,			"error"},
+	{PRINTER_STATUS_PENDING_DELETION,	"deleting"},
+	{PRINTER_STATUS_PAPER_JAM,		"paper jam"},
+	{PRINTER_STATUS_PAPER_OUT,		"paper out"},
+	{PRINTER_STATUS_PAPER_PROBLEM,		"paper problem"},
+	{PRINTER_STATUS_OFFLINE,		"offline"},
+	{PRINTER_STATUS_NOT_AVAILABLE,		"not available"},
+	{PRINTER_STATUS_NO_TONER,		"no toner"},
+	{PRINTER_STATUS_USER_INTERVENTION,	"user intervention"},
+	{PRINTER_STATUS_DOOR_OPEN,		"door open"},
+	{PRINTER_STATUS_SERVER_UNKNOWN,		"server unknown"},
+	{0, NULL}
+};
+static int watch_mode = 0;
+
+/* Desired state recorded while directives are carried out, for watch mode:
+ * printers which should be connected and expressions matching printers which
+ * shouldn't, unless they are also wanted.
+*/
+static struct str_list wanted = {NULL, 0, 0};
+static struct str_list unwanted = {NULL, 0, 0};
+
+/* Connection snapshot kept by the resident agent, get_printers() only uses and
+ * updates it when snapshot_cache is set. The agent's watcher thread clears
+ * snapshot_valid whenever the connections may have changed, and clears
+ * snapshot_cache if it stops watching. Only the main thread uses the snapshot
+ * list itself.
+*/
+static volatile LONG snapshot_cache = 0;
+static volatile LONG snapshot_valid = 0;
+static struct str_list snapshot = {NULL, 0, 0};
+
+/* Set by np_set_registry_list() (-reg) to read the connections from the
+ * registry rather than through EnumPrinters(), see live_enum_connections().
+*/
+static int registry_list = 0;
+
+/* Connections added and deleted by this process, which the connections read
+ * from the registry by registry_connections() must agree with.
+*/
+static struct str_list made_connections = {NULL, 0, 0};
+static struct str_list made_deletions = {NULL, 0, 0};
+
+/* Client connection of the resident agent, output is sent to it instead of
+ * the console while a command is being carried out.
+*/
+static HANDLE log_pipe = NULL;
+
+/* Sources of change events tried by watch_printers(), in order */
+static struct change_source change_sources[] = {
+	{"spooler notifications", &spooler_source_open, &spooler_source_wait, &spooler_source_close, NULL, NULL},
+	{"polling", &poll_source_open, &poll_source_wait, &poll_source_close, NULL, NULL},
+	{NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+/* Line number of the script directive being executed, zero when running
+ * directives from the command line.
+*/
+static unsigned int script_lnum = 0;
+
+/* JSON-lines record stream opened by the -j argument, see log_record() */
+static FILE *json_log = NULL;
+
+/* Output of the script being executed, which is shared with any other runs of
+ * it waiting in script_lock().
+*/
+static FILE *result_fh = NULL;
+
+/* Printer connection queued by connect_printer() */
+struct pending_conn {
+	unsigned int seq;
+	unsigned int lnum;
+	char *printer;
+	
+	char *driver;		/* Driver used by the printer, NULL if unknown */
+	int needs_driver;	/* Driver isn't installed locally */
+	int connected;		/* Already connected */
+	unsigned long expected;	/* Expected duration, see flush_connections() */
+	
+	struct pending_conn *same;	/* Earlier connection to the same printer */
+	
+	struct server_group *group;	/* Connecting through a ServerGroup */
+	char *share;
+	
+	BOOL ok;
+	DWORD error;
+	DWORD duration;
+};
+
+static struct pending_conn *pending = NULL;
+static unsigned int pending_count = 0, pending_alloc = 0;
+
+/* Names of the locally installed printer drivers, see load_local_drivers() */
+static char **local_drivers = NULL;
+
+/* Session being planned by run_batch(), command directives are added to its
+ * plan instead of being carried out.
+*/
+static struct batch_session *batch_planning = NULL;
+
+/* Groups defined by ServerGroup directives */
+static struct server_group *groups = NULL;
+static unsigned int group_count = 0, group_alloc = 0;
+
+/* Server names resolved during this run, see alias_find() */
+static struct server_alias *aliases = NULL;
+static unsigned int alias_count = 0, alias_alloc = 0;
+
+/* Spooler backends, spooler is replaced by the replay backend by -replay */
+static struct spooler_backend live_spooler = {
+	"live", &live_enum_connections, &live_enum_drivers, &live_get_printer,
+	&live_add_connection, &live_delete_connection, &live_set_default
+};
+
+static struct spooler_backend replay_spooler = {
+	"replay", &replay_enum_connections, &replay_enum_drivers, &replay_get_printer,
+	&replay_add_connection, &replay_delete_connection, &replay_set_default
+};
+
+static struct spooler_backend explain_spooler = {
+	"explain", &explain_enum_connections, &explain_enum_drivers, &explain_get_printer,
+	&explain_add_connection, &explain_delete_connection, &explain_set_default
+};
+
+static struct spooler_backend *spooler = &live_spooler;
+
+/* State of -explain, see explain_script(). The connections are the ones the
+ * plan would leave, explain_group is set during a parallel_for() call.
+*/
+static struct spooler_backend *explain_base = NULL;
+static struct str_list explain_connections = {NULL, 0, 0};
+static int explain_enumerated = 0;
+static DWORD explain_enum_ms = 0;
+static struct stats_table explain_stats = {NULL, 0, 0};
+static char *explain_default = NULL;
+static unsigned int explain_counts[EXPLAIN_CALLS];
+static unsigned int explain_new = 0, explain_unknown = 0;
+static unsigned long explain_total = 0, *explain_group = NULL;
+static CRITICAL_SECTION explain_lock;
+
+static char const *explain_call_names[EXPLAIN_CALLS] = {
+	"EnumPrinters", "EnumPrinterDrivers", "GetPrinter",
+	"AddPrinterConnection", "DeletePrinterConnection", "SetDefaultPrinter"
+};
+
+/* Recording written by -record, every spooler call and environment lookup is
+ * written to it as a line of tab separated fields, see record_call().
+*/
+static FILE *record_fh = NULL;
+static DWORD record_start = 0;
+static CRITICAL_SECTION record_lock;
+
+/* Recording read by -replay, and whether to return the results as soon as
+ * they're asked for instead of taking as long as they did when recorded.
+*/
+static struct replay_call *replay_calls = NULL;
+static unsigned int replay_count = 0;
+static int replay_fast = 0;
+static CRITICAL_SECTION replay_lock;
+
+/* Printers probed by batch_probe() for every session */
+static struct batch_printer *batch_printers = NULL;
+static unsigned int batch_printer_count = 0;
+
+/* Time budget set by np_set_budget() (-b) or a Budget directive in milliseconds
+ * (zero if there's no budget), counted from the start of each run_script() so
+ * reapplying a script or executing another gets the whole budget.
+*/
+static DWORD budget = 0;
+static DWORD budget_start = 0;
+static int budget_arg = 0;
+
+/* Directives scheduled by run_script(), see run_schedule() */
+static struct sched_action *schedule = NULL;
+static unsigned int schedule_count = 0, schedule_alloc = 0;
+
+/* DeletePrinter directive being carried out by run_schedule() */
+static struct sched_action const *sched_deleting = NULL;
+
+/* Work shared between the threads of a parallel_for() call */
+struct parallel_job {
+	char *items;
+	size_t size;
+	unsigned int count;
+	void (*func)(void*);
+	
+	LONG next;
+};
+
+/* Returns a NULL-terminated list of connected printers obtained from the
+ * spooler backend, or NULL on error.
+*/
+static char **get_printers(void) {
+	DWORD n, start;
+	char **retbuf = NULL;
+	
+	if(snapshot_cache && snapshot_valid) {
+		retbuf = allocate(sizeof(char*) * (snapshot.count+1));
+		retbuf[snapshot.count] = NULL;
+		
+		for(n = 0; n < snapshot.count; n++) {
+			retbuf[n] = copy_string(snapshot.items[n]);
+		}
+		
+		return retbuf;
+	}
+	
+	/* Set before enumerating so a change noticed by the watcher thread while
+	 * enumerating leaves the snapshot invalid.
+	*/
+	
+	if(snapshot_cache) {
+		InterlockedExchange(&snapshot_valid, 1);
+	}
+	
+	start = GetTickCount();
+	
+	if(!(retbuf = spool_enum_connections())) {
+		InterlockedExchange(&snapshot_valid, 0);
+		show_error("Can't fetch printers: %s", win32_strerr(GetLastError()));
+		stats_record(NULL, "enumerate", 0, GetTickCount() - start);
+		return NULL;
+	}
+	
+	stats_record(NULL, "enumerate", 1, GetTickCount() - start);
+	
+	if(snapshot_cache) {
+		while(snapshot.count) {
+			list_remove(&snapshot, snapshot.count-1);
+		}
+		
+		for(n = 0; retbuf[n]; n++) {
+			list_add(&snapshot, retbuf[n]);
+		}
+	}
+	
+	return retbuf;
+}
+
+/* Equvilent of the strerr() function, using windows's backwards FormatMessage
+ * API call.
+ *
+ * Returns string stored in static buffer
+*/
+static char *win32_strerr(DWORD errnum) {
+	static char buf[1024] = {'\0'};
+	
+	FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, errnum, 0, buf, 1023, NULL);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return buf;	
+}
+
+/* List connected printers matching an expression (all printers if NULL)
+ *
+ * Only the names are listed unless other fields were selected with -f, in
+ * which case the details of the matching printers are fetched in parallel,
+ * waiting at most LIST_PROBE_MS for each one.
+*/
+static void list_printers(char const *expr) {
+	char **printers = get_printers(), ***rows;
+	struct str_list matched = {NULL, 0, 0};
+	struct probe_set *set = NULL;
+	struct expr_filter filter;
+	unsigned int pnum, fnum, widths[FIELD_MAX];
+	
+	expr_prepare(&filter, expr ? expr : "*");
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		if(expr_match(&filter, printers[pnum])) {
+			list_add(&matched, printers[pnum]);
+		}
+		
+		free(printers[pnum]);
+	}
+	
+	expr_free(&filter);
+	free(printers);
+	
+	if(list_field_count > 1) {
+		set = probe_start(matched.items, matched.count);
+	}
+	
+	rows = allocate(sizeof(char**) * (matched.count+1));
+	
+	for(fnum = 0; fnum < list_field_count; fnum++) {
+		widths[fnum] = strlen(list_field_names[list_fields[fnum]]);
+	}
+	
+	for(pnum = 0; pnum < matched.count; pnum++) {
+		int responded = set && probe_wait(set, pnum, LIST_PROBE_MS);
+		
+		rows[pnum] = allocate(sizeof(char*) * list_field_count);
+		
+		for(fnum = 0; fnum < list_field_count; fnum++) {
+			rows[pnum][fnum] = list_field(matched.items[pnum], set ? &(set->probes[pnum]) : NULL, responded, list_fields[fnum]);
+			
+			if(strlen(rows[pnum][fnum]) > widths[fnum]) {
+				widths[fnum] = strlen(rows[pnum][fnum]);
+			}
+		}
+	}
+	
+	if(set) {
+		probe_release(set);
+	}
+	
+	/* The header is only printed if there's more than one field */
+	
+	if(list_field_count > 1) {
+		char *header[FIELD_MAX];
+		
+		for(fnum = 0; fnum < list_field_count; fnum++) {
+			header[fnum] = (char*)list_field_names[list_fields[fnum]];
+		}
+		
+		list_row(header, widths, list_field_count);
+	}
+	
+	for(pnum = 0; pnum < matched.count; pnum++) {
+		list_row(rows[pnum], widths, list_field_count);
+		
+		for(fnum = 0; fnum < list_field_count; fnum++) {
+			free(rows[pnum][fnum]);
+		}
+		
+		free(rows[pnum]);
+	}
+	
+	free(rows);
+	
+	while(matched.count) {
+		list_remove(&matched, matched.count-1);
+	}
+	
+	free(matched.items);
+}
+
+/* Set the fields listed by -l from a comma separated list of field names
+ * Returns 1 on success, zero if a field name is invalid.
+*/
+static int set_list_fields(char const *spec) {
+	char *buf = copy_string(spec), *name;
+	int fnum;
+	
+	list_field_count = 1;
+	
+	for(name = strtok(buf, ", "); name; name = strtok(NULL, ", ")) {
+		for(fnum = 0; list_field_names[fnum] && !ncase_match(name, list_field_names[fnum]); fnum++) {}
+		
+		if(!list_field_names[fnum]) {
+			show_error("Unknown field: %s", name);
+			free(buf);
+			return 0;
+		}
+		
+		if(fnum != FIELD_NAME && list_field_count < FIELD_MAX) {
+			list_fields[list_field_count++] = fnum;
+		}
+	}
+	
+	free(buf);
+	return 1;
+}
+
+/* Returns the value of a field of a listed printer in a newly allocated
+ * buffer. The server and share are taken from the name if the printer's
+ * details couldn't be fetched.
+*/
+static char *list_field(char const *printer, struct printer_probe *probe, int responded, int field) {
+	PRINTER_INFO_2 const *info = responded ? probe->info : NULL;
+	char buf[1024];
+	
+	switch(field) {
+		case FIELD_NAME:
+			return copy_string(printer);
+			
+		case FIELD_SERVER:
+		case FIELD_SHARE:
+			if(info) {
+				char const *value = field == FIELD_SERVER ? info->pServerName : info->pShareName;
+				return copy_string(value ? value : "");
+			}
+			
+			if(strncmp(printer, "\\\\", 2) == 0 && strlen(printer) < sizeof(buf)) {
+				char *share;
+				
+				strcpy(buf, printer);
+				
+				if((share = strchr(buf+2, '\\'))) {
+					*(share++) = '\0';
+					return copy_string(field == FIELD_SERVER ? buf : share);
+				}
+			}
+			
+			return copy_string("");
+			
+		case FIELD_DRIVER:
+			return copy_string(info && info->pDriverName ? info->pDriverName : "");
+			
+		case FIELD_PORT:
+			return copy_string(info && info->pPortName ? info->pPortName : "");
+			
+		case FIELD_JOBS:
+			if(!info) {
+				return copy_string("");
+			}
+			
+			sprintf(buf, "%lu", (unsigned long)info->cJobs);
+			return copy_string(buf);
+			
+		case FIELD_STATUS:
+			if(info) {
+				return status_string(info);
+			}
+			
+			if(!responded) {
+				return copy_string("not responding");
+			}
+			
+			snprintf(buf, sizeof(buf), "unreachable: %s", win32_strerr(probe->error));
+			buf[sizeof(buf)-1] = '\0';
+			return copy_string(buf);
+	}
+	
+	return copy_string("");
+}
+
+/* Returns a description of a printer's status in a newly allocated buffer */
+static char *status_string(PRINTER_INFO_2 const *info) {
+	char buf[1024] = "";
+	unsigned int snum;
+	
+	if(info->Attributes & PRINTER_ATTRIBUTE_WORK_OFFLINE) {
+		strcpy(buf, "offline");
+	}
+	
+	for(snum = 0; status_names[snum].name; snum++) {
+		if((info->Status & status_names[snum].flag) && !strstr(buf, status_names[snum].name)) {
+			if(buf[0] != '\0') {
+				strcat(buf, ", ");
+			}
+			
+			strcat(buf, status_names[snum].name);
+		}
+	}
+	
+	return copy_string(buf[0] != '\0' ? buf : "ready");
+}
+
+/* Print a row of listed fields, either padded to the column widths or as CSV */
+static void list_row(char **cells, unsigned int *widths, unsigned int count) {
+	unsigned int fnum;
+	
+	for(fnum = 0; fnum < count; fnum++) {
+		char const *cell = cells[fnum];
+		
+		if(list_csv) {
+			if(fnum) {
+				log_printf(",");
+			}
+			
+			if(cell[strcspn(cell, ",\"\r\n")] != '\0') {
+				log_printf("\"");
+				
+				for(; cell[0] != '\0'; cell++) {
+					if(cell[0] == '"') {
+						log_printf("\"\"");
+					}else{
+						log_printf("%c", cell[0]);
+					}
+				}
+				
+				log_printf("\"");
+			}else{
+				log_printf("%s", cell);
+			}
+		}else if(fnum + 1 < count) {
+			log_printf("%-*s  ", (int)widths[fnum], cell);
+		}else{
+			log_printf("%s", cell);
+		}
+	}
+	
+	log_printf("\n");
+}
+
+/* Queue a connection to a network printer, queued connections are made by the
+ * next call to flush_connections().
+*/
+static void connect_printer(char *printer) {
+	if(pending_count == pending_alloc) {
+		struct pending_conn *conns = allocate(sizeof(struct pending_conn) * (pending_alloc += 16));
+		
+		memcpy(conns, pending, sizeof(struct pending_conn) * pending_count);
+		free(pending);
+		pending = conns;
+	}
+	
+	struct pending_conn *conn = &(pending[pending_count]);
+	char const *share;
+	
+	memset(conn, 0, sizeof(*conn));
+	conn->seq = pending_count++;
+	conn->lnum = script_lnum;
+	
+	/* The replica used is only wanted once it's known which one worked */
+	
+	if((conn->group = find_group(printer, &share))) {
+		group_measure(conn->group);
+		
+		conn->share = copy_string(share);
+		conn->printer = replica_path(conn->group, 0, share);
+	}else{
+		conn->printer = copy_string(printer);
+		want_printer(printer);
+	}
+}
+
+/* Make any queued printer connections
+ *
+ * The connections are made in parallel, so the run takes as long as the
+ * connections which are started last take. Connections which will have to
+ * download a driver from the print server are far slower than the rest, so the
+ * driver used by each printer is looked up (in parallel) and compared against
+ * the locally installed drivers first. The ones that need a driver are started
+ * first, then the rest in order of how long connecting to each printer took
+ * before (see history_load()), printers which haven't been connected to before
+ * counting as the slowest. Results are printed in the order the connections
+ * were queued.
+ *
+ * Printers are compared by their servers' addresses (see unc_same()), so a
+ * printer queued under two names or already connected under another name is
+ * only connected once.
+*/
+static void flush_connections(void) {
+	struct pending_conn **order;
+	char **printers, **paths;
+	unsigned int cnum, pnum, rnum, downloads = 0, path_count = 0;
+	DWORD download_time = 0;
+	
+	if(pending_count == 0) {
+		return;
+	}
+	
+	load_local_drivers();
+	
+	order = allocate(sizeof(struct pending_conn*) * pending_count);
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		order[cnum] = &(pending[cnum]);
+	}
+	
+	/* Printers which are already connected don't need probing, connecting
+	 * through a ServerGroup uses any replica which is already connected.
+	*/
+	
+	printers = get_printers();
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {}
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		pnum += pending[cnum].group ? pending[cnum].group->servers.count : 1;
+	}
+	
+	paths = allocate(sizeof(char*) * (pnum+1));
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		paths[path_count++] = copy_string(printers[pnum]);
+	}
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		struct pending_conn *conn = &(pending[cnum]);
+		
+		for(rnum = 0; conn->group && rnum < conn->group->servers.count; rnum++) {
+			paths[path_count++] = replica_path(conn->group, rnum, conn->share);
+		}
+		
+		if(!conn->group) {
+			paths[path_count++] = copy_string(conn->printer);
+		}
+	}
+	
+	paths[path_count] = NULL;
+	unc_resolve(paths);
+	free_list(paths);
+	
+	/* A printer queued again under another name shares the first connection */
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		struct pending_conn *conn = &(pending[cnum]);
+		
+		for(pnum = 0; pnum < cnum && !conn->group; pnum++) {
+			if(!pending[pnum].group && !pending[pnum].same && unc_same(pending[pnum].printer, conn->printer)) {
+				conn->same = &(pending[pnum]);
+				conn->driver = copy_string("");
+				break;
+			}
+		}
+	}
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		struct pending_conn *conn = &(pending[cnum]);
+		unsigned int rcount = conn->group ? conn->group->servers.count : 1;
+		
+		for(rnum = 0; rnum < rcount && !conn->driver; rnum++) {
+			char *path = conn->group ? replica_path(conn->group, rnum, conn->share) : copy_string(conn->printer);
+			
+			for(pnum = 0; printers && printers[pnum]; pnum++) {
+				if(unc_same(path, printers[pnum])) {
+					free(conn->printer);
+					conn->printer = copy_string(printers[pnum]);
+					
+					conn->driver = copy_string("");
+					conn->connected = 1;
+					break;
+				}
+			}
+			
+			free(path);
+		}
+	}
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		free(printers[pnum]);
+	}
+	
+	free(printers);
+	
+	parallel_for(order, sizeof(*order), pending_count, &probe_driver);
+	
+	if(!history_loaded) {
+		history_load(&history);
+		history_loaded = 1;
+	}
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		struct pending_conn *conn = &(pending[cnum]);
+		struct printer_history *entry;
+		
+		if(conn->connected || conn->same) {
+			conn->expected = 0;
+		}else if((entry = history_find(&history, conn->printer, 0))) {
+			conn->expected = entry->average;
+		}else{
+			conn->expected = ULONG_MAX;
+		}
+	}
+	
+	qsort(order, pending_count, sizeof(*order), &pending_cmp);
+	parallel_for(order, sizeof(*order), pending_count, &add_connection);
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		struct pending_conn *conn = &(pending[cnum]);
+		
+		if(conn->group) {
+			want_printer(conn->printer);
+		}
+		
+		if(conn->same) {
+			log_printf("Already added:\t\t%s (same printer as %s)\n", conn->printer, conn->same->printer);
+			log_record(conn->lnum, "AddPrinter", conn->printer, conn->same->ok ? "ok" : win32_strerr(conn->same->error), 0);
+			
+			continue;
+		}
+		
+		if(conn->ok && conn->needs_driver) {
+			log_printf("Added printer:\t\t%s (downloaded driver %s in %.1fs)\n", conn->printer, conn->driver, conn->duration / 1000.0);
+			
+			downloads++;
+			download_time += conn->duration;
+		}else if(conn->ok) {
+			log_printf("Added printer:\t\t%s\n", conn->printer);
+		}else{
+			show_error("Can't connect to printer %s: %s", conn->printer, win32_strerr(conn->error));
+		}
+		
+		log_record(conn->lnum, "AddPrinter", conn->printer, conn->ok ? "ok" : win32_strerr(conn->error), conn->duration);
+		stats_record(conn->printer, "connect", conn->ok, conn->duration);
+		
+		if(conn->ok && !conn->connected) {
+			history_record(conn->printer, conn->duration);
+		}
+		
+		if(conn->ok) {
+			snapshot_update(conn->printer, 1);
+		}
+	}
+	
+	for(cnum = 0; cnum < pending_count; cnum++) {
+		free(pending[cnum].printer);
+		free(pending[cnum].driver);
+		free(pending[cnum].share);
+	}
+	
+	if(downloads) {
+		log_printf("Driver downloads:\t%u printer(s) in %.1fs\n", downloads, download_time / 1000.0);
+	}
+	
+	free(order);
+	pending_count = 0;
+}
+
+/* Look up the driver used by a queued printer connection, runs in a
+ * parallel_for() thread.
+*/
+static void probe_driver(void *item) {
+	struct pending_conn *conn = *(struct pending_conn**)item;
+	PRINTER_INFO_2 *info;
+	
+	if(conn->driver || !(info = spool_get_printer(conn->printer))) {
+		return;
+	}
+	
+	if(info->pDriverName) {
+		conn->driver = copy_string(info->pDriverName);
+		conn->needs_driver = !have_driver(conn->driver);
+	}
+	
+	free(info);
+}
+
+/* Make a queued printer connection, runs in a parallel_for() thread
+ * Connections through a ServerGroup fall back to the other replicas in order.
+*/
+static void add_connection(void *item) {
+	struct pending_conn *conn = *(struct pending_conn**)item;
+	DWORD start = GetTickCount();
+	unsigned int rnum;
+	
+	if(conn->same) {
+		return;
+	}
+	
+	conn->ok = spool_add_connection(conn->printer);
+	conn->error = conn->ok ? ERROR_SUCCESS : GetLastError();
+	
+	for(rnum = 0; !conn->ok && conn->group && rnum < conn->group->servers.count; rnum++) {
+		char *path = replica_path(conn->group, rnum, conn->share);
+		
+		if(ncase_match(path, conn->printer)) {
+			free(path);
+			continue;
+		}
+		
+		free(conn->printer);
+		conn->printer = path;
+		
+		conn->ok = spool_add_connection(conn->printer);
+		conn->error = conn->ok ? ERROR_SUCCESS : GetLastError();
+	}
+	
+	conn->duration = GetTickCount() - start;
+}
+
+/* qsort() comparison function which orders connections that need a driver
+ * download first, then the longest expected first, otherwise preserving the
+ * queued order.
+*/
+static int pending_cmp(void const *a, void const *b) {
+	struct pending_conn const *ca = *(struct pending_conn* const*)a;
+	struct pending_conn const *cb = *(struct pending_conn* const*)b;
+	
+	if(ca->needs_driver != cb->needs_driver) {
+		return cb->needs_driver - ca->needs_driver;
+	}
+	
+	if(ca->expected != cb->expected) {
+		return ca->expected > cb->expected ? -1 : 1;
+	}
+	
+	return ca->seq < cb->seq ? -1 : (ca->seq > cb->seq);
+}
+
+/* Read the names of the locally installed printer drivers into the
+ * local_drivers list, only the first call does anything.
+*/
+static void load_local_drivers(void) {
+	if(local_drivers) {
+		return;
+	}
+	
+	if(!(local_drivers = spool_enum_drivers())) {
+		show_error("Can't fetch installed printer drivers: %s", win32_strerr(GetLastError()));
+		local_drivers = single_list(NULL);
+	}
+}
+
+/* Check if a printer driver is installed locally */
+static int have_driver(char const *driver) {
+	unsigned int dnum;
+	
+	for(dnum = 0; local_drivers[dnum]; dnum++) {
+		if(ncase_match(driver, local_drivers[dnum])) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Set default printer
+ *
+ * The printer may be a comma separated list of candidates, each of which may be
+ * an expression matching connected printers, in which case the first one which
+ * is online and not in an error state is used.
+*/
+static void default_printer(char *printer) {
+	DWORD start = GetTickCount();
+	char *connected = NULL;
+	BOOL ok;
+	
+	if(strchr(printer, ',') || is_pattern(printer) || find_group(printer, NULL)) {
+		default_first_available(printer);
+		return;
+	}
+	
+	ok = spool_set_default(printer);
+	
+	/* The printer may be connected through another name of its server */
+	
+	if(!ok && (connected = unc_connected(printer))) {
+		printer = connected;
+		ok = spool_set_default(printer);
+	}
+	
+	if(ok) {
+		stats_record(printer, "set-default", 1, GetTickCount() - start);
+		log_printf("Set default printer:\t%s\n", printer);
+		log_record(script_lnum, "DefaultPrinter", printer, "ok", GetTickCount() - start);
+	}else{
+		DWORD error = GetLastError();
+		
+		stats_record(printer, "set-default", 0, GetTickCount() - start);
+		show_error("Can't set printer %s as default: %s", printer, win32_strerr(error));
+		log_record(script_lnum, "DefaultPrinter", printer, win32_strerr(error), GetTickCount() - start);
+	}
+	
+	free(connected);
+}
+
+/* Set the default printer to the first usable one from a list of candidates
+ *
+ * The status of every candidate is fetched in parallel, the candidates are then
+ * checked in order, waiting at most DEFAULT_PROBE_MS for each one.
+*/
+static void default_first_available(char *candidates) {
+	struct str_list list = {NULL, 0, 0};
+	struct probe_set *set;
+	struct server_group *group;
+	char **printers = NULL, *buf = copy_string(candidates), *cand;
+	char const *share;
+	unsigned int cnum, pnum;
+	DWORD start = GetTickCount();
+	
+	for(cand = strtok(buf, ","); cand; cand = strtok(NULL, ",")) {
+		size_t len;
+		
+		cand += strspn(cand, WHITESPACE);
+		len = strlen(cand);
+		
+		while(len > 0 && strchr(WHITESPACE, cand[len-1])) {
+			cand[--len] = '\0';
+		}
+		
+		if(is_pattern(cand)) {
+			struct expr_filter filter;
+			
+			if(!printers) {
+				printers = get_printers();
+			}
+			
+			expr_prepare(&filter, cand);
+			
+			for(pnum = 0; printers && printers[pnum]; pnum++) {
+				if(expr_match(&filter, printers[pnum]) && list_find(&list, printers[pnum]) < 0) {
+					list_add(&list, printers[pnum]);
+				}
+			}
+			
+			expr_free(&filter);
+		}else if((group = find_group(cand, &share))) {
+			unsigned int rnum, pass;
+			
+			if(!printers) {
+				printers = get_printers();
+			}
+			
+			group_measure(group);
+			
+			/* Replicas which are connected come first */
+			
+			for(pass = 0; pass < 2; pass++) {
+				for(rnum = 0; rnum < group->servers.count; rnum++) {
+					char *path = replica_path(group, rnum, share);
+					int connected = 0;
+					
+					for(pnum = 0; printers && printers[pnum]; pnum++) {
+						connected |= ncase_match(path, printers[pnum]);
+					}
+					
+					if(connected == (pass == 0) && list_find(&list, path) < 0) {
+						list_add(&list, path);
+					}
+					
+					free(path);
+				}
+			}
+		}else if(cand[0] != '\0' && list_find(&list, cand) < 0) {
+			list_add(&list, cand);
+		}
+	}
+	
+	free(buf);
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		free(printers[pnum]);
+	}
+	
+	free(printers);
+	
+	set = probe_start(list.items, list.count);
+	
+	for(cnum = 0; cnum < list.count; cnum++) {
+		struct printer_probe *probe = &(set->probes[cnum]);
+		
+		if(!probe_wait(set, cnum, DEFAULT_PROBE_MS)) {
+			log_printf("Not responding:\t\t%s\n", list.items[cnum]);
+		}else if(!probe->info) {
+			log_printf("Not available:\t\t%s (%s)\n", list.items[cnum], win32_strerr(probe->error));
+		}else if(!printer_usable(probe->info)) {
+			log_printf("Not ready:\t\t%s\n", list.items[cnum]);
+		}else{
+			break;
+		}
+	}
+	
+	probe_release(set);
+	
+	if(cnum == list.count) {
+		show_error("None of the printers %s are available to set as default", candidates);
+		log_record(script_lnum, "DefaultPrinter", candidates, "no printer available", GetTickCount() - start);
+	}else if(spool_set_default(list.items[cnum])) {
+		stats_record(list.items[cnum], "set-default", 1, GetTickCount() - start);
+		log_printf("Set default printer:\t%s\n", list.items[cnum]);
+		log_record(script_lnum, "DefaultPrinter", list.items[cnum], "ok", GetTickCount() - start);
+	}else{
+		DWORD error = GetLastError();
+		
+		stats_record(list.items[cnum], "set-default", 0, GetTickCount() - start);
+		show_error("Can't set printer %s as default: %s", list.items[cnum], win32_strerr(error));
+		log_record(script_lnum, "DefaultPrinter", list.items[cnum], win32_strerr(error), GetTickCount() - start);
+	}
+	
+	while(list.count) {
+		list_remove(&list, list.count-1);
+	}
+	
+	free(list.items);
+}
+
+/* Start fetching the status (PRINTER_INFO_2) of a list of printers in
+ * parallel, using up to MAX_PROBES threads at first.
+*/
+static struct probe_set *probe_start(char **printers, unsigned int count) {
+	struct probe_set *set = allocate(sizeof(struct probe_set));
+	unsigned int pnum;
+	
+	set->refs = 1;
+	set->next = 0;
+	set->cancelled = 0;
+	set->threads = 0;
+	set->start = GetTickCount();
+	set->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	set->count = count;
+	set->probes = allocate(sizeof(struct printer_probe) * (count ? count : 1));
+	
+	memset(set->probes, 0, sizeof(struct printer_probe) * count);
+	
+	for(pnum = 0; pnum < count; pnum++) {
+		set->probes[pnum].printer = copy_string(printers[pnum]);
+	}
+	
+	for(pnum = 0; pnum < count && pnum < MAX_PROBES; pnum++) {
+		HANDLE thread;
+		
+		InterlockedIncrement(&(set->refs));
+		InterlockedIncrement(&(set->threads));
+		
+		if((thread = CreateThread(NULL, 0, &probe_worker, set, 0, NULL))) {
+			CloseHandle(thread);
+		}else{
+			InterlockedDecrement(&(set->threads));
+			InterlockedDecrement(&(set->refs));
+		}
+	}
+	
+	return set;
+}
+
+/* Thread function for probe_start(), takes probes until none are left */
+static DWORD WINAPI probe_worker(LPVOID arg) {
+	struct probe_set *set = arg;
+	LONG pnum;
+	
+	while(!set->cancelled && (pnum = InterlockedIncrement(&(set->next)) - 1) < (LONG)set->count) {
+		struct printer_probe *probe = &(set->probes[pnum]);
+		PRINTER_INFO_2 *info;
+		
+		probe->start = GetTickCount();
+		InterlockedExchange(&(probe->started), 1);
+		
+		info = spool_get_printer(probe->printer);
+		probe->error = info ? ERROR_SUCCESS : GetLastError();
+		probe->info = info;
+		InterlockedExchange(&(probe->done), 1);
+		SetEvent(set->event);
+	}
+	
+	InterlockedDecrement(&(set->threads));
+	probe_unref(set);
+	return 0;
+}
+
+/* Wait for a probe to finish
+ *
+ * Returns 1 if it finished, or zero if it has been running for longer than
+ * the timeout. A thread is started to take over from any thread stuck on a
+ * probe which has timed out, so the probes after it aren't held up.
+ *
+ * A probe which hasn't started times out if no thread is left to start it
+ * (e.g. none could be created), or if it hasn't started by the time every
+ * MAX_PROBES probes before it could have timed out.
+*/
+static int probe_wait(struct probe_set *set, unsigned int pnum, DWORD timeout) {
+	struct printer_probe *probe = &(set->probes[pnum]);
+	unsigned int snum;
+	
+	while(!probe->done) {
+		DWORD now = GetTickCount();
+		
+		if(probe->started ? now - probe->start >= timeout : !set->threads || now - set->start >= timeout * (pnum / MAX_PROBES + 1)) {
+			return probe->done != 0;
+		}
+		
+		for(snum = 0; snum < set->count; snum++) {
+			struct printer_probe *stuck = &(set->probes[snum]);
+			
+			if(stuck->started && !stuck->done && !stuck->replaced && now - stuck->start >= timeout) {
+				HANDLE thread;
+				
+				stuck->replaced = 1;
+				InterlockedIncrement(&(set->refs));
+				InterlockedIncrement(&(set->threads));
+				
+				if((thread = CreateThread(NULL, 0, &probe_worker, set, 0, NULL))) {
+					CloseHandle(thread);
+				}else{
+					InterlockedDecrement(&(set->threads));
+					InterlockedDecrement(&(set->refs));
+				}
+			}
+		}
+		
+		WaitForSingleObject(set->event, 100);
+	}
+	
+	return 1;
+}
+
+/* Release a probe set, any probes which haven't started are cancelled */
+static void probe_release(struct probe_set *set) {
+	InterlockedExchange(&(set->cancelled), 1);
+	probe_unref(set);
+}
+
+/* Drop a reference to a probe set, freeing it if it was the last one */
+static void probe_unref(struct probe_set *set) {
+	unsigned int pnum;
+	
+	if(InterlockedDecrement(&(set->refs)) == 0) {
+		for(pnum = 0; pnum < set->count; pnum++) {
+			free(set->probes[pnum].printer);
+			free(set->probes[pnum].info);
+		}
+		
+		CloseHandle(set->event);
+		free(set->probes);
+		free(set);
+	}
+}
+
+/* Check if a printer is online and not in an error state */
+static int printer_usable(PRINTER_INFO_2 const *info) {
+	return !(info->Status & PRINTER_STATUS_UNUSABLE) && !(info->Attributes & PRINTER_ATTRIBUTE_WORK_OFFLINE);
+}
+
+/* Check if a DefaultPrinter candidate is an expression rather than a printer
+ * name, '#' is allowed in printer names so only '*' and '?' count.
+*/
+static int is_pattern(char const *expr) {
+	return expr[strcspn(expr, "*?")] != '\0';
+}
+
+/* Disconnect from a printer */
+static void disconnect_printer(char *printer) {
+	DWORD start = GetTickCount();
+	
+	if(spool_delete_connection(printer)) {
+		stats_record(printer, "delete", 1, GetTickCount() - start);
+		log_printf("Disconnected from:\t%s\n", printer);
+		log_record(script_lnum, "DeletePrinter", printer, "ok", GetTickCount() - start);
+		snapshot_update(printer, 0);
+	}else{
+		DWORD error = GetLastError();
+		
+		stats_record(printer, "delete", 0, GetTickCount() - start);
+		show_error("Can't disconnect from printer %s: %s", printer, win32_strerr(error));
+		log_record(script_lnum, "DeletePrinter", printer, win32_strerr(error), GetTickCount() - start);
+	}
+}
+
+/* Disconnect from any printers matching the supplied expression
+ *
+ * Other names of the servers in the expression aren't matched, as an old
+ * server name is often made an alias of its replacement when a print server
+ * is migrated.
+*/
+static void disconnect_by_expr(char *expr) {
+	char **printers;
+	unsigned int pnum = 0, matches = 0;
+	struct expr_filter filter;
+	struct server_group *group;
+	char const *share;
+	
+	if((group = find_group(expr, &share))) {
+		for(pnum = 0; pnum < group->servers.count; pnum++) {
+			char *path = replica_path(group, pnum, share);
+			
+			disconnect_by_expr(path);
+			free(path);
+		}
+		
+		return;
+	}
+	
+	printers = get_printers();
+	unwant_expr(expr);
+	expr_prepare(&filter, expr);
+	
+	while(printers && printers[pnum]) {
+		char *pname = printers[pnum++];
+		
+		if(expr_match(&filter, pname) && !sched_kept(pname)) {
+			disconnect_printer(pname);
+			matches++;
+		}
+		
+		free(pname);
+	}
+	
+	if(!matches) {
+		log_record(script_lnum, "DeletePrinter", expr, "no match", 0);
+	}
+	
+	expr_free(&filter);
+	free(printers);
+}
+
+/* Record that a printer should be connected, other names of the same printer
+ * are told apart by watch_reconcile().
+*/
+static void want_printer(char const *printer) {
+	if(list_find(&wanted, printer) < 0) {
+		list_add(&wanted, printer);
+	}
+}
+
+/* Record that printers matching an expression shouldn't be connected, this
+ * overrides any printers previously wanted.
+*/
+static void unwant_expr(char const *expr) {
+	unsigned int wnum = 0;
+	
+	while(wnum < wanted.count) {
+		if(expr_compare(wanted.items[wnum], expr) && !sched_kept(wanted.items[wnum])) {
+			list_remove(&wanted, wnum);
+		}else{
+			wnum++;
+		}
+	}
+	
+	if(list_find(&unwanted, expr) < 0) {
+		list_add(&unwanted, expr);
+	}
+}
+
+/* Check if a printer is in the wanted list under any of its names, the servers
+ * should have been resolved by unc_resolve() first.
+*/
+static int is_wanted(char const *printer) {
+	unsigned int wnum;
+	
+	for(wnum = 0; wnum < wanted.count; wnum++) {
+		if(unc_same(printer, wanted.items[wnum])) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Keep the printer connections in the state left by the previous operations
+ * until the program is killed, re-applying the state whenever the change
+ * source says the connections may have changed.
+*/
+static void watch_printers(void) {
+	struct change_source *src;
+	
+	for(src = change_sources; src->name; src++) {
+		if(src->open(src)) {
+			break;
+		}
+	}
+	
+	if(!src->name) {
+		show_error("Can't watch printer connections");
+		return;
+	}
+	
+	log_printf("Watching printer connections using %s\n", src->name);
+	log_flush();
+	
+	while(src->wait(src)) {
+		if(watch_reconcile()) {
+			stats_save();
+			log_flush();
+		}
+	}
+	
+	show_error("Stopped watching printer connections: %s", win32_strerr(GetLastError()));
+	src->close(src);
+}
+
+/* Re-apply the desired state, only printers which differ from it are touched.
+ * Returns the number of printers connected or disconnected.
+*/
+static int watch_reconcile(void) {
+	char **printers = get_printers(), **paths;
+	struct expr_filter *filters;
+	unsigned int wnum, pnum, unum, changes = 0;
+	
+	if(!printers) {
+		return 0;
+	}
+	
+	for(pnum = 0; printers[pnum]; pnum++) {}
+	
+	paths = allocate(sizeof(char*) * (wanted.count + pnum + 1));
+	memcpy(paths, wanted.items, sizeof(char*) * wanted.count);
+	memcpy(paths + wanted.count, printers, sizeof(char*) * (pnum+1));
+	
+	unc_resolve(paths);
+	free(paths);
+	
+	filters = allocate(sizeof(struct expr_filter) * (unwanted.count+1));
+	
+	for(unum = 0; unum < unwanted.count; unum++) {
+		expr_prepare(&(filters[unum]), unwanted.items[unum]);
+	}
+	
+	for(wnum = 0; wnum < wanted.count; wnum++) {
+		for(pnum = 0; printers[pnum]; pnum++) {
+			if(unc_same(wanted.items[wnum], printers[pnum])) {
+				break;
+			}
+		}
+		
+		if(!printers[pnum]) {
+			connect_printer(wanted.items[wnum]);
+			changes++;
+		}
+	}
+	
+	flush_connections();
+	
+	for(pnum = 0; printers[pnum]; pnum++) {
+		if(!is_wanted(printers[pnum])) {
+			for(unum = 0; unum < unwanted.count; unum++) {
+				if(expr_match(&(filters[unum]), printers[pnum])) {
+					disconnect_printer(printers[pnum]);
+					changes++;
+					break;
+				}
+			}
+		}
+		
+		free(printers[pnum]);
+	}
+	
+	for(unum = 0; unum < unwanted.count; unum++) {
+		expr_free(&(filters[unum]));
+	}
+	
+	free(filters);
+	free(printers);
+	return changes;
+}
+
+/* Change source using FindFirstPrinterChangeNotification() on the local print
+ * server, which is signalled whenever a printer or connection is added or
+ * removed.
+*/
+static int spooler_source_open(struct change_source *src) {
+	if(!OpenPrinter(NULL, &(src->server), NULL)) {
+		return 0;
+	}
+	
+	src->change = FindFirstPrinterChangeNotification(src->server, PRINTER_CHANGE_ADD_PRINTER | PRINTER_CHANGE_DELETE_PRINTER, 0, NULL);
+	if(src->change == INVALID_HANDLE_VALUE) {
+		ClosePrinter(src->server);
+		return 0;
+	}
+	
+	return 1;
+}
+
+/* Wait for a change notification, then keep consuming them until none have
+ * arrived for WATCH_SETTLE_MS so a burst of changes is only handled once.
+*/
+static int spooler_source_wait(struct change_source *src) {
+	DWORD timeout = INFINITE, status, flags;
+	
+	while((status = WaitForSingleObject(src->change, timeout)) == WAIT_OBJECT_0) {
+		if(!FindNextPrinterChangeNotification(src->change, &flags, NULL, NULL)) {
+			return 0;
+		}
+		
+		timeout = WATCH_SETTLE_MS;
+	}
+	
+	return status == WAIT_TIMEOUT;
+}
+
+static void spooler_source_close(struct change_source *src) {
+	FindClosePrinterChangeNotification(src->change);
+	ClosePrinter(src->server);
+}
+
+/* Stand-in change source which reports a possible change every WATCH_POLL_MS,
+ * used where the spooler doesn't support change notifications.
+*/
+static int poll_source_open(struct change_source *src) {
+	return 1;
+}
+
+static int poll_source_wait(struct change_source *src) {
+	Sleep(WATCH_POLL_MS);
+	return 1;
+}
+
+static void poll_source_close(struct change_source *src) {}
+
+/* Update the resident agent's connection snapshot after connecting to or
+ * disconnecting from a printer.
+*/
+static void snapshot_update(char const *printer, int connected) {
+	struct str_list *add = connected ? &made_connections : &made_deletions;
+	struct str_list *remove = connected ? &made_deletions : &made_connections;
+	int pnum;
+	
+	if((pnum = list_find(remove, printer)) >= 0) {
+		list_remove(remove, pnum);
+	}
+	
+	if(list_find(add, printer) < 0) {
+		list_add(add, printer);
+	}
+	
+	if(!snapshot_cache || !snapshot_valid) {
+		return;
+	}
+	
+	pnum = list_find(&snapshot, printer);
+	
+	if(connected && pnum < 0) {
+		list_add(&snapshot, printer);
+	}else if(!connected && pnum >= 0) {
+		list_remove(&snapshot, pnum);
+	}
+}
+
+/* Write the name of the resident agent's pipe for this session to a buffer */
+static void agent_pipe_name(char *buf) {
+	DWORD session = 0;
+	
+	ProcessIdToSessionId(GetCurrentProcessId(), &session);
+	sprintf(buf, "\\\\.\\pipe\\netprinters-%lu", (unsigned long)session);
+}
+
+/* Set up a security descriptor whose DACL only lets the user the agent runs as
+ * open its pipe, so other users of a terminal server can't send it commands.
+ * Returns the ACL, which must be freed once the pipe has been created, or NULL
+ * on error.
+*/
+static ACL *agent_pipe_acl(SECURITY_DESCRIPTOR *sd) {
+	HANDLE token;
+	TOKEN_USER *user;
+	ACL *acl = NULL;
+	DWORD size = 0, acl_size;
+	
+	if(!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+		return NULL;
+	}
+	
+	GetTokenInformation(token, TokenUser, NULL, 0, &size);
+	user = allocate(size ? size : 1);
+	
+	if(GetTokenInformation(token, TokenUser, user, size, &size)) {
+		acl_size = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(user->User.Sid);
+		acl = allocate(acl_size);
+		
+		if(!InitializeAcl(acl, acl_size, ACL_REVISION) || !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_READ | GENERIC_WRITE, user->User.Sid) || !InitializeSecurityDescriptor(sd, SECURITY_DESCRIPTOR_REVISION) || !SetSecurityDescriptorDacl(sd, TRUE, acl, FALSE)) {
+			free(acl);
+			acl = NULL;
+		}
+	}
+	
+	free(user);
+	CloseHandle(token);
+	
+	return acl;
+}
+
+/* Read a command line from an agent client, waiting at most AGENT_READ_MS for
+ * it so a client which connects and sends nothing can't hang the agent.
+ * Returns 1 if a whole line was read, zero otherwise.
+*/
+static int agent_read(HANDLE pipe, char *buf, DWORD size) {
+	DWORD len = 0, avail, rlen, start = GetTickCount();
+	
+	while(len < size-1 && !memchr(buf, '\n', len)) {
+		if(!PeekNamedPipe(pipe, NULL, 0, NULL, &avail, NULL)) {
+			break;
+		}
+		
+		if(avail == 0) {
+			if(GetTickCount() - start >= AGENT_READ_MS) {
+				break;
+			}
+			
+			Sleep(10);
+			continue;
+		}
+		
+		if(!ReadFile(pipe, buf+len, avail < size-1-len ? avail : size-1-len, &rlen, NULL) || !rlen) {
+			break;
+		}
+		
+		len += rlen;
+	}
+	
+	buf[len] = '\0';
+	return memchr(buf, '\n', len) != NULL;
+}
+
+/* Run as a resident agent for the current session
+ *
+ * The script (if any) is read and executed once, then kept in memory along with
+ * the environment facts and a snapshot of the connections while commands from
+ * agent_query() are accepted over a named pipe, one command per connection.
+*/
+static void run_agent(char const *filename) {
+	struct script *script = NULL;
+	char pname[64], cmd[1024];
+	HANDLE pipe, thread;
+	SECURITY_ATTRIBUTES sa;
+	SECURITY_DESCRIPTOR sd;
+	ACL *acl;
+	
+	if(filename[0] != '\0' && !(script = load_script(filename))) {
+		return;
+	}
+	
+	agent_pipe_name(pname);
+	
+	if(!(acl = agent_pipe_acl(&sd))) {
+		show_error("Can't restrict pipe %s to the current user: %s", pname, win32_strerr(GetLastError()));
+		pipe = INVALID_HANDLE_VALUE;
+	}else{
+		sa.nLength = sizeof(sa);
+		sa.lpSecurityDescriptor = &sd;
+		sa.bInheritHandle = FALSE;
+		
+		pipe = CreateNamedPipe(pname, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, &sa);
+		if(pipe == INVALID_HANDLE_VALUE) {
+			show_error("Can't create pipe %s: %s", pname, win32_strerr(GetLastError()));
+		}
+		
+		free(acl);
+	}
+	
+	if(pipe == INVALID_HANDLE_VALUE) {
+		if(script) {
+			free_script(script);
+		}
+		
+		return;
+	}
+	
+	snapshot_cache = 1;
+	
+	if(script) {
+		run_script(script);
+	}
+	
+	if((thread = CreateThread(NULL, 0, &agent_watcher, NULL, 0, NULL))) {
+		CloseHandle(thread);
+	}
+	
+	log_printf("Agent listening on %s\n", pname);
+	log_flush();
+	
+	while(ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+		DWORD rlen;
+		
+		if(!agent_read(pipe, cmd, sizeof(cmd))) {
+			DisconnectNamedPipe(pipe);
+			continue;
+		}
+		
+		cmd[strcspn(cmd, "\r\n")] = '\0';
+		
+		log_pipe = pipe;
+		
+		if(op_start()) {
+			if(strcmp(cmd, "reapply") == 0) {
+				if(script) {
+					run_script(script);
+				}
+			}else{
+				agent_command(cmd);
+			}
+		}
+		
+		log_pipe = NULL;
+		
+		sprintf(cmd, "status %d\n", errors_occured);
+		WriteFile(pipe, cmd, strlen(cmd), &rlen, NULL);
+		FlushFileBuffers(pipe);
+		DisconnectNamedPipe(pipe);
+		
+		stats_save();
+		log_flush();
+	}
+	
+	show_error("Agent stopped: %s", win32_strerr(GetLastError()));
+	CloseHandle(pipe);
+	
+	if(script) {
+		free_script(script);
+	}
+}
+
+/* Thread which invalidates the agent's connection snapshot whenever the
+ * connections may have been changed by something else.
+*/
+static DWORD WINAPI agent_watcher(LPVOID arg) {
+	struct change_source *src;
+	
+	for(src = change_sources; src->name; src++) {
+		if(src->open(src)) {
+			while(src->wait(src)) {
+				InterlockedExchange(&snapshot_valid, 0);
+			}
+			
+			src->close(src);
+		}
+	}
+	
+	InterlockedExchange(&snapshot_cache, 0);
+	InterlockedExchange(&snapshot_valid, 0);
+	
+	return 0;
+}
+
+/* Carry out a command other than reapply received by the resident agent */
+static void agent_command(char *cmd) {
+	char *arg = cmd+strcspn(cmd, WHITESPACE);
+	
+	if(arg[0] != '\0') {
+		*(arg++) = '\0';
+		arg += strspn(arg, WHITESPACE);
+	}
+	
+	if(strcmp(cmd, "list") == 0) {
+		list_printers(arg[0] != '\0' ? arg : NULL);
+	}else if(strcmp(cmd, "add") == 0 && arg[0] != '\0') {
+		connect_printer(arg);
+		flush_connections();
+	}else if(strcmp(cmd, "remove") == 0 && arg[0] != '\0') {
+		disconnect_by_expr(arg);
+	}else{
+		show_error("Unknown agent command: %s", cmd);
+	}
+}
+
+/* Send a command to the resident agent of this session and print its output
+ * Returns the agent's status, or 1 if the agent can't be reached.
+*/
+static int agent_query(char const *cmd) {
+	char pname[64], buf[4096], *status;
+	HANDLE pipe;
+	DWORD len = 0, rlen;
+	
+	agent_pipe_name(pname);
+	
+	while((pipe = CreateFile(pname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE) {
+		if(GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(pname, 5000)) {
+			show_error("Can't connect to agent: %s", win32_strerr(GetLastError()));
+			return 1;
+		}
+	}
+	
+	if(!WriteFile(pipe, cmd, strlen(cmd), &rlen, NULL) || !WriteFile(pipe, "\n", 1, &rlen, NULL)) {
+		show_error("Can't send command to agent: %s", win32_strerr(GetLastError()));
+		CloseHandle(pipe);
+		return 1;
+	}
+	
+	/* Everything up to the final "status" line is the command's output */
+	
+	while(ReadFile(pipe, buf+len, sizeof(buf)-1-len, &rlen, NULL) && rlen) {
+		char *eol;
+		
+		len += rlen;
+		buf[len] = '\0';
+		
+		while((eol = strchr(buf, '\n')) && strncmp(buf, "status ", 7) != 0) {
+			log_printf("%.*s", (int)(eol+1-buf), buf);
+			memmove(buf, eol+1, len - (eol+1-buf) + 1);
+			len -= eol+1-buf;
+		}
+		
+		if(len == sizeof(buf)-1 && !strchr(buf, '\n')) {
+			log_printf("%.*s", (int)len, buf);
+			len = 0;
+		}
+	}
+	
+	CloseHandle(pipe);
+	buf[len] = '\0';
+	
+	if(strncmp(buf, "status ", 7) != 0) {
+		show_error("Lost connection to agent");
+		return 1;
+	}
+	
+	status = buf+7;
+	return atoi(status);
+}
+
+/* Execute a script for every active session on the computer (such as the users
+ * of a Remote Desktop host), which requires running as SYSTEM.
+ *
+ * The script is read once and evaluated for each session while impersonating
+ * its user, only the Username fact and environment variables are looked up
+ * again for each session. The printers used by any session are probed once,
+ * then the directives of all the sessions are carried out in parallel, each
+ * session's in script order and in its user's context. Printers which didn't
+ * respond to the probe aren't connected, and only one session at a time
+ * downloads the driver of each printer.
+*/
+static void run_batch(char const *filename) {
+	struct script *script = load_script(filename);
+	struct batch_session *sessions, **order;
+	wts_query_user_token query_token;
+	WTS_SESSION_INFO *info = NULL;
+	HMODULE wtsapi;
+	DWORD count = 0, snum;
+	unsigned int scount = 0, pnum;
+	
+	if(!script) {
+		return;
+	}
+	
+	wtsapi = LoadLibrary("wtsapi32.dll");
+	query_token = wtsapi ? (wts_query_user_token)GetProcAddress(wtsapi, "WTSQueryUserToken") : NULL;
+	
+	if(!query_token) {
+		show_error("-batch requires Windows XP or later");
+		free_script(script);
+		return;
+	}
+	
+	if(!WTSEnumerateSessions(WTS_CURRENT_SERVER_HANDLE, 0, 1, &info, &count)) {
+		show_error("Can't enumerate sessions: %s", win32_strerr(GetLastError()));
+		free_script(script);
+		return;
+	}
+	
+	sessions = allocate(sizeof(struct batch_session) * (count ? count : 1));
+	
+	for(snum = 0; snum < count; snum++) {
+		struct batch_session *session = &(sessions[scount]);
+		
+		if(info[snum].State != WTSActive) {
+			continue;
+		}
+		
+		memset(session, 0, sizeof(*session));
+		session->id = info[snum].SessionId;
+		
+		if(!query_token(session->id, &(session->token))) {
+			show_error("Can't get the user of session %lu: %s", (unsigned long)session->id, win32_strerr(GetLastError()));
+			continue;
+		}
+		
+		if(batch_plan(script, session)) {
+			scount++;
+		}else{
+			CloseHandle(session->token);
+		}
+	}
+	
+	WTSFreeMemory(info);
+	reset_user_facts();
+	
+	batch_probe(sessions, scount);
+	
+	order = allocate(sizeof(struct batch_session*) * (scount ? scount : 1));
+	for(snum = 0; snum < scount; snum++) {
+		order[snum] = &(sessions[snum]);
+	}
+	
+	parallel_for(order, sizeof(*order), scount, &batch_apply);
+	
+	for(snum = 0; snum < scount; snum++) {
+		batch_report(&(sessions[snum]));
+	}
+	
+	for(pnum = 0; pnum < batch_printer_count; pnum++) {
+		free(batch_printers[pnum].printer);
+		DeleteCriticalSection(&(batch_printers[pnum].install));
+	}
+	
+	free(batch_printers);
+	batch_printers = NULL;
+	batch_printer_count = 0;
+	
+	free(order);
+	free(sessions);
+	free_script(script);
+}
+
+/* Evaluate a script for a session while impersonating its user, adding the
+ * command directives to the session's plan.
+ *
+ * Returns 1 on success, zero on error.
+*/
+static int batch_plan(struct script *script, struct batch_session *session) {
+	WCHAR *block = NULL, *var;
+	char **user;
+	
+	if(!CreateEnvironmentBlock((void**)&block, session->token, FALSE)) {
+		show_error("Can't get the environment of session %lu: %s", (unsigned long)session->id, win32_strerr(GetLastError()));
+		return 0;
+	}
+	
+	for(var = block; var[0] != L'\0'; var += wcslen(var)+1) {
+		int size = WideCharToMultiByte(CP_ACP, 0, var, -1, NULL, 0, NULL, NULL);
+		char *buf;
+		
+		if(size <= 0) {
+			continue;
+		}
+		
+		buf = allocate(size);
+		WideCharToMultiByte(CP_ACP, 0, var, -1, buf, size, NULL, NULL);
+		list_add(&(session->env), buf);
+		free(buf);
+	}
+	
+	DestroyEnvironmentBlock(block);
+	
+	if(!ImpersonateLoggedOnUser(session->token)) {
+		show_error("Can't impersonate the user of session %lu: %s", (unsigned long)session->id, win32_strerr(GetLastError()));
+		
+		while(session->env.count) {
+			list_remove(&(session->env), session->env.count-1);
+		}
+		
+		free(session->env.items);
+		return 0;
+	}
+	
+	reset_user_facts();
+	
+	user = get_fact("Username");
+	session->user = copy_string(user[0] ? user[0] : "unknown user");
+	
+	log_printf("Evaluating script for session %lu (%s)\n", (unsigned long)session->id, session->user);
+	
+	batch_planning = session;
+	run_script(script);
+	batch_planning = NULL;
+	
+	RevertToSelf();
+	return 1;
+}
+
+/* Add a command directive to the plan of the session being evaluated */
+static void batch_add_action(struct directive const *directive, char const *value) {
+	struct batch_session *session = batch_planning;
+	struct batch_action *action;
+	struct server_group *group;
+	char const *share;
+	
+	if(session->count == session->alloc) {
+		struct batch_action *actions = allocate(sizeof(struct batch_action) * (session->alloc += 16));
+		
+		memcpy(actions, session->actions, sizeof(struct batch_action) * session->count);
+		free(session->actions);
+		session->actions = actions;
+	}
+	
+	action = &(session->actions[session->count++]);
+	
+	memset(action, 0, sizeof(*action));
+	action->lnum = script_lnum;
+	action->type = directive->batch_type;
+	
+	/* Sessions use the fastest replica of a ServerGroup, without falling back */
+	
+	if(action->type != BATCH_DELETE && (group = find_group(value, &share))) {
+		group_measure(group);
+		action->target = replica_path(group, 0, share);
+	}else{
+		action->target = copy_string(value);
+	}
+}
+
+/* Probe every printer connected by the sessions' plans, and every printer
+ * named as a DefaultPrinter candidate, filling in the batch_printers array.
+*/
+static void batch_probe(struct batch_session *sessions, unsigned int count) {
+	struct str_list names = {NULL, 0, 0};
+	struct probe_set *set;
+	unsigned int snum, anum, pnum;
+	DWORD start = GetTickCount();
+	
+	for(snum = 0; snum < count; snum++) {
+		for(anum = 0; anum < sessions[snum].count; anum++) {
+			struct batch_action *action = &(sessions[snum].actions[anum]);
+			char *buf, *cand;
+			
+			if(action->type == BATCH_ADD && list_find(&names, action->target) < 0) {
+				list_add(&names, action->target);
+			}
+			
+			if(action->type != BATCH_DEFAULT) {
+				continue;
+			}
+			
+			buf = copy_string(action->target);
+			
+			for(cand = strtok(buf, ","); cand; cand = strtok(NULL, ",")) {
+				size_t len;
+				
+				cand += strspn(cand, WHITESPACE);
+				len = strlen(cand);
+				
+				while(len > 0 && strchr(WHITESPACE, cand[len-1])) {
+					cand[--len] = '\0';
+				}
+				
+				if(cand[0] != '\0' && !is_pattern(cand) && list_find(&names, cand) < 0) {
+					list_add(&names, cand);
+				}
+			}
+			
+			free(buf);
+		}
+	}
+	
+	load_local_drivers();
+	
+	batch_printers = allocate(sizeof(struct batch_printer) * (names.count ? names.count : 1));
+	batch_printer_count = names.count;
+	
+	set = probe_start(names.items, names.count);
+	
+	for(pnum = 0; pnum < names.count; pnum++) {
+		struct batch_printer *printer = &(batch_printers[pnum]);
+		struct printer_probe *probe = &(set->probes[pnum]);
+		
+		memset(printer, 0, sizeof(*printer));
+		printer->printer = copy_string(names.items[pnum]);
+		printer->reachable = 1;
+		InitializeCriticalSection(&(printer->install));
+		
+		/* Errors which mean the connection would fail for every user */
+		
+		if(!probe_wait(set, pnum, DEFAULT_PROBE_MS)) {
+			printer->reachable = 0;
+			printer->error = ERROR_TIMEOUT;
+		}else if(!probe->info) {
+			if(probe->error == RPC_S_SERVER_UNAVAILABLE || probe->error == ERROR_BAD_NETPATH || probe->error == ERROR_BAD_NET_NAME || probe->error == ERROR_INVALID_PRINTER_NAME) {
+				printer->reachable = 0;
+				printer->error = probe->error;
+			}
+		}else{
+			printer->usable = printer_usable(probe->info);
+			printer->needs_driver = probe->info->pDriverName && !have_driver(probe->info->pDriverName);
+		}
+		
+		if(!printer->reachable) {
+			log_printf("Not available:\t\t%s (%s)\n", printer->printer, win32_strerr(printer->error));
+		}
+	}
+	
+	probe_release(set);
+	
+	log_printf("Probed %u printer(s) for %u session(s) in %.1fs\n", names.count, count, (GetTickCount() - start) / 1000.0);
+	
+	while(names.count) {
+		list_remove(&names, names.count-1);
+	}
+	
+	free(names.items);
+}
+
+/* Find a printer probed by batch_probe(), returns NULL if it wasn't probed */
+static struct batch_printer *batch_find_printer(char const *printer) {
+	unsigned int pnum;
+	
+	for(pnum = 0; pnum < batch_printer_count; pnum++) {
+		if(ncase_match(printer, batch_printers[pnum].printer)) {
+			return &(batch_printers[pnum]);
+		}
+	}
+	
+	return NULL;
+}
+
+/* Carry out the plan of a session in its user's context, runs in a
+ * parallel_for() thread. The results are printed later by batch_report().
+*/
+static void batch_apply(void *item) {
+	struct batch_session *session = *(struct batch_session**)item;
+	unsigned int anum;
+	DWORD error = ERROR_SUCCESS;
+	
+	if(!ImpersonateLoggedOnUser(session->token)) {
+		error = GetLastError();
+	}
+	
+	for(anum = 0; anum < session->count; anum++) {
+		struct batch_action *action = &(session->actions[anum]);
+		DWORD start = GetTickCount();
+		
+		if(error != ERROR_SUCCESS) {
+			action->ok = FALSE;
+			action->error = error;
+			continue;
+		}
+		
+		if(action->type == BATCH_ADD) {
+			struct batch_printer *printer = batch_find_printer(action->target);
+			
+			if(!printer->reachable) {
+				action->ok = FALSE;
+				action->error = printer->error;
+				continue;
+			}
+			
+			if(printer->needs_driver && !printer->installed) {
+				EnterCriticalSection(&(printer->install));
+				
+				action->downloaded = !printer->installed;
+				action->ok = spool_add_connection(action->target);
+				action->error = action->ok ? ERROR_SUCCESS : GetLastError();
+				
+				if(action->ok) {
+					InterlockedExchange(&(printer->installed), 1);
+				}
+				
+				LeaveCriticalSection(&(printer->install));
+			}else{
+				action->ok = spool_add_connection(action->target);
+				action->error = action->ok ? ERROR_SUCCESS : GetLastError();
+			}
+		}else if(action->type == BATCH_DEFAULT) {
+			batch_default(action);
+		}else{
+			char **printers = batch_get_printers(action);
+			unsigned int pnum;
+			struct expr_filter filter;
+			
+			action->ok = printers != NULL;
+			action->error = action->enum_error;
+			expr_prepare(&filter, action->target);
+			
+			for(pnum = 0; printers && printers[pnum]; pnum++) {
+				if(!expr_match(&filter, printers[pnum])) {
+					free(printers[pnum]);
+					continue;
+				}
+				
+				if(spool_delete_connection(printers[pnum])) {
+					list_add(&(action->done), printers[pnum]);
+				}else{
+					action->ok = FALSE;
+					action->error = GetLastError();
+				}
+				
+				free(printers[pnum]);
+			}
+			
+			expr_free(&filter);
+			free(printers);
+		}
+		
+		action->duration = GetTickCount() - start;
+	}
+	
+	if(error == ERROR_SUCCESS) {
+		RevertToSelf();
+	}
+}
+
+/* Set the default printer for a batch_apply() session, candidates which were
+ * probed by batch_probe() are skipped if they weren't usable, the status of
+ * connected printers matched by an expression isn't checked.
+*/
+static void batch_default(struct batch_action *action) {
+	char **printers = NULL, *buf = copy_string(action->target), *cand, *next;
+	char *chosen = NULL;
+	unsigned int pnum;
+	
+	if(!strchr(buf, ',') && !is_pattern(buf)) {
+		chosen = buf;
+	}
+	
+	/* strtok() isn't safe to use here, other sessions are using it */
+	
+	for(cand = buf; !chosen && cand; cand = next) {
+		struct batch_printer *printer;
+		size_t len;
+		
+		if((next = strchr(cand, ','))) {
+			*(next++) = '\0';
+		}
+		
+		cand += strspn(cand, WHITESPACE);
+		len = strlen(cand);
+		
+		while(len > 0 && strchr(WHITESPACE, cand[len-1])) {
+			cand[--len] = '\0';
+		}
+		
+		if(is_pattern(cand)) {
+			struct expr_filter filter;
+			
+			if(!printers && !action->enum_failed) {
+				printers = batch_get_printers(action);
+			}
+			
+			expr_prepare(&filter, cand);
+			
+			for(pnum = 0; !chosen && printers && printers[pnum]; pnum++) {
+				printer = batch_find_printer(printers[pnum]);
+				
+				if(expr_match(&filter, printers[pnum]) && (!printer || printer->usable)) {
+					chosen = printers[pnum];
+				}
+			}
+			
+			expr_free(&filter);
+		}else if(cand[0] != '\0') {
+			printer = batch_find_printer(cand);
+			
+			if(!printer || printer->usable) {
+				chosen = cand;
+			}
+		}
+	}
+	
+	if(!chosen) {
+		action->ok = FALSE;
+		action->error = ERROR_SUCCESS;
+	}else{
+		list_add(&(action->done), chosen);
+		
+		action->ok = spool_set_default(chosen);
+		action->error = action->ok ? ERROR_SUCCESS : GetLastError();
+	}
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		free(printers[pnum]);
+	}
+	
+	free(printers);
+	free(buf);
+}
+
+/* Returns the connections of the user being impersonated by batch_apply(), or
+ * NULL on error. get_printers() reports errors itself, which isn't safe in a
+ * parallel_for() thread, so an error is recorded in the action for
+ * batch_report() instead.
+*/
+static char **batch_get_printers(struct batch_action *action) {
+	DWORD start = GetTickCount();
+	char **printers = spool_enum_connections();
+	
+	if(!printers) {
+		action->enum_failed = 1;
+		action->enum_error = GetLastError();
+	}
+	
+	stats_record(NULL, "enumerate", printers != NULL, GetTickCount() - start);
+	return printers;
+}
+
+/* Print and record the results of a session's plan, then free it */
+static void batch_report(struct batch_session *session) {
+	unsigned int anum, pnum;
+	
+	log_printf("\nSession %lu (%s):\n", (unsigned long)session->id, session->user);
+	
+	for(anum = 0; anum < session->count; anum++) {
+		struct batch_action *action = &(session->actions[anum]);
+		char const *result;
+		
+		if(action->enum_failed) {
+			show_error("Can't fetch printers: %s", win32_strerr(action->enum_error));
+		}
+		
+		result = action->ok ? "ok" : win32_strerr(action->error);
+		
+		if(action->type == BATCH_ADD) {
+			if(action->ok && action->downloaded) {
+				log_printf("Added printer:\t\t%s (downloaded driver in %.1fs)\n", action->target, action->duration / 1000.0);
+			}else if(action->ok) {
+				log_printf("Added printer:\t\t%s\n", action->target);
+			}else{
+				show_error("Can't connect to printer %s: %s", action->target, result);
+			}
+			
+			log_record(action->lnum, "AddPrinter", action->target, result, action->duration);
+			stats_record(action->target, "connect", action->ok, action->duration);
+		}else if(action->type == BATCH_DEFAULT) {
+			if(action->done.count == 0) {
+				show_error("None of the printers %s are available to set as default", action->target);
+				log_record(action->lnum, "DefaultPrinter", action->target, "no printer available", action->duration);
+			}else{
+				if(action->ok) {
+					log_printf("Set default printer:\t%s\n", action->done.items[0]);
+				}else{
+					show_error("Can't set printer %s as default: %s", action->done.items[0], result);
+				}
+				
+				log_record(action->lnum, "DefaultPrinter", action->done.items[0], result, action->duration);
+				stats_record(action->done.items[0], "set-default", action->ok, action->duration);
+			}
+		}else{
+			for(pnum = 0; pnum < action->done.count; pnum++) {
+				log_printf("Disconnected from:\t%s\n", action->done.items[pnum]);
+			}
+			
+			if(!action->ok) {
+				show_error("Can't disconnect from printers matching %s: %s", action->target, result);
+			}
+			
+			log_record(action->lnum, "DeletePrinter", action->target, action->done.count || !action->ok ? result : "no match", action->duration);
+		}
+		
+		while(action->done.count) {
+			list_remove(&(action->done), action->done.count-1);
+		}
+		
+		free(action->done.items);
+		free(action->target);
+	}
+	
+	while(session->env.count) {
+		list_remove(&(session->env), session->env.count-1);
+	}
+	
+	free(session->env.items);
+	free(session->actions);
+	free(session->user);
+	CloseHandle(session->token);
+}
+
+/* Look up an environment variable of the session being evaluated by
+ * batch_plan(), returns NULL if it isn't set.
+*/
+static char const *batch_getenv(char const *name) {
+	size_t len = strlen(name);
+	unsigned int vnum;
+	
+	for(vnum = 0; vnum < batch_planning->env.count; vnum++) {
+		char const *var = batch_planning->env.items[vnum];
+		
+		if(_strnicmp(var, name, len) == 0 && var[len] == '=') {
+			return var+len+1;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Forget the facts which depend on the user, so they're resolved again for
+ * the next session evaluated by batch_plan().
+*/
+static void reset_user_facts(void) {
+	unsigned int fnum, vnum;
+	
+	for(fnum = 0; userenv[fnum].directive; fnum++) {
+		if(userenv[fnum].per_user && userenv[fnum].values) {
+			for(vnum = 0; userenv[fnum].values[vnum]; vnum++) {
+				free(userenv[fnum].values[vnum]);
+			}
+			
+			free(userenv[fnum].values);
+			userenv[fnum].values = NULL;
+		}
+	}
+}
+
+/* Define a ServerGroup, the value is the name of the group followed by the
+ * servers in it separated by commas or whitespace. Defining a group which
+ * already exists replaces its servers.
+*/
+static void define_group(char const *value) {
+	struct server_group *group = NULL;
+	char *buf = copy_string(value), *name, *server;
+	unsigned int gnum;
+	
+	name = strtok(buf, WHITESPACE);
+	server = name ? strtok(NULL, ", \t") : NULL;
+	
+	if(!server) {
+		show_error("ServerGroup requires a name and at least one server at line %u", script_lnum);
+		log_record(script_lnum, "ServerGroup", value, "invalid", 0);
+		free(buf);
+		return;
+	}
+	
+	for(gnum = 0; gnum < group_count; gnum++) {
+		if(ncase_match(groups[gnum].name, name)) {
+			group = &(groups[gnum]);
+			
+			while(group->servers.count) {
+				list_remove(&(group->servers), group->servers.count-1);
+			}
+			
+			break;
+		}
+	}
+	
+	if(!group) {
+		if(group_count == group_alloc) {
+			struct server_group *list = allocate(sizeof(struct server_group) * (group_alloc += 4));
+			
+			memcpy(list, groups, sizeof(struct server_group) * group_count);
+			free(groups);
+			groups = list;
+		}
+		
+		group = &(groups[group_count++]);
+		memset(group, 0, sizeof(*group));
+		group->name = copy_string(name);
+	}
+	
+	group->measured = 0;
+	
+	for(; server; server = strtok(NULL, ", \t")) {
+		server += strspn(server, "\\");
+		
+		if(server[0] != '\0' && list_find(&(group->servers), server) < 0) {
+			list_add(&(group->servers), server);
+		}
+	}
+	
+	log_record(script_lnum, "ServerGroup", value, "ok", 0);
+	free(buf);
+}
+
+/* Find the ServerGroup named by the server part of a UNC path, and optionally
+ * the rest of the path after the server. Returns NULL if the server isn't a
+ * group.
+*/
+static struct server_group *find_group(char const *printer, char const **share) {
+	size_t len;
+	unsigned int gnum;
+	
+	if(strncmp(printer, "\\\\", 2) != 0) {
+		return NULL;
+	}
+	
+	len = strcspn(printer+2, "\\");
+	if(printer[2+len] != '\\') {
+		return NULL;
+	}
+	
+	for(gnum = 0; gnum < group_count; gnum++) {
+		if(groups[gnum].servers.count && strlen(groups[gnum].name) == len && _strnicmp(groups[gnum].name, printer+2, len) == 0) {
+			if(share) {
+				*share = printer+3+len;
+			}
+			
+			return &(groups[gnum]);
+		}
+	}
+	
+	return NULL;
+}
+
+/* Put the servers of a ServerGroup in order of how long they take to accept a
+ * TCP connection, measured in parallel. Servers which don't respond within
+ * GROUP_PROBE_MS go last but are kept in case the others fail, only the first
+ * call for each group does anything.
+*/
+static void group_measure(struct server_group *group) {
+	struct replica_probe *probes;
+	char **servers;
+	unsigned int snum;
+	
+	if(group->measured) {
+		return;
+	}
+	
+	group->measured = 1;
+	
+	probes = allocate(sizeof(struct replica_probe) * group->servers.count);
+	servers = allocate(sizeof(char*) * group->servers.count);
+	
+	for(snum = 0; snum < group->servers.count; snum++) {
+		probes[snum].server = group->servers.items[snum];
+		probes[snum].index = snum;
+	}
+	
+	parallel_for(probes, sizeof(*probes), group->servers.count, &replica_probe);
+	qsort(probes, group->servers.count, sizeof(*probes), &replica_cmp);
+	
+	log_printf("Server group %s:\t", group->name);
+	
+	for(snum = 0; snum < group->servers.count; snum++) {
+		char path[272];
+		
+		servers[snum] = group->servers.items[probes[snum].index];
+		
+		if(probes[snum].ok) {
+			log_printf("%s%s (%lums)", snum ? ", " : "", servers[snum], (unsigned long)probes[snum].latency);
+		}else{
+			log_printf("%s%s (not responding)", snum ? ", " : "", servers[snum]);
+		}
+		
+		if(strlen(servers[snum]) < sizeof(path)-3) {
+			sprintf(path, "\\\\%s\\", servers[snum]);
+			stats_record(path, "reach", probes[snum].ok, probes[snum].latency);
+		}
+	}
+	
+	log_printf("\n");
+	
+	memcpy(group->servers.items, servers, sizeof(char*) * group->servers.count);
+	
+	free(servers);
+	free(probes);
+}
+
+/* Time how long a server takes to accept a connection, runs in a
+ * parallel_for() thread. The result is recorded and replayed with the
+ * spooler calls.
+ *
+ * Each address of the server is tried in turn until one accepts, within
+ * GROUP_PROBE_MS in total, and the latency includes the addresses which
+ * failed, as a client connecting by name would wait for them too.
+*/
+static void replica_probe(void *item) {
+	struct replica_probe *probe = item;
+	struct addrinfo hints, *res, *ai;
+	struct timeval timeout;
+	char port[8];
+	fd_set wfds, efds;
+	u_long nonblock = 1;
+	DWORD start, elapsed;
+	SOCKET sock;
+	
+	probe->ok = 0;
+	probe->latency = GROUP_PROBE_MS;
+	
+	if(replaying()) {
+		struct replay_call *call = replay_find("reach", probe->server);
+		
+		if(call) {
+			probe->ok = call->ok;
+			probe->latency = call->duration;
+		}
+		
+		return;
+	}
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	sprintf(port, "%u", GROUP_PROBE_PORT);
+	
+	if(!winsock_init() || getaddrinfo(probe->server, port, &hints, &res) != 0) {
+		return;
+	}
+	
+	start = GetTickCount();
+	
+	for(ai = res; ai && !probe->ok && (elapsed = GetTickCount() - start) < GROUP_PROBE_MS; ai = ai->ai_next) {
+		if((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == INVALID_SOCKET) {
+			continue;
+		}
+		
+		ioctlsocket(sock, FIONBIO, &nonblock);
+		
+		if(connect(sock, ai->ai_addr, (int)ai->ai_addrlen) == 0 || WSAGetLastError() == WSAEWOULDBLOCK) {
+			FD_ZERO(&wfds);
+			FD_SET(sock, &wfds);
+			
+			/* A refused connection is reported through the exception set */
+			
+			FD_ZERO(&efds);
+			FD_SET(sock, &efds);
+			
+			timeout.tv_sec = (GROUP_PROBE_MS - elapsed) / 1000;
+			timeout.tv_usec = ((GROUP_PROBE_MS - elapsed) % 1000) * 1000;
+			
+			if(select(0, NULL, &wfds, &efds, &timeout) > 0 && FD_ISSET(sock, &wfds) && !FD_ISSET(sock, &efds)) {
+				probe->ok = 1;
+				probe->latency = GetTickCount() - start;
+			}
+		}
+		
+		closesocket(sock);
+	}
+	
+	freeaddrinfo(res);
+	record_call("reach", probe->server, probe->ok, probe->ok ? ERROR_SUCCESS : ERROR_TIMEOUT, start, NULL);
+}
+
+/* qsort() comparison function which orders servers that responded first,
+ * fastest first, otherwise preserving the order they were given in.
+*/
+static int replica_cmp(void const *a, void const *b) {
+	struct replica_probe const *pa = a, *pb = b;
+	
+	if(pa->ok != pb->ok) {
+		return pb->ok - pa->ok;
+	}
+	
+	if(pa->ok && pa->latency != pb->latency) {
+		return pa->latency < pb->latency ? -1 : 1;
+	}
+	
+	return pa->index < pb->index ? -1 : (pa->index > pb->index);
+}
+
+/* Returns \\<server>\<share> for a server of a ServerGroup */
+static char *replica_path(struct server_group *group, unsigned int snum, char const *share) {
+	char *path = allocate(strlen(group->servers.items[snum]) + strlen(share) + 4);
+	
+	sprintf(path, "\\\\%s\\%s", group->servers.items[snum], share);
+	return path;
+}
+
+/* Returns the server part of a UNC printer path (\\<server>\<share>) and its
+ * length, or NULL if the printer isn't a UNC path.
+*/
+static char const *unc_server(char const *printer, size_t *len) {
+	if(strncmp(printer, "\\\\", 2) != 0) {
+		return NULL;
+	}
+	
+	*len = strcspn(printer+2, "\\");
+	
+	if(*len == 0 || printer[2+*len] != '\\') {
+		return NULL;
+	}
+	
+	return printer+2;
+}
+
+/* Check if two printer paths name the same printer, either because they're
+ * the same apart from case or because their shares are the same and their
+ * servers resolve to at least one common address.
+*/
+static int unc_same(char const *printer1, char const *printer2) {
+	char const *server1, *server2;
+	char **addrs1, **addrs2;
+	size_t len1, len2;
+	unsigned int anum1, anum2;
+	
+	if(ncase_match(printer1, printer2)) {
+		return 1;
+	}
+	
+	if(!(server1 = unc_server(printer1, &len1)) || !(server2 = unc_server(printer2, &len2)) || !ncase_match(server1+len1, server2+len2)) {
+		return 0;
+	}
+	
+	addrs1 = server_addrs(server1, len1);
+	addrs2 = server_addrs(server2, len2);
+	
+	for(anum1 = 0; addrs1[anum1]; anum1++) {
+		for(anum2 = 0; addrs2[anum2]; anum2++) {
+			if(ncase_match(addrs1[anum1], addrs2[anum2])) {
+				return 1;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+/* Resolve the servers of any printers which unc_same() would have to compare
+ * by their addresses in parallel, rather than one at a time when they're first
+ * compared. The list is NULL-terminated.
+*/
+static void unc_resolve(char **printers) {
+	struct server_alias **todo;
+	unsigned int *index, pnum, onum, count = 0, tnum;
+	char const *server, *other;
+	size_t len, olen;
+	
+	for(pnum = 0; printers[pnum]; pnum++) {}
+	
+	index = allocate(sizeof(unsigned int) * (pnum+1));
+	
+	for(pnum = 0; printers[pnum]; pnum++) {
+		if(!(server = unc_server(printers[pnum], &len))) {
+			continue;
+		}
+		
+		for(onum = 0; printers[onum]; onum++) {
+			if((other = unc_server(printers[onum], &olen)) && ncase_match(server+len, other+olen) && (len != olen || _strnicmp(server, other, len) != 0)) {
+				break;
+			}
+		}
+		
+		if(printers[onum]) {
+			struct server_alias *alias = alias_find(server, len);
+			
+			if(!alias->addrs) {
+				for(tnum = 0; tnum < count && index[tnum] != (unsigned int)(alias - aliases); tnum++) {}
+				
+				if(tnum == count) {
+					index[count++] = alias - aliases;
+				}
+			}
+		}
+	}
+	
+	/* alias_find() may have moved the table, so the pointers are only taken
+	 * once it's finished adding servers.
+	*/
+	
+	todo = allocate(sizeof(struct server_alias*) * (count+1));
+	
+	for(tnum = 0; tnum < count; tnum++) {
+		todo[tnum] = &(aliases[index[tnum]]);
+	}
+	
+	parallel_for(todo, sizeof(*todo), count, &alias_resolve);
+	
+	free(todo);
+	free(index);
+}
+
+/* Returns the name a printer is connected under if it's connected through
+ * another name of its server, NULL otherwise.
+*/
+static char *unc_connected(char const *printer) {
+	char **printers = get_printers(), **paths, *ret = NULL;
+	unsigned int pnum;
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {}
+	
+	paths = allocate(sizeof(char*) * (pnum+2));
+	paths[0] = (char*)printer;
+	paths[pnum+1] = NULL;
+	
+	if(pnum) {
+		memcpy(paths+1, printers, sizeof(char*) * pnum);
+	}
+	
+	unc_resolve(paths);
+	free(paths);
+	
+	for(pnum = 0; printers && printers[pnum]; pnum++) {
+		if(!ret && !ncase_match(printer, printers[pnum]) && unc_same(printer, printers[pnum])) {
+			ret = copy_string(printers[pnum]);
+		}
+	}
+	
+	free_list(printers);
+	return ret;
+}
+
+/* Returns the addresses of a server, resolving it the first time */
+static char **server_addrs(char const *server, size_t len) {
+	struct server_alias *alias = alias_find(server, len);
+	
+	if(!alias->addrs) {
+		alias->addrs = resolve_server(alias->name);
+	}
+	
+	return alias->addrs;
+}
+
+/* Find the entry for a server in the alias table, adding it if it doesn't
+ * exist. The table is kept for the rest of the run.
+*/
+static struct server_alias *alias_find(char const *server, size_t len) {
+	unsigned int anum;
+	
+	for(anum = 0; anum < alias_count; anum++) {
+		if(strlen(aliases[anum].name) == len && _strnicmp(aliases[anum].name, server, len) == 0) {
+			return &(aliases[anum]);
+		}
+	}
+	
+	if(alias_count == alias_alloc) {
+		struct server_alias *a = allocate(sizeof(struct server_alias) * (alias_alloc += 16));
+		
+		memcpy(a, aliases, sizeof(struct server_alias) * alias_count);
+		free(aliases);
+		aliases = a;
+	}
+	
+	struct server_alias *alias = &(aliases[alias_count++]);
+	
+	alias->name = fold_copy(server, len);
+	alias->addrs = NULL;
+	
+	return alias;
+}
+
+/* Resolve a server in the alias table, runs in a parallel_for() thread */
+static void alias_resolve(void *item) {
+	struct server_alias *alias = *(struct server_alias**)item;
+	
+	alias->addrs = resolve_server(alias->name);
+}
+
+/* Resolve a server name or address to the IPv4 and IPv6 addresses of the host,
+ * so every name of a server shares at least one address with the others
+ * without needing reverse DNS. A name which can't be resolved is its only
+ * address.
+*/
+static char **resolve_server(char *server) {
+	struct addrinfo hints, *res = NULL, *ai;
+	char **addrs, buf[64];
+	unsigned int count = 0;
+	DWORD start = GetTickCount(), error = ERROR_SUCCESS;
+	
+	if(replaying()) {
+		struct replay_call *call = replay_find("resolve", server);
+		
+		return call && call->ok && call->values[0] ? copy_list(call->values) : single_list(server);
+	}
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	if(!winsock_init() || (error = getaddrinfo(server, NULL, &hints, &res)) != 0) {
+		record_call("resolve", server, FALSE, error ? error : (DWORD)WSAGetLastError(), start, NULL);
+		return single_list(server);
+	}
+	
+	for(ai = res; ai; ai = ai->ai_next) {
+		count++;
+	}
+	
+	addrs = allocate(sizeof(char*) * (count+1));
+	count = 0;
+	
+	for(ai = res; ai; ai = ai->ai_next) {
+		DWORD size = sizeof(buf);
+		
+		if((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && WSAAddressToString(ai->ai_addr, (DWORD)ai->ai_addrlen, NULL, buf, &size) == 0) {
+			addrs[count++] = copy_string(buf);
+		}
+	}
+	
+	addrs[count] = NULL;
+	freeaddrinfo(res);
+	
+	record_call("resolve", server, TRUE, ERROR_SUCCESS, start, addrs);
+	return addrs;
+}
+
+/* Fetch the connected printers from the spooler backend, recording the call */
+static char **spool_enum_connections(void) {
+	DWORD start = GetTickCount(), error;
+	char **printers = spooler->enum_connections();
+	
+	error = printers ? ERROR_SUCCESS : GetLastError();
+	record_call("enumerate", NULL, printers != NULL, error, start, printers);
+	
+	SetLastError(error);
+	return printers;
+}
+
+/* Fetch the installed printer drivers from the spooler backend, recording the
+ * call.
+*/
+static char **spool_enum_drivers(void) {
+	DWORD start = GetTickCount(), error;
+	char **drivers = spooler->enum_drivers();
+	
+	error = drivers ? ERROR_SUCCESS : GetLastError();
+	record_call("drivers", NULL, drivers != NULL, error, start, drivers);
+	
+	SetLastError(error);
+	return drivers;
+}
+
+/* Fetch the details of a printer from the spooler backend, recording the call */
+static PRINTER_INFO_2 *spool_get_printer(char const *printer) {
+	DWORD start = GetTickCount(), error;
+	PRINTER_INFO_2 *info = spooler->get_printer(printer);
+	
+	error = info ? ERROR_SUCCESS : GetLastError();
+	
+	if(record_fh) {
+		char **values = info ? printer_values(info) : NULL;
+		
+		record_call("printer", printer, info != NULL, error, start, values);
+		free_list(values);
+	}
+	
+	SetLastError(error);
+	return info;
+}
+
+/* Add a printer connection using the spooler backend, recording the call */
+static BOOL spool_add_connection(char const *printer) {
+	DWORD start = GetTickCount(), error;
+	BOOL ok = spooler->add_connection(printer);
+	
+	error = ok ? ERROR_SUCCESS : GetLastError();
+	record_call("add", printer, ok, error, start, NULL);
+	
+	SetLastError(error);
+	return ok;
+}
+
+/* Delete a printer connection using the spooler backend, recording the call */
+static BOOL spool_delete_connection(char const *printer) {
+	DWORD start = GetTickCount(), error;
+	BOOL ok = spooler->delete_connection(printer);
+	
+	error = ok ? ERROR_SUCCESS : GetLastError();
+	record_call("delete", printer, ok, error, start, NULL);
+	
+	SetLastError(error);
+	return ok;
+}
+
+/* Set the default printer using the spooler backend, recording the call */
+static BOOL spool_set_default(char const *printer) {
+	DWORD start = GetTickCount(), error;
+	BOOL ok = spooler->set_default(printer);
+	
+	error = ok ? ERROR_SUCCESS : GetLastError();
+	record_call("default", printer, ok, error, start, NULL);
+	
+	SetLastError(error);
+	return ok;
+}
+
+/* The connections come from EnumPrinters() unless -reg was used, which reads
+ * them from the registry if possible. EnumPrinters() can take a long time as the
+ * spooler may contact the print servers, but the registry layout isn't a
+ * documented interface, so it's only used when asked for.
+*/
+static char **live_enum_connections(void) {
+	PRINTER_INFO_4 *printers = NULL;
+	DWORD size = 0, count, n;
+	char **ret;
+	
+	if(registry_list && (ret = registry_connections())) {
+		return ret;
+	}
+	
+	while(!EnumPrinters(PRINTER_ENUM_CONNECTIONS, NULL, 4, (void*)printers, size, &size, &count)) {
+		DWORD error = GetLastError();
+		
+		free(printers);
+		
+		if(error != 122 && error != 1784) {
+			SetLastError(error);
+			return NULL;
+		}
+		
+		printers = allocate(size);
+	}
+	
+	ret = allocate(sizeof(char*) * (count+1));
+	ret[count] = NULL;
+	
+	for(n = 0; n < count; n++) {
+		ret[n] = copy_string(printers[n].pPrinterName);
+	}
+	
+	free(printers);
+	return ret;
+}
+
+/* Read the connected printers from the user's registry, where the spooler
+ * keeps them as the subkeys of Printers\Connections named ,,server,share
+ *
+ * Returns NULL if they can't be read, any subkey isn't in that form, or they
+ * don't agree with the connections this process has added and deleted.
+*/
+static char **registry_connections(void) {
+	HKEY user, key;
+	DWORD count = 0, n, len;
+	char name[MAX_PATH], *comma, **ret;
+	LONG error;
+	
+	/* Unlike HKEY_CURRENT_USER this follows impersonation, for -batch */
+	
+	if(RegOpenCurrentUser(KEY_READ, &user) != ERROR_SUCCESS) {
+		return NULL;
+	}
+	
+	error = RegOpenKeyEx(user, "Printers\\Connections", 0, KEY_READ, &key);
+	RegCloseKey(user);
+	
+	if(error == ERROR_FILE_NOT_FOUND) {
+		ret = single_list(NULL);
+		goto REGISTRY_CONNECTIONS_CHECK;
+	}else if(error != ERROR_SUCCESS) {
+		return NULL;
+	}
+	
+	if(RegQueryInfoKey(key, NULL, NULL, NULL, &count, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) {
+		RegCloseKey(key);
+		return NULL;
+	}
+	
+	ret = allocate(sizeof(char*) * (count+1));
+	ret[0] = NULL;
+	
+	for(n = 0; n < count; n++) {
+		len = sizeof(name);
+		
+		if(RegEnumKeyEx(key, n, name, &len, NULL, NULL, NULL, NULL) != ERROR_SUCCESS || strncmp(name, ",,", 2) != 0) {
+			comma = NULL;
+		}else{
+			comma = strchr(name+2, ',');
+		}
+		
+		if(!comma || comma == name+2 || comma[1] == '\0') {
+			RegCloseKey(key);
+			free_list(ret);
+			return NULL;
+		}
+		
+		name[0] = '\\';
+		name[1] = '\\';
+		comma[0] = '\\';
+		
+		ret[n] = copy_string(name);
+		ret[n+1] = NULL;
+	}
+	
+	RegCloseKey(key);
+	
+	REGISTRY_CONNECTIONS_CHECK:
+	
+	for(n = 0; n < made_connections.count + made_deletions.count; n++) {
+		int expected = n < made_connections.count;
+		char const *printer = expected ? made_connections.items[n] : made_deletions.items[n - made_connections.count];
+		unsigned int pnum;
+		int found = 0;
+		
+		for(pnum = 0; ret[pnum]; pnum++) {
+			found |= ncase_match(printer, ret[pnum]);
+		}
+		
+		if(found != expected) {
+			free_list(ret);
+			return NULL;
+		}
+	}
+	
+	return ret;
+}
+
+static char **live_enum_drivers(void) {
+	DRIVER_INFO_2 *drivers = NULL;
+	DWORD size = 0, count = 0, n;
+	char **ret;
+	
+	while(!EnumPrinterDrivers(NULL, NULL, 2, (void*)drivers, size, &size, &count)) {
+		DWORD error = GetLastError();
+		
+		free(drivers);
+		
+		if(error != ERROR_INSUFFICIENT_BUFFER) {
+			SetLastError(error);
+			return NULL;
+		}
+		
+		drivers = allocate(size);
+	}
+	
+	ret = allocate(sizeof(char*) * (count+1));
+	ret[count] = NULL;
+	
+	for(n = 0; n < count; n++) {
+		ret[n] = copy_string(drivers[n].pName);
+	}
+	
+	free(drivers);
+	return ret;
+}
+
+static PRINTER_INFO_2 *live_get_printer(char const *printer) {
+	PRINTER_INFO_2 *info = NULL;
+	HANDLE handle;
+	DWORD size = 0, error = ERROR_SUCCESS;
+	
+	if(!OpenPrinter((char*)printer, &handle, NULL)) {
+		return NULL;
+	}
+	
+	while(!GetPrinter(handle, 2, (void*)info, size, &size)) {
+		error = GetLastError();
+		
+		free(info);
+		info = NULL;
+		
+		if(error != ERROR_INSUFFICIENT_BUFFER) {
+			break;
+		}
+		
+		info = allocate(size);
+	}
+	
+	ClosePrinter(handle);
+	
+	SetLastError(error);
+	return info;
+}
+
+static BOOL live_add_connection(char const *printer) {
+	return AddPrinterConnection((char*)printer);
+}
+
+static BOOL live_delete_connection(char const *printer) {
+	return DeletePrinterConnection((char*)printer);
+}
+
+static BOOL live_set_default(char const *printer) {
+	return SetDefaultPrinter(printer);
+}
+
+static char **replay_enum_connections(void) {
+	struct replay_call *call = replay_find("enumerate", NULL);
+	
+	if(!call || !call->ok) {
+		SetLastError(call ? call->error : ERROR_NOT_FOUND);
+		return NULL;
+	}
+	
+	return copy_list(call->values);
+}
+
+static char **replay_enum_drivers(void) {
+	struct replay_call *call = replay_find("drivers", NULL);
+	
+	if(!call || !call->ok) {
+		SetLastError(call ? call->error : ERROR_NOT_FOUND);
+		return NULL;
+	}
+	
+	return copy_list(call->values);
+}
+
+static PRINTER_INFO_2 *replay_get_printer(char const *printer) {
+	struct replay_call *call = replay_find("printer", printer);
+	
+	if(!call || !call->ok) {
+		SetLastError(call ? call->error : ERROR_NOT_FOUND);
+		return NULL;
+	}
+	
+	return printer_from_values(call->values);
+}
+
+static BOOL replay_add_connection(char const *printer) {
+	struct replay_call *call = replay_find("add", printer);
+	
+	SetLastError(call ? call->error : ERROR_NOT_FOUND);
+	return call ? call->ok : FALSE;
+}
+
+static BOOL replay_delete_connection(char const *printer) {
+	struct replay_call *call = replay_find("delete", printer);
+	
+	SetLastError(call ? call->error : ERROR_NOT_FOUND);
+	return call ? call->ok : FALSE;
+}
+
+static BOOL replay_set_default(char const *printer) {
+	struct replay_call *call = replay_find("default", printer);
+	
+	SetLastError(call ? call->error : ERROR_NOT_FOUND);
+	return call ? call->ok : FALSE;
+}
+
+/* The explain backend used by -explain passes the calls which only read to the
+ * backend it replaced, and reports the calls which would change a connection
+ * with an estimate of how long they'd take instead of making them. The
+ * connections it returns are the ones the plan would leave.
+*/
+static char **explain_enum_connections(void) {
+	DWORD start = GetTickCount();
+	char **printers;
+	unsigned int pnum;
+	
+	if(!explain_enumerated) {
+		if(!(printers = explain_base->enum_connections())) {
+			return NULL;
+		}
+		
+		for(pnum = 0; printers[pnum]; pnum++) {
+			list_add(&explain_connections, printers[pnum]);
+		}
+		
+		free_list(printers);
+		
+		explain_enumerated = 1;
+		explain_enum_ms = GetTickCount() - start;
+		explain_call(EXPLAIN_ENUM, NULL, 1, explain_enum_ms, NULL);
+	}else{
+		explain_call(EXPLAIN_ENUM, NULL, 0, explain_enum_ms, "the first enumeration");
+	}
+	
+	printers = allocate(sizeof(char*) * (explain_connections.count+1));
+	
+	for(pnum = 0; pnum < explain_connections.count; pnum++) {
+		printers[pnum] = copy_string(explain_connections.items[pnum]);
+	}
+	
+	printers[pnum] = NULL;
+	return printers;
+}
+
+static char **explain_enum_drivers(void) {
+	DWORD start = GetTickCount();
+	char **drivers = explain_base->enum_drivers();
+	DWORD error = drivers ? ERROR_SUCCESS : GetLastError();
+	
+	explain_call(EXPLAIN_DRIVERS, NULL, 1, GetTickCount() - start, NULL);
+	
+	SetLastError(error);
+	return drivers;
+}
+
+static PRINTER_INFO_2 *explain_get_printer(char const *printer) {
+	DWORD start = GetTickCount();
+	PRINTER_INFO_2 *info = explain_base->get_printer(printer);
+	DWORD error = info ? ERROR_SUCCESS : GetLastError();
+	
+	explain_call(EXPLAIN_GET, printer, 1, GetTickCount() - start, NULL);
+	
+	SetLastError(error);
+	return info;
+}
+
+static BOOL explain_add_connection(char const *printer) {
+	unsigned long ms;
+	char const *source;
+	
+	if(list_find(&explain_connections, printer) >= 0) {
+		explain_call(EXPLAIN_ADD, printer, 0, 0, "already connected");
+	}else{
+		source = explain_estimate(printer, "connect", &ms);
+		explain_call(EXPLAIN_ADD, printer, 0, ms, source);
+		list_add(&explain_connections, printer);
+	}
+	
+	return TRUE;
+}
+
+static BOOL explain_delete_connection(char const *printer) {
+	unsigned long ms;
+	char const *source = explain_estimate(printer, "delete", &ms);
+	int pnum;
+	
+	explain_call(EXPLAIN_DELETE, printer, 0, ms, source);
+	
+	if((pnum = list_find(&explain_connections, printer)) >= 0) {
+		list_remove(&explain_connections, pnum);
+	}
+	
+	return TRUE;
+}
+
+static BOOL explain_set_default(char const *printer) {
+	unsigned long ms;
+	char const *source = explain_estimate(printer, "set-default", &ms);
+	
+	explain_call(EXPLAIN_DEFAULT, printer, 0, ms, source);
+	
+	free(explain_default);
+	explain_default = copy_string(printer);
+	
+	return TRUE;
+}
+
+/* Start recording spooler calls and environment lookups to a file
+ * Returns 1 on success, zero on error.
+*/
+static int record_open(char const *filename) {
+	if(record_fh) {
+		fclose(record_fh);
+	}
+	
+	if(!(record_fh = fopen(filename, "w"))) {
+		show_error("Can't open %s: %s", filename, strerror(errno));
+		return 0;
+	}
+	
+	fprintf(record_fh, "%s\n", RECORD_MAGIC);
+	record_start = GetTickCount();
+	
+	return 1;
+}
+
+/* Write a call to the recording, if one is open
+ *
+ * Each call is a line of tab separated fields: the operation, time it started
+ * (in milliseconds since recording started), duration, whether it succeeded,
+ * error code, argument (empty if none) and any values it returned.
+*/
+static void record_call(char const *op, char const *arg, BOOL ok, DWORD error, DWORD start, char **values) {
+	unsigned int vnum;
+	
+	if(!record_fh) {
+		return;
+	}
+	
+	EnterCriticalSection(&record_lock);
+	
+	fprintf(record_fh, "%s\t%lu\t%lu\t%d\t%lu\t", op, (unsigned long)(start - record_start), (unsigned long)(GetTickCount() - start), ok ? 1 : 0, (unsigned long)error);
+	record_string(arg);
+	
+	for(vnum = 0; values && values[vnum]; vnum++) {
+		fputc('\t', record_fh);
+		record_string(values[vnum]);
+	}
+	
+	fputc('\n', record_fh);
+	
+	LeaveCriticalSection(&record_lock);
+}
+
+/* Write a field to the recording, escaping tabs, newlines and backslashes */
+static void record_string(char const *str) {
+	for(; str && str[0] != '\0'; str++) {
+		if(str[0] == '\t') {
+			fputs("\\t", record_fh);
+		}else if(str[0] == '\n') {
+			fputs("\\n", record_fh);
+		}else if(str[0] == '\r') {
+			fputs("\\r", record_fh);
+		}else if(str[0] == '\\') {
+			fputs("\\\\", record_fh);
+		}else{
+			fputc(str[0], record_fh);
+		}
+	}
+}
+
+/* Undo the escaping done by record_string() in place */
+static void record_unescape(char *str) {
+	char *out = str;
+	
+	for(; str[0] != '\0'; str++) {
+		if(str[0] == '\\' && str[1] != '\0') {
+			str++;
+			
+			*(out++) = str[0] == 't' ? '\t' : (str[0] == 'n' ? '\n' : (str[0] == 'r' ? '\r' : str[0]));
+		}else{
+			*(out++) = str[0];
+		}
+	}
+	
+	out[0] = '\0';
+}
+
+/* Read a recording written by -record and switch to the replay backend
+ * Returns 1 on success, zero on error.
+*/
+static int replay_load(char const *filename) {
+	FILE *fh = fopen(filename, "r");
+	char *line = NULL;
+	size_t alloc = 0, len;
+	unsigned int call_alloc = 0, lnum = 0;
+	
+	if(!fh) {
+		show_error("Can't open %s: %s", filename, strerror(errno));
+		return 0;
+	}
+	
+	while(1) {
+		struct replay_call *call;
+		char *field[6], *next;
+		unsigned int fnum, vcount;
+		
+		/* Lines are as long as the list of connected printers */
+		
+		len = 0;
+		
+		do {
+			if(alloc - len < 1024) {
+				char *buf = allocate(alloc += 4096);
+				
+				memcpy(buf, line, len);
+				free(line);
+				line = buf;
+			}
+			
+			if(!fgets(line+len, alloc-len, fh)) {
+				break;
+			}
+			
+			len += strlen(line+len);
+		} while(len > 0 && line[len-1] != '\n');
+		
+		if(len == 0) {
+			break;
+		}
+		
+		line[strcspn(line, "\r\n")] = '\0';
+		
+		if(lnum++ == 0) {
+			if(strcmp(line, RECORD_MAGIC) != 0) {
+				show_error("%s isn't a NetPrinters recording", filename);
+				fclose(fh);
+				free(line);
+				return 0;
+			}
+			
+			continue;
+		}
+		
+		for(fnum = 0, next = line; fnum < 6 && next; fnum++) {
+			field[fnum] = next;
+			
+			if((next = strchr(next, '\t'))) {
+				*(next++) = '\0';
+			}
+		}
+		
+		if(fnum < 6) {
+			show_error("Invalid call at line %u of %s", lnum, filename);
+			continue;
+		}
+		
+		if(replay_count == call_alloc) {
+			struct replay_call *calls = allocate(sizeof(struct replay_call) * (call_alloc += 256));
+			
+			memcpy(calls, replay_calls, sizeof(struct replay_call) * replay_count);
+			free(replay_calls);
+			replay_calls = calls;
+		}
+		
+		call = &(replay_calls[replay_count++]);
+		
+		record_unescape(field[5]);
+		
+		call->op = copy_string(field[0]);
+		call->arg = field[5][0] != '\0' ? copy_string(field[5]) : NULL;
+		call->duration = strtoul(field[2], NULL, 10);
+		call->ok = atoi(field[3]) != 0;
+		call->error = strtoul(field[4], NULL, 10);
+		call->used = 0;
+		
+		for(vcount = 0, len = 0; next && next[len] != '\0'; len++) {
+			vcount += next[len] == '\t';
+		}
+		
+		call->values = allocate(sizeof(char*) * (vcount + (next ? 2 : 1)));
+		
+		for(vcount = 0; next; vcount++) {
+			char *value = next;
+			
+			if((next = strchr(next, '\t'))) {
+				*(next++) = '\0';
+			}
+			
+			record_unescape(value);
+			call->values[vcount] = copy_string(value);
+		}
+		
+		call->values[vcount] = NULL;
+	}
+	
+	fclose(fh);
+	free(line);
+	
+	spooler = &replay_spooler;
+	return 1;
+}
+
+/* Check if spooler calls are being replayed, either directly or underneath
+ * the explain backend.
+*/
+static int replaying(void) {
+	return spooler == &replay_spooler || explain_base == &replay_spooler;
+}
+
+/* Find the first call in the recording which hasn't been replayed yet with the
+ * same operation and argument, waiting for as long as the call took unless
+ * replaying as fast as possible.
+ *
+ * Returns NULL if there is no such call.
+*/
+static struct replay_call *replay_find(char const *op, char const *arg) {
+	struct replay_call *call = NULL;
+	unsigned int cnum;
+	
+	EnterCriticalSection(&replay_lock);
+	
+	for(cnum = 0; cnum < replay_count; cnum++) {
+		struct replay_call *c = &(replay_calls[cnum]);
+		
+		if(!c->used && strcmp(c->op, op) == 0 && (arg ? c->arg && ncase_match(c->arg, arg) : !c->arg)) {
+			c->used = 1;
+			call = c;
+			break;
+		}
+	}
+	
+	LeaveCriticalSection(&replay_lock);
+	
+	if(call && !replay_fast) {
+		Sleep(call->duration);
+	}
+	
+	return call;
+}
+
+/* Returns a copy of the values returned by a recorded call, or an empty list
+ * if the call isn't in the recording.
+*/
+static char **replay_values(char const *op, char const *arg) {
+	struct replay_call *call = replay_find(op, arg);
+	
+	return call ? copy_list(call->values) : single_list(NULL);
+}
+
+/* Returns the recorded form of the printer details used by NetPrinters */
+static char **printer_values(PRINTER_INFO_2 const *info) {
+	char **values = allocate(sizeof(char*) * 8), buf[32];
+	
+	values[0] = copy_string(info->pDriverName ? info->pDriverName : "");
+	values[1] = copy_string(info->pPortName ? info->pPortName : "");
+	values[2] = copy_string(info->pServerName ? info->pServerName : "");
+	values[3] = copy_string(info->pShareName ? info->pShareName : "");
+	
+	sprintf(buf, "%lu", (unsigned long)info->Status);
+	values[4] = copy_string(buf);
+	
+	sprintf(buf, "%lu", (unsigned long)info->Attributes);
+	values[5] = copy_string(buf);
+	
+	sprintf(buf, "%lu", (unsigned long)info->cJobs);
+	values[6] = copy_string(buf);
+	
+	values[7] = NULL;
+	return values;
+}
+
+/* Rebuild printer details from the values written by printer_values(), in a
+ * single buffer so they can be freed the same way as those from GetPrinter().
+*/
+static PRINTER_INFO_2 *printer_from_values(char **values) {
+	char const *fields[7] = {"", "", "", "", "0", "0", "0"};
+	PRINTER_INFO_2 *info;
+	size_t size = sizeof(PRINTER_INFO_2);
+	unsigned int fnum;
+	char *str;
+	
+	for(fnum = 0; fnum < 7 && values[fnum]; fnum++) {
+		fields[fnum] = values[fnum];
+	}
+	
+	for(fnum = 0; fnum < 4; fnum++) {
+		size += strlen(fields[fnum])+1;
+	}
+	
+	info = allocate(size);
+	memset(info, 0, sizeof(PRINTER_INFO_2));
+	str = (char*)(info+1);
+	
+	info->pDriverName = strcpy(str, fields[0]);
+	str += strlen(str)+1;
+	info->pPortName = strcpy(str, fields[1]);
+	str += strlen(str)+1;
+	info->pServerName = strcpy(str, fields[2]);
+	str += strlen(str)+1;
+	info->pShareName = strcpy(str, fields[3]);
+	
+	info->Status = strtoul(fields[4], NULL, 10);
+	info->Attributes = strtoul(fields[5], NULL, 10);
+	info->cJobs = strtoul(fields[6], NULL, 10);
+	
+	return info;
+}
+
+/* Returns the path of a file in the directory NetPrinters keeps its local
+ * state in, creating the directory if necessary. The directory is NetPrinters
+ * under the user's local application data directory.
+*/
+static char *state_path(char const *name) {
+	char const *vars[] = {"LOCALAPPDATA", "APPDATA", "TEMP", NULL};
+	char base[MAX_PATH], *path;
+	unsigned int vnum;
+	DWORD len = 0;
+	
+	for(vnum = 0; vars[vnum]; vnum++) {
+		len = GetEnvironmentVariable(vars[vnum], base, sizeof(base));
+		if(len > 0 && len < sizeof(base)) {
+			break;
+		}
+	}
+	
+	if(!vars[vnum]) {
+		strcpy(base, ".");
+	}
+	
+	path = allocate(strlen(base) + strlen(name) + 14);
+	
+	sprintf(path, "%s\\NetPrinters", base);
+	CreateDirectory(path, NULL);
+	
+	strcat(path, "\\");
+	strcat(path, name);
+	
+	return path;
+}
+
+/* Take an exclusive lock on a file in the state directory, so other processes
+ * can't read, merge and rewrite it at the same time. The lock is taken on a
+ * separate .lock file, as the file itself is replaced rather than rewritten.
+ *
+ * Returns the handle to pass to state_unlock(), or INVALID_HANDLE_VALUE if the
+ * lock can't be taken.
+*/
+static HANDLE state_lock(char const *name) {
+	char *path = state_path(name), *lpath = allocate(strlen(path) + 6);
+	OVERLAPPED overlapped;
+	HANDLE lock;
+	
+	sprintf(lpath, "%s.lock", path);
+	
+	lock = CreateFile(lpath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	
+	free(lpath);
+	free(path);
+	
+	if(lock == INVALID_HANDLE_VALUE) {
+		return INVALID_HANDLE_VALUE;
+	}
+	
+	memset(&overlapped, 0, sizeof(overlapped));
+	
+	if(!LockFileEx(lock, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+		CloseHandle(lock);
+		return INVALID_HANDLE_VALUE;
+	}
+	
+	return lock;
+}
+
+/* Release a lock taken by state_lock() */
+static void state_unlock(HANDLE lock) {
+	OVERLAPPED overlapped;
+	
+	if(lock == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	
+	memset(&overlapped, 0, sizeof(overlapped));
+	UnlockFileEx(lock, 0, 1, 0, &overlapped);
+	CloseHandle(lock);
+}
+
+/* Returns the path a script should be read from
+ *
+ * Scripts on network drives or UNC paths are copied to the local state
+ * directory, and the copy is used for as long as the size and last write time
+ * of the original (which are checked without reading it) are unchanged. If the
+ * original can't be reached, the copy is used with a warning.
+*/
+static char *cached_script(char const *filename) {
+	WIN32_FILE_ATTRIBUTE_DATA remote;
+	char name[32], *cache, *meta, *tmp;
+	unsigned long hash = 2166136261UL, size, wtime_hi, wtime_lo;
+	unsigned int cnum;
+	FILE *fh;
+	
+	if(strncmp(filename, "\\\\", 2) != 0) {
+		char root[] = "?:\\";
+		
+		root[0] = filename[0];
+		
+		if(filename[0] == '\0' || filename[1] != ':' || GetDriveType(root) != DRIVE_REMOTE) {
+			return copy_string(filename);
+		}
+	}
+	
+	for(cnum = 0; filename[cnum]; cnum++) {
+		hash = ((hash ^ (unsigned char)tolower(filename[cnum])) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	
+	sprintf(name, "script-%08lx.nps", hash);
+	cache = state_path(name);
+	
+	sprintf(name, "script-%08lx.meta", hash);
+	meta = state_path(name);
+	
+	if(!GetFileAttributesEx(filename, GetFileExInfoStandard, &remote)) {
+		DWORD error = GetLastError();
+		
+		if(GetFileAttributes(cache) == INVALID_FILE_ATTRIBUTES) {
+			free(cache);
+			cache = copy_string(filename);
+		}else{
+			log_printf("Warning:\t\tCan't reach %s (%s), using cached copy\n", filename, win32_strerr(error));
+		}
+		
+		free(meta);
+		return cache;
+	}
+	
+	if((fh = fopen(meta, "r"))) {
+		int valid = fscanf(fh, "%lu %lu %lu", &size, &wtime_hi, &wtime_lo) == 3
+			&& size == remote.nFileSizeLow
+			&& wtime_hi == remote.ftLastWriteTime.dwHighDateTime
+			&& wtime_lo == remote.ftLastWriteTime.dwLowDateTime
+			&& remote.nFileSizeHigh == 0;
+		
+		fclose(fh);
+		
+		if(valid && GetFileAttributes(cache) != INVALID_FILE_ATTRIBUTES) {
+			free(meta);
+			return cache;
+		}
+	}
+	
+	/* Copy to a temporary file first so an interrupted copy can't leave a
+	 * partial script behind to be used later.
+	*/
+	
+	tmp = allocate(strlen(cache) + 5);
+	sprintf(tmp, "%s.tmp", cache);
+	
+	if(CopyFile(filename, tmp, FALSE) && MoveFileEx(tmp, cache, MOVEFILE_REPLACE_EXISTING)) {
+		if((fh = fopen(meta, "w"))) {
+			fprintf(fh, "%lu %lu %lu\n", (unsigned long)remote.nFileSizeLow, (unsigned long)remote.ftLastWriteTime.dwHighDateTime, (unsigned long)remote.ftLastWriteTime.dwLowDateTime);
+			fclose(fh);
+		}
+	}else{
+		DeleteFile(tmp);
+		DeleteFile(meta);
+		
+		free(cache);
+		cache = copy_string(filename);
+	}
+	
+	free(tmp);
+	free(meta);
+	return cache;
+}
+
+/* Record the outcome and duration of an operation on the server of a printer,
+ * or the local spooler if the printer is NULL.
+*/
+static void stats_record(char const *printer, char const *op, int ok, DWORD duration) {
+	char server[256];
+	struct server_stats *entry;
+	unsigned int bucket = 0;
+	
+	/* The calls -explain pretends to make took no time */
+	
+	if(spooler == &explain_spooler) {
+		return;
+	}
+	
+	stats_server(printer, server, sizeof(server));
+	
+	while(duration && bucket < STATS_BUCKETS-1) {
+		duration >>= 1;
+		bucket++;
+	}
+	
+	EnterCriticalSection(&stats_lock);
+	
+	entry = stats_find(&run_stats, server, op);
+	
+	if(ok) {
+		entry->ok++;
+	}else{
+		entry->fail++;
+	}
+	
+	entry->buckets[bucket]++;
+	
+	LeaveCriticalSection(&stats_lock);
+}
+
+/* Write the lowercase server of a printer to a buffer, or "(local)" if the
+ * printer is NULL or isn't on a print server.
+*/
+static void stats_server(char const *printer, char *server, size_t size) {
+	size_t len;
+	
+	strcpy(server, "(local)");
+	
+	if(printer && strncmp(printer, "\\\\", 2) == 0) {
+		len = strcspn(printer+2, "\\");
+		
+		if(len > 0 && len < size) {
+			unsigned int cnum;
+			
+			for(cnum = 0; cnum < len; cnum++) {
+				server[cnum] = tolower((unsigned char)printer[2+cnum]);
+			}
+			
+			server[len] = '\0';
+		}
+	}
+}
+
+/* Find the entry for a server and operation in a stats table, adding it if
+ * it doesn't exist.
+*/
+static struct server_stats *stats_find(struct stats_table *table, char const *server, char const *op) {
+	unsigned int snum;
+	
+	for(snum = 0; snum < table->count; snum++) {
+		if(strcmp(table->entries[snum].server, server) == 0 && strcmp(table->entries[snum].op, op) == 0) {
+			return &(table->entries[snum]);
+		}
+	}
+	
+	if(table->count == table->alloc) {
+		struct server_stats *entries = allocate(sizeof(struct server_stats) * (table->alloc += 16));
+		
+		memcpy(entries, table->entries, sizeof(struct server_stats) * table->count);
+		free(table->entries);
+		table->entries = entries;
+	}
+	
+	struct server_stats *entry = &(table->entries[table->count++]);
+	
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->server, server, sizeof(entry->server)-1);
+	strncpy(entry->op, op, sizeof(entry->op)-1);
+	
+	return entry;
+}
+
+/* Read the stats file into a table
+ * Returns 1 on success, zero if the file doesn't exist or is invalid.
+*/
+static int stats_load(struct stats_table *table) {
+	char *path = state_path(STATS_FILE), line[1024];
+	FILE *fh = fopen(path, "r");
+	
+	free(path);
+	
+	if(!fh) {
+		return 0;
+	}
+	
+	if(!fgets(line, sizeof(line), fh) || strncmp(line, STATS_MAGIC, strlen(STATS_MAGIC)) != 0) {
+		fclose(fh);
+		return 0;
+	}
+	
+	while(fgets(line, sizeof(line), fh)) {
+		char *server = strtok(line, "\t"), *op = strtok(NULL, "\t"), *counts = strtok(NULL, "\r\n");
+		struct server_stats *entry;
+		unsigned int bucket;
+		
+		if(!server || !op || !counts) {
+			continue;
+		}
+		
+		entry = stats_find(table, server, op);
+		entry->ok += strtoul(counts, &counts, 10);
+		entry->fail += strtoul(counts, &counts, 10);
+		
+		for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+			entry->buckets[bucket] += strtoul(counts, &counts, 10);
+		}
+	}
+	
+	fclose(fh);
+	return 1;
+}
+
+/* Merge the statistics recorded by this run into the stats file, and the
+ * connect durations into the history file.
+ *
+ * The file is read again rather than kept in memory, and is locked with
+ * state_lock() from reading it until it's replaced, so runs which overlap
+ * don't lose each other's statistics. If it can't be locked the statistics are
+ * kept for the next save rather than merged unlocked.
+*/
+static void stats_save(void) {
+	static int saving = 0;
+	struct stats_table table = {NULL, 0, 0};
+	char *path, *tmp;
+	unsigned int snum, bucket;
+	HANDLE lock;
+	FILE *fh;
+	
+	/* Replayed calls say nothing about the servers now, and saving is set
+	 * before anything can report an error, as the error callback could call
+	 * np_finish() while saving.
+	*/
+	
+	if(saving || replaying()) {
+		return;
+	}
+	
+	saving = 1;
+	history_save();
+	
+	if(run_stats.count == 0) {
+		saving = 0;
+		return;
+	}
+	
+	if((lock = state_lock(STATS_FILE)) == INVALID_HANDLE_VALUE) {
+		show_error("Can't lock %s, statistics not saved: %s", STATS_FILE, win32_strerr(GetLastError()));
+		saving = 0;
+		return;
+	}
+	
+	stats_load(&table);
+	
+	for(snum = 0; snum < run_stats.count; snum++) {
+		struct server_stats *src = &(run_stats.entries[snum]);
+		struct server_stats *dest = stats_find(&table, src->server, src->op);
+		
+		dest->ok += src->ok;
+		dest->fail += src->fail;
+		
+		for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+			dest->buckets[bucket] += src->buckets[bucket];
+		}
+	}
+	
+	path = state_path(STATS_FILE);
+	tmp = allocate(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	
+	if((fh = fopen(tmp, "w"))) {
+		fprintf(fh, "%s\n", STATS_MAGIC);
+		
+		for(snum = 0; snum < table.count; snum++) {
+			struct server_stats *entry = &(table.entries[snum]);
+			
+			fprintf(fh, "%s\t%s\t%lu %lu", entry->server, entry->op, entry->ok, entry->fail);
+			
+			for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+				fprintf(fh, " %lu", entry->buckets[bucket]);
+			}
+			
+			fputc('\n', fh);
+		}
+		
+		if(fclose(fh) == 0 && MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+			run_stats.count = 0;
+		}else{
+			DeleteFile(tmp);
+		}
+	}
+	
+	state_unlock(lock);
+	
+	free(table.entries);
+	free(tmp);
+	free(path);
+	
+	saving = 0;
+}
+
+/* Print the statistics from the stats file */
+static void stats_print(void) {
+	struct stats_table table = {NULL, 0, 0};
+	unsigned int snum;
+	
+	stats_save();
+	
+	if(!stats_load(&table)) {
+		log_printf("No statistics recorded\n");
+		return;
+	}
+	
+	log_printf("%-24s %-12s %8s %8s %9s %9s %9s\n", "Server", "Operation", "OK", "Failed", "p50 (ms)", "p90 (ms)", "p99 (ms)");
+	
+	for(snum = 0; snum < table.count; snum++) {
+		struct server_stats *entry = &(table.entries[snum]);
+		
+		log_printf("%-24s %-12s %8lu %8lu %9lu %9lu %9lu\n", entry->server, entry->op, entry->ok, entry->fail,
+			stats_percentile(entry, 50), stats_percentile(entry, 90), stats_percentile(entry, 99));
+	}
+	
+	free(table.entries);
+}
+
+/* Returns an upper bound, in milliseconds, of the given percentile of the
+ * durations recorded in a histogram.
+*/
+static unsigned long stats_percentile(struct server_stats const *entry, unsigned int percent) {
+	unsigned long total = 0, seen = 0;
+	unsigned int bucket;
+	
+	for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		total += entry->buckets[bucket];
+	}
+	
+	for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		seen += entry->buckets[bucket];
+		
+		if(seen * 100 >= total * percent) {
+			break;
+		}
+	}
+	
+	return bucket < STATS_BUCKETS ? (1UL << bucket) - 1 : 0;
+}
+
+/* Find the history of a printer, adding it if it doesn't exist and add is
+ * set. Returns NULL if the printer isn't in the table.
+*/
+static struct printer_history *history_find(struct history_table *table, char const *printer, int add) {
+	struct printer_history *entry;
+	unsigned int hnum;
+	
+	for(hnum = 0; hnum < table->count; hnum++) {
+		if(ncase_match(table->entries[hnum].printer, printer)) {
+			return &(table->entries[hnum]);
+		}
+	}
+	
+	if(!add) {
+		return NULL;
+	}
+	
+	if(table->count == table->alloc) {
+		struct printer_history *entries = allocate(sizeof(struct printer_history) * (table->alloc += 16));
+		
+		memcpy(entries, table->entries, sizeof(struct printer_history) * table->count);
+		free(table->entries);
+		table->entries = entries;
+	}
+	
+	entry = &(table->entries[table->count++]);
+	
+	memset(entry, 0, sizeof(*entry));
+	entry->printer = fold_copy(printer, strlen(printer));
+	
+	return entry;
+}
+
+/* Read the history file into a table, which has a line for each printer with
+ * its average connect duration and the number of connections it's from.
+ *
+ * Returns 1 on success, zero if the file doesn't exist or is invalid.
+*/
+static int history_load(struct history_table *table) {
+	char *path = state_path(HISTORY_FILE), line[1024];
+	FILE *fh = fopen(path, "r");
+	
+	free(path);
+	
+	if(!fh) {
+		return 0;
+	}
+	
+	if(!fgets(line, sizeof(line), fh) || strncmp(line, HISTORY_MAGIC, strlen(HISTORY_MAGIC)) != 0) {
+		fclose(fh);
+		return 0;
+	}
+	
+	while(fgets(line, sizeof(line), fh)) {
+		char *printer = strtok(line, "\t"), *counts = strtok(NULL, "\r\n");
+		struct printer_history *entry;
+		
+		if(!printer || !counts) {
+			continue;
+		}
+		
+		entry = history_find(table, printer, 1);
+		entry->average = strtoul(counts, &counts, 10);
+		entry->samples = strtoul(counts, &counts, 10);
+	}
+	
+	fclose(fh);
+	return 1;
+}
+
+/* Add the duration of a successful connection to the history of a printer
+ * The average favours recent connections, so it follows a printer getting
+ * faster once its driver is installed or slower when the server is busy.
+*/
+static void history_record(char const *printer, DWORD duration) {
+	struct printer_history *entry;
+	
+	/* -explain doesn't really connect */
+	
+	if(spooler == &explain_spooler) {
+		return;
+	}
+	
+	entry = history_find(&history, printer, 1);
+	
+	if(entry->samples == 0) {
+		entry->average = duration;
+	}else{
+		entry->average = (entry->average * 3 + duration) / 4;
+	}
+	
+	entry->samples++;
+	entry->updated = 1;
+}
+
+/* Write the printers connected during this run to the history file, keeping
+ * the other printers from the file as it is now. The file is locked like the
+ * stats file by stats_save(), and if it can't be the durations are kept for
+ * the next save.
+*/
+static void history_save(void) {
+	struct history_table table = {NULL, 0, 0};
+	unsigned int hnum, updated = 0;
+	char *path, *tmp;
+	HANDLE lock;
+	FILE *fh;
+	
+	for(hnum = 0; hnum < history.count; hnum++) {
+		updated += history.entries[hnum].updated;
+	}
+	
+	if(!updated) {
+		return;
+	}
+	
+	if((lock = state_lock(HISTORY_FILE)) == INVALID_HANDLE_VALUE) {
+		show_error("Can't lock %s, connect durations not saved: %s", HISTORY_FILE, win32_strerr(GetLastError()));
+		return;
+	}
+	
+	history_load(&table);
+	
+	for(hnum = 0; hnum < history.count; hnum++) {
+		struct printer_history *src = &(history.entries[hnum]);
+		
+		if(src->updated) {
+			struct printer_history *dest = history_find(&table, src->printer, 1);
+			
+			dest->average = src->average;
+			dest->samples = src->samples;
+		}
+	}
+	
+	path = state_path(HISTORY_FILE);
+	tmp = allocate(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	
+	if((fh = fopen(tmp, "w"))) {
+		fprintf(fh, "%s\n", HISTORY_MAGIC);
+		
+		for(hnum = 0; hnum < table.count; hnum++) {
+			fprintf(fh, "%s\t%lu %lu\n", table.entries[hnum].printer, table.entries[hnum].average, table.entries[hnum].samples);
+		}
+		
+		if(fclose(fh) == 0 && MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+			for(hnum = 0; hnum < history.count; hnum++) {
+				history.entries[hnum].updated = 0;
+			}
+		}else{
+			DeleteFile(tmp);
+		}
+	}
+	
+	state_unlock(lock);
+	
+	for(hnum = 0; hnum < table.count; hnum++) {
+		free(table.entries[hnum].printer);
+	}
+	
+	free(table.entries);
+	free(tmp);
+	free(path);
+}
+
+/* Read a NetPrinters script into memory and compile any Subnet directives
+ * Returns NULL if the script can't be opened.
+*/
+static struct script *load_script(char const *filename) {
+	char *path = cached_script(filename);
+	FILE *fh = fopen(path, "r");
+	
+	free(path);
+	
+	if(!fh) {
+		show_error("Can't open script %s: %s", filename, win32_strerr(GetLastError()));
+		return NULL;
+	}
+	
+	struct script *script = allocate(sizeof(struct script));
+	unsigned int lnum = 1, alloc = 0;
+	char buf[1024];
+	
+	memset(script, 0, sizeof(*script));
+	
+	while(fgets(buf, 1024, fh)) {
+		char *name, *value;
+		
+		split_line(buf, &name, &value);
+		
+		if(name[0] == '#') {
+			lnum++;
+			continue;
+		}
+		
+		if(script->count == alloc) {
+			struct script_line *lines = allocate(sizeof(struct script_line) * (alloc += 64));
+			
+			memcpy(lines, script->lines, sizeof(struct script_line) * script->count);
+			free(script->lines);
+			script->lines = lines;
+		}
+		
+		struct script_line *line = &(script->lines[script->count++]);
+		
+		line->lnum = lnum++;
+		line->name = copy_string(name);
+		line->value = copy_string(value);
+		line->subnet = NULL;
+		line->directive = directive_find(name, &(line->negated));
+		line->fact = (line->directive && !line->negated) ? line->directive->fact : -1;
+		
+		if(line->directive && line->directive->handler == &directive_subnet) {
+			line->subnet = subnet_insert(script, value, line->lnum);
+		}
+	}
+	
+	fclose(fh);
+	
+	script_index(script, sizeof(userenv) / sizeof(userenv[0]) - 1);
+	return script;
+}
+
+/* Free a script returned by load_script() */
+static void free_script(struct script *script) {
+	unsigned int lnum;
+	
+	for(lnum = 0; lnum < script->count; lnum++) {
+		free(script->lines[lnum].name);
+		free(script->lines[lnum].value);
+	}
+	
+	for(lnum = 0; lnum < script->index_size; lnum++) {
+		while(script->index[lnum]) {
+			struct block_key *key = script->index[lnum];
+			
+			script->index[lnum] = key->next;
+			free(key->key);
+			free(key);
+		}
+	}
+	
+	free(script->lines);
+	free(script->blocks);
+	free(script->general);
+	free(script->index);
+	free(script->fact_first);
+	subnet_free(script->subnets[0]);
+	subnet_free(script->subnets[1]);
+	free(script);
+}
+
+/* Parse and execute a NetPrinters script
+ *
+ * Only one process at a time executes a script for the same user, if another
+ * process is already executing it this one waits for it to finish and then
+ * uses its output and status instead of executing the script again. Watch
+ * mode needs the script to have been executed by this process.
+ *
+ * Returns 1 if the Exit directive was used, zero otherwise.
+*/
+static int exec_script(char const *filename) {
+	struct script *script;
+	HANDLE lock = NULL;
+	char *result = NULL, *tmp = NULL;
+	int exit_used = 0, errors_before = errors_occured;
+	
+	if(!watch_mode && spooler == &live_spooler && (exit_used = script_lock(filename, &lock, &result)) >= 0) {
+		ReleaseMutex(lock);
+		CloseHandle(lock);
+		free(result);
+		
+		return exit_used;
+	}
+	
+	if(result) {
+		tmp = allocate(strlen(result)+5);
+		sprintf(tmp, "%s.tmp", result);
+		result_fh = fopen(tmp, "w");
+	}
+	
+	errors_occured = 0;
+	exit_used = 0;
+	
+	if((script = load_script(filename))) {
+		exit_used = run_script(script);
+		free_script(script);
+	}
+	
+	if(result_fh) {
+		fprintf(result_fh, "status %d exit %d\n", errors_occured, exit_used);
+		
+		if(fclose(result_fh) != 0 || !MoveFileEx(tmp, result, MOVEFILE_REPLACE_EXISTING)) {
+			DeleteFile(tmp);
+		}
+		
+		result_fh = NULL;
+	}
+	
+	errors_occured |= errors_before;
+	
+	if(lock) {
+		ReleaseMutex(lock);
+		CloseHandle(lock);
+	}
+	
+	free(result);
+	free(tmp);
+	
+	return exit_used;
+}
+
+/* Evaluate a script with the explain backend, printing the lines which are
+ * reached and the spooler calls they'd make, then a summary of the plan and
+ * how long the calls would take. No printer connection is changed, and the
+ * statistics and history aren't updated.
+ *
+ * Returns 1 if the script used Exit, zero otherwise.
+*/
+static int explain_script(char const *filename) {
+	unsigned int cnum;
+	int exit_used;
+	
+	explain_base = spooler;
+	spooler = &explain_spooler;
+	
+	stats_load(&explain_stats);
+	
+	explain_printf("Explaining %s, only the lines which are reached are listed\n\n", filename);
+	exit_used = exec_script(filename);
+	
+	explain_printf("\nNew connections:\t%u\n", explain_new);
+	explain_printf("Deletions:\t\t%u\n", explain_counts[EXPLAIN_DELETE]);
+	explain_printf("Default printer:\t%s\n", explain_default ? explain_default : "unchanged");
+	explain_printf("Spooler calls:\n");
+	
+	for(cnum = 0; cnum < EXPLAIN_CALLS; cnum++) {
+		if(explain_counts[cnum]) {
+			explain_printf("\t%-24s %u\n", explain_call_names[cnum], explain_counts[cnum]);
+		}
+	}
+	
+	if(explain_unknown) {
+		explain_printf("Estimated time:\t\t%.1fs (%u call(s) without an estimate)\n", explain_total / 1000.0, explain_unknown);
+	}else{
+		explain_printf("Estimated time:\t\t%.1fs\n", explain_total / 1000.0);
+	}
+	
+	spooler = explain_base;
+	explain_base = NULL;
+	
+	while(explain_connections.count) {
+		list_remove(&explain_connections, explain_connections.count-1);
+	}
+	
+	free(explain_stats.entries);
+	explain_stats.entries = NULL;
+	explain_stats.count = explain_stats.alloc = 0;
+	
+	free(explain_default);
+	explain_default = NULL;
+	
+	memset(explain_counts, 0, sizeof(explain_counts));
+	explain_enumerated = 0;
+	explain_new = explain_unknown = 0;
+	explain_total = 0;
+	
+	return exit_used;
+}
+
+/* Report a call made or estimated by the explain backend, and add its
+ * duration to the estimated time. Calls made within a parallel_for() call are
+ * added to the first worker which would be free instead, see
+ * explain_parallel().
+ *
+ * Measured calls were made and took ms milliseconds, otherwise ms is an
+ * estimate and source says where it came from (NULL if there isn't one).
+*/
+static void explain_call(int call, char const *target, int measured, unsigned long ms, char const *source) {
+	char const *sep = target ? " " : "";
+	
+	EnterCriticalSection(&explain_lock);
+	
+	if(measured) {
+		explain_printf("\t%s%s%s\ttook %lu ms\n", explain_call_names[call], sep, target ? target : "", ms);
+	}else if(source) {
+		explain_printf("\t%s%s%s\test. %lu ms (%s)\n", explain_call_names[call], sep, target ? target : "", ms, source);
+	}else{
+		explain_printf("\t%s%s%s\tno estimate\n", explain_call_names[call], sep, target ? target : "");
+		explain_unknown++;
+	}
+	
+	explain_counts[call]++;
+	
+	if(call == EXPLAIN_ADD && !(source && strcmp(source, "already connected") == 0)) {
+		explain_new++;
+	}
+	
+	if(explain_group) {
+		unsigned int wnum, first = 0;
+		
+		for(wnum = 1; wnum < MAX_WORKERS; wnum++) {
+			if(explain_group[wnum] < explain_group[first]) {
+				first = wnum;
+			}
+		}
+		
+		explain_group[first] += ms;
+	}else{
+		explain_total += ms;
+	}
+	
+	LeaveCriticalSection(&explain_lock);
+}
+
+/* Estimate how long changing a printer connection would take, using the
+ * average time connecting to the printer has taken before (see history_load())
+ * or else the median recorded for the operation on its server by earlier runs.
+ *
+ * Returns where the estimate came from, or NULL if there isn't one.
+*/
+static char const *explain_estimate(char const *printer, char const *op, unsigned long *ms) {
+	struct printer_history *entry;
+	char server[256];
+	unsigned int snum;
+	
+	*ms = 0;
+	
+	if(strcmp(op, "connect") == 0) {
+		if(!history_loaded) {
+			history_load(&history);
+			history_loaded = 1;
+		}
+		
+		if((entry = history_find(&history, printer, 0))) {
+			*ms = entry->average;
+			return "history";
+		}
+	}
+	
+	stats_server(printer, server, sizeof(server));
+	
+	for(snum = 0; snum < explain_stats.count; snum++) {
+		struct server_stats *stats = &(explain_stats.entries[snum]);
+		
+		if(strcmp(stats->server, server) == 0 && strcmp(stats->op, op) == 0 && stats->ok) {
+			*ms = stats_percentile(stats, 50);
+			return "median for the server";
+		}
+	}
+	
+	return NULL;
+}
+
+/* Carry out a parallel_for() call one item at a time for the explain backend,
+ * so the calls are listed in the order they'd be started. The estimated time
+ * of the call is how long the busiest worker would take.
+*/
+static void explain_parallel(void *items, size_t size, unsigned int count, void (*func)(void*)) {
+	unsigned long workers[MAX_WORKERS], longest = 0;
+	unsigned int inum;
+	
+	memset(workers, 0, sizeof(workers));
+	
+	EnterCriticalSection(&explain_lock);
+	explain_group = workers;
+	LeaveCriticalSection(&explain_lock);
+	
+	for(inum = 0; inum < count; inum++) {
+		func((char*)items + inum * size);
+	}
+	
+	EnterCriticalSection(&explain_lock);
+	explain_group = NULL;
+	LeaveCriticalSection(&explain_lock);
+	
+	for(inum = 0; inum < MAX_WORKERS; inum++) {
+		if(workers[inum] > longest) {
+			longest = workers[inum];
+		}
+	}
+	
+	if(count > 1 && longest) {
+		explain_printf("\t(in parallel, est. %lu ms)\n", longest);
+	}
+	
+	EnterCriticalSection(&explain_lock);
+	explain_total += longest;
+	LeaveCriticalSection(&explain_lock);
+}
+
+/* Take the lock for executing a script as the current user, the lock is a
+ * mutex in the session namespace named after the user and the full path of
+ * the script. If the other run holds it for longer than SCRIPT_LOCK_MS the
+ * script is executed without the lock.
+ *
+ * Sets the lock handle (NULL if the mutex can't be created) and the path of
+ * the file the outcome of the script is shared through. If another process
+ * executed the script while this one waited for the lock and its outcome is
+ * used, returns 1 if it used Exit and zero otherwise, or -1 if the script
+ * should be executed.
+*/
+static int script_lock(char const *filename, HANDLE *lock, char **result) {
+	char path[MAX_PATH], name[64], **user = get_fact("Username");
+	unsigned long hash = 2166136261UL;
+	unsigned int cnum;
+	FILETIME start;
+	DWORD status;
+	
+	*lock = NULL;
+	*result = NULL;
+	
+	if(GetFullPathName(filename, sizeof(path), path, NULL) >= sizeof(path)) {
+		strncpy(path, filename, sizeof(path)-1);
+		path[sizeof(path)-1] = '\0';
+	}
+	
+	for(cnum = 0; user[0] && user[0][cnum]; cnum++) {
+		hash = ((hash ^ (unsigned char)tolower(user[0][cnum])) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	
+	hash = ((hash ^ '\n') * 16777619UL) & 0xFFFFFFFFUL;
+	
+	for(cnum = 0; path[cnum]; cnum++) {
+		hash = ((hash ^ (unsigned char)tolower(path[cnum])) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	
+	sprintf(name, "Local\\netprinters-%08lx", hash);
+	
+	if(!(*lock = CreateMutex(NULL, FALSE, name))) {
+		log_printf("Can't create lock for %s: %s\n", filename, win32_strerr(GetLastError()));
+		return -1;
+	}
+	
+	sprintf(name, "result-%08lx.txt", hash);
+	*result = state_path(name);
+	
+	GetSystemTimeAsFileTime(&start);
+	
+	if((status = WaitForSingleObject(*lock, 0)) == WAIT_TIMEOUT) {
+		log_printf("Waiting for another run of %s to finish\n", filename);
+		log_flush();
+		
+		if((status = WaitForSingleObject(*lock, SCRIPT_LOCK_MS)) == WAIT_OBJECT_0) {
+			return script_result(*result, &start);
+		}
+	}
+	
+	if(status == WAIT_TIMEOUT) {
+		log_printf("Other run of %s didn't finish within %u seconds, executing it anyway\n", filename, SCRIPT_LOCK_MS / 1000);
+	}else if(status == WAIT_FAILED) {
+		log_printf("Can't take lock for %s: %s\n", filename, win32_strerr(GetLastError()));
+	}
+	
+	if(status != WAIT_OBJECT_0 && status != WAIT_ABANDONED) {
+		CloseHandle(*lock);
+		*lock = NULL;
+	}
+	
+	return -1;
+}
+
+/* Print the output of a run of a script by another process which finished
+ * after the given time and take on its status.
+ *
+ * Returns 1 if the run used Exit, zero if it didn't, or -1 if there's no
+ * such run.
+*/
+static int script_result(char const *path, FILETIME const *since) {
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	char *buf, *status;
+	int errors, exit_used;
+	size_t len;
+	FILE *fh;
+	
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &attr) || CompareFileTime(&(attr.ftLastWriteTime), since) < 0) {
+		return -1;
+	}
+	
+	if(!(fh = fopen(path, "r"))) {
+		return -1;
+	}
+	
+	buf = allocate(attr.nFileSizeLow+1);
+	len = fread(buf, 1, attr.nFileSizeLow, fh);
+	buf[len] = '\0';
+	fclose(fh);
+	
+	/* Everything up to the final "status" line is the output */
+	
+	while(len > 0 && buf[len-1] == '\n') {
+		buf[--len] = '\0';
+	}
+	
+	status = strrchr(buf, '\n') ? strrchr(buf, '\n')+1 : buf;
+	
+	if(sscanf(status, "status %d exit %d", &errors, &exit_used) != 2) {
+		free(buf);
+		return -1;
+	}
+	
+	status[0] = '\0';
+	
+	log_printf("Using the result of the run which just finished:\n");
+	log_printf("%s", buf);
+	
+	errors_occured |= errors;
+	
+	free(buf);
+	return exit_used;
+}
+
+/* Execute a script which has been read into memory, visiting its blocks
+ * through the index as described at walk_next().
+ *
+ * Returns 1 if the Exit directive was used, zero otherwise.
+*/
+static int run_script(struct script *script) {
+	struct block_walk walk;
+	unsigned int bnum;
+	int exit_used = 0;
+	
+	budget_start = GetTickCount();
+	walk_start(&walk, script, &fact_values);
+	
+	while(!exit_used && !oom_released && (bnum = walk_next(&walk)) != UINT_MAX) {
+		exit_used = run_block(script, &(script->blocks[bnum]));
+	}
+	
+	walk_free(&walk);
+	
+	if(!exit_used) {
+		if(spooler == &explain_spooler && (pending_count || schedule_count)) {
+			explain_printf("End of script:\n");
+		}
+		
+		flush_connections();
+		run_schedule();
+	}
+	
+	script_lnum = 0;
+	return exit_used;
+}
+
+/* Execute the lines of a block until a filter evaluates false, each line is
+ * handled according to its entry in the directives table.
+ * Returns 1 if the Exit directive was used, zero otherwise.
+*/
+static int run_block(struct script *script, struct script_block *block) {
+	unsigned int lnum;
+	
+	for(lnum = block->start; lnum < block->end; lnum++) {
+		struct script_line *line = &(script->lines[lnum]);
+		struct directive const *dir = line->directive;
+		char *name = line->name, *value = line->value;
+		int filter = -1;
+		DWORD start;
+		
+		script_lnum = line->lnum;
+		start = GetTickCount();
+		
+		if(spooler == &explain_spooler) {
+			explain_printf("Line %u:\t%s %s\n", line->lnum, name, value);
+		}
+		
+		if(!dir) {
+			show_error("Unknown directive %s at line %u", name, line->lnum);
+			log_record(line->lnum, name, value, "unknown directive", 0);
+			continue;
+		}
+		
+		if((dir->flags & DIRECTIVE_SPOOLER) && batch_planning) {
+			batch_add_action(dir, value);
+			continue;
+		}
+		
+		if((dir->flags & DIRECTIVE_SPOOLER) && budget) {
+			sched_add(dir, value);
+			continue;
+		}
+		
+		if(dir->flags & DIRECTIVE_FLUSH) {
+			flush_connections();
+		}
+		
+		filter = dir->handler(script, line);
+		
+		if(dir->flags & DIRECTIVE_EXIT) {
+			return 1;
+		}
+		
+		if(filter != -1 && line->negated) {
+			filter = !filter;
+		}
+		
+		if(filter != -1) {
+			log_record(line->lnum, name, value, filter ? "true" : "false", GetTickCount() - start);
+			
+			if(spooler == &explain_spooler) {
+				explain_printf("\t%s\n", filter ? "true" : "false, skipping the rest of the block");
+			}
+			
+			if(!filter) {
+				break;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+/* Set the time budget from a Budget directive, unless -b was used */
+static void set_budget(char const *value) {
+	char *end;
+	unsigned long seconds = strtoul(value, &end, 10);
+	
+	if(value[0] < '0' || value[0] > '9' || end[strspn(end, WHITESPACE)] != '\0' || seconds == 0 || seconds > 86400) {
+		show_error("Invalid budget '%s' at line %u", value, script_lnum);
+		log_record(script_lnum, "Budget", value, "invalid budget", 0);
+		return;
+	}
+	
+	if(!budget_arg) {
+		budget = seconds * 1000;
+	}
+	
+	log_record(script_lnum, "Budget", value, budget_arg ? "overridden by -b" : "ok", 0);
+}
+
+/* Returns the number of milliseconds left of the time budget */
+static DWORD budget_left(void) {
+	DWORD used = GetTickCount() - budget_start;
+	
+	return used < budget ? budget - used : 0;
+}
+
+/* Schedule a command directive to be carried out by run_schedule() */
+static void sched_add(struct directive const *directive, char const *value) {
+	struct sched_action *action;
+	
+	if(schedule_count == schedule_alloc) {
+		struct sched_action *actions = allocate(sizeof(struct sched_action) * (schedule_alloc += 16));
+		
+		memcpy(actions, schedule, sizeof(struct sched_action) * schedule_count);
+		free(schedule);
+		schedule = actions;
+	}
+	
+	action = &(schedule[schedule_count]);
+	
+	action->seq = schedule_count++;
+	action->lnum = script_lnum;
+	action->directive = directive;
+	action->value = copy_string(value);
+	action->priority = directive->priority;
+}
+
+/* Carry out the scheduled directives in priority order within the time budget
+ *
+ * Printers named by a DefaultPrinter directive are connected first, followed by
+ * the default printer being set, then the CriticalPrinter and AddPrinter
+ * connections, each class in parallel. DeletePrinter directives are carried out
+ * last and don't disconnect printers connected by later lines of the script.
+ * Each class of connections is only started if some of the budget is left,
+ * anything which isn't started is reported by sched_defer() and dropped, it
+ * isn't kept for a later run.
+*/
+static void run_schedule(void) {
+	unsigned int anum, bnum, cnum, deferred = 0;
+	
+	if(schedule_count == 0) {
+		return;
+	}
+	
+	for(anum = 0; anum < schedule_count; anum++) {
+		if(schedule[anum].priority != PRIORITY_DEFAULT) {
+			continue;
+		}
+		
+		for(bnum = 0; bnum < schedule_count; bnum++) {
+			struct sched_action *action = &(schedule[bnum]);
+			
+			if((action->priority == PRIORITY_CRITICAL || action->priority == PRIORITY_NORMAL) && sched_names(schedule[anum].value, action->value)) {
+				action->priority = PRIORITY_DEFAULT;
+			}
+		}
+	}
+	
+	qsort(schedule, schedule_count, sizeof(struct sched_action), &sched_cmp);
+	
+	for(anum = 0; anum < schedule_count; anum = bnum) {
+		int connects = 0;
+		
+		for(bnum = anum; bnum < schedule_count && schedule[bnum].priority == schedule[anum].priority; bnum++) {
+			if(schedule[bnum].directive->flags & DIRECTIVE_PARALLEL) {
+				connects = 1;
+			}
+		}
+		
+		if(connects && budget_left() == 0) {
+			while(anum < bnum) {
+				sched_defer(&(schedule[anum++]));
+				deferred++;
+			}
+			
+			continue;
+		}
+		
+		for(cnum = anum; cnum < bnum; cnum++) {
+			if(schedule[cnum].directive->flags & DIRECTIVE_PARALLEL) {
+				script_lnum = schedule[cnum].lnum;
+				connect_printer(schedule[cnum].value);
+			}
+		}
+		
+		flush_connections();
+		
+		for(cnum = anum; cnum < bnum; cnum++) {
+			struct sched_action *action = &(schedule[cnum]);
+			
+			if(action->directive->flags & DIRECTIVE_PARALLEL) {
+				continue;
+			}
+			
+			if(budget_left() == 0) {
+				sched_defer(action);
+				deferred++;
+				continue;
+			}
+			
+			script_lnum = action->lnum;
+			
+			if(action->priority == PRIORITY_CLEANUP) {
+				sched_deleting = action;
+				disconnect_by_expr(action->value);
+				sched_deleting = NULL;
+			}else{
+				default_printer(action->value);
+			}
+		}
+	}
+	
+	if(deferred) {
+		log_printf("Budget used up:\t\t%u directive(s) deferred after %.1fs\n", deferred, (GetTickCount() - budget_start) / 1000.0);
+	}
+	
+	for(anum = 0; anum < schedule_count; anum++) {
+		free(schedule[anum].value);
+	}
+	
+	schedule_count = 0;
+}
+
+/* Report a scheduled directive which wasn't carried out within the budget,
+ * deferring the default printer or a critical printer is an error.
+*/
+static void sched_defer(struct sched_action *action) {
+	if(action->priority == PRIORITY_DEFAULT || action->priority == PRIORITY_CRITICAL) {
+		show_error("Budget used up before line %u (%s %s)", action->lnum, action->directive->name, action->value);
+	}else{
+		log_printf("Deferred:\t\t%s %s\n", action->directive->name, action->value);
+	}
+	
+	log_record(action->lnum, action->directive->name, action->value, "deferred", 0);
+}
+
+/* qsort() comparison function which orders scheduled directives by priority,
+ * otherwise preserving the order of the script.
+*/
+static int sched_cmp(void const *a, void const *b) {
+	struct sched_action const *sa = a, *sb = b;
+	
+	if(sa->priority != sb->priority) {
+		return sa->priority - sb->priority;
+	}
+	
+	return sa->seq < sb->seq ? -1 : (sa->seq > sb->seq);
+}
+
+/* Check if a printer is one of the comma separated DefaultPrinter candidates,
+ * either by name or by matching a candidate expression.
+*/
+static int sched_names(char const *candidates, char const *printer) {
+	char *buf = copy_string(candidates), *cand;
+	int found = 0;
+	
+	for(cand = strtok(buf, ","); cand && !found; cand = strtok(NULL, ",")) {
+		size_t len;
+		
+		cand += strspn(cand, WHITESPACE);
+		len = strlen(cand);
+		
+		while(len > 0 && strchr(WHITESPACE, cand[len-1])) {
+			cand[--len] = '\0';
+		}
+		
+		found = ncase_match(cand, printer) || (is_pattern(cand) && expr_compare(printer, cand));
+	}
+	
+	free(buf);
+	return found;
+}
+
+/* Check if a printer is connected by a scheduled directive on a later line
+ * than the DeletePrinter directive being carried out, any replica of a
+ * ServerGroup counts.
+*/
+static int sched_kept(char const *printer) {
+	unsigned int anum, rnum;
+	struct server_group *group;
+	char const *share;
+	
+	if(!sched_deleting) {
+		return 0;
+	}
+	
+	for(anum = 0; anum < schedule_count; anum++) {
+		struct sched_action const *action = &(schedule[anum]);
+		
+		if(action->lnum <= sched_deleting->lnum || !(action->directive->flags & DIRECTIVE_PARALLEL)) {
+			continue;
+		}
+		
+		if(ncase_match(action->value, printer)) {
+			return 1;
+		}
+		
+		if((group = find_group(action->value, &share))) {
+			for(rnum = 0; rnum < group->servers.count; rnum++) {
+				char *path = replica_path(group, rnum, share);
+				int match = ncase_match(path, printer);
+				
+				free(path);
+				
+				if(match) {
+					return 1;
+				}
+			}
+		}
+	}
+	
+	return 0;
+}
+
+/* Add a subnet in CIDR notation (e.g. 10.1.0.0/16 or fd00::/8) to the prefix
+ * tree of a script.
+ *
+ * Returns the node for the subnet, or NULL if the subnet is invalid.
+*/
+static struct subnet_node *subnet_insert(struct script *script, char const *cidr, unsigned int lnum) {
+	struct sockaddr_storage addr;
+	int alen = sizeof(addr), family, plen, maxlen;
+	unsigned char const *bytes;
+	char abuf[64], *slash;
+	
+	if(strlen(cidr) >= sizeof(abuf) || !winsock_init()) {
+		goto SUBNET_INSERT_ERR;
+	}
+	
+	strcpy(abuf, cidr);
+	slash = strchr(abuf, '/');
+	if(slash) {
+		*(slash++) = '\0';
+	}
+	
+	family = strchr(abuf, ':') ? AF_INET6 : AF_INET;
+	maxlen = family == AF_INET6 ? 128 : 32;
+	
+	memset(&addr, 0, sizeof(addr));
+	if(WSAStringToAddress(abuf, family, NULL, (struct sockaddr*)&addr, &alen) != 0) {
+		goto SUBNET_INSERT_ERR;
+	}
+	
+	plen = maxlen;
+	if(slash) {
+		char *end;
+		
+		plen = strtol(slash, &end, 10);
+		if(slash[0] == '\0' || end[0] != '\0' || plen < 0 || plen > maxlen) {
+			goto SUBNET_INSERT_ERR;
+		}
+	}
+	
+	if(family == AF_INET6) {
+		bytes = ((struct sockaddr_in6*)&addr)->sin6_addr.s6_addr;
+	}else{
+		bytes = (unsigned char const*)&(((struct sockaddr_in*)&addr)->sin_addr);
+	}
+	
+	struct subnet_node **node = &(script->subnets[family == AF_INET6]);
+	int bit = 0;
+	
+	while(1) {
+		if(!*node) {
+			*node = allocate(sizeof(struct subnet_node));
+			memset(*node, 0, sizeof(struct subnet_node));
+		}
+		
+		if(bit == plen) {
+			break;
+		}
+		
+		node = &((*node)->child[(bytes[bit / 8] >> (7 - bit % 8)) & 1]);
+		bit++;
+	}
+	
+	(*node)->terminal = 1;
+	return *node;
+	
+	SUBNET_INSERT_ERR:
+	show_error("Invalid subnet %s at line %u", cidr, lnum);
+	return NULL;
+}
+
+/* Check if any local address is within the subnet of a Subnet directive
+ *
+ * The first call walks the prefix tree once for each local address and marks
+ * every subnet containing it, so the cost doesn't grow with the number of
+ * Subnet directives in the script.
+*/
+static int subnet_match(struct script *script, struct subnet_node *subnet) {
+	unsigned int anum;
+	
+	if(!script->subnets_resolved) {
+		load_local_addrs();
+		
+		for(anum = 0; anum < local_addr_count; anum++) {
+			struct sockaddr *addr = (struct sockaddr*)&(local_addrs[anum]);
+			struct subnet_node *node;
+			unsigned char const *bytes;
+			int bit, maxlen;
+			
+			if(addr->sa_family == AF_INET6) {
+				node = script->subnets[1];
+				bytes = ((struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+				maxlen = 128;
+			}else if(addr->sa_family == AF_INET) {
+				node = script->subnets[0];
+				bytes = (unsigned char const*)&(((struct sockaddr_in*)addr)->sin_addr);
+				maxlen = 32;
+			}else{
+				continue;
+			}
+			
+			for(bit = 0; node; bit++) {
+				if(node->terminal) {
+					node->matched = 1;
+				}
+				
+				if(bit == maxlen) {
+					break;
+				}
+				
+				node = node->child[(bytes[bit / 8] >> (7 - bit % 8)) & 1];
+			}
+		}
+		
+		script->subnets_resolved = 1;
+	}
+	
+	return subnet ? subnet->matched : 0;
+}
+
+/* Free a subnet prefix tree */
+static void subnet_free(struct subnet_node *node) {
+	if(node) {
+		subnet_free(node->child[0]);
+		subnet_free(node->child[1]);
+		free(node);
+	}
+}
+
+/* Hash the directives table into directive_index and look up the fact tested
+ * by each fact filter.
+*/
+static void directive_init(void) {
+	unsigned int dnum, fnum;
+	
+	for(dnum = 0; directives[dnum].name; dnum++) {
+		struct directive *dir = &(directives[dnum]);
+		unsigned long hash = directive_hash(dir->name) & (DIRECTIVE_HASH_SIZE-1);
+		
+		for(fnum = 0; dir->handler == &directive_fact && userenv[fnum].directive; fnum++) {
+			if(ncase_match(dir->name, userenv[fnum].directive)) {
+				dir->fact = fnum;
+			}
+		}
+		
+		dir->next = directive_index[hash];
+		directive_index[hash] = dir;
+	}
+}
+
+/* FNV-1a hash of a directive name, ignoring case */
+static unsigned long directive_hash(char const *name) {
+	unsigned long hash = 2166136261UL;
+	
+	for(; *name; name++) {
+		hash = ((hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	
+	return hash;
+}
+
+/* Look up a directive by name, a filter may be prefixed with ! to negate it
+ * which sets negated. Returns NULL if the directive is unknown.
+*/
+static struct directive const *directive_find(char const *name, int *negated) {
+	struct directive const *dir;
+	
+	*negated = (name[0] == '!');
+	
+	for(dir = directive_index[directive_hash(name + *negated) & (DIRECTIVE_HASH_SIZE-1)]; dir; dir = dir->next) {
+		if(ncase_match(name + *negated, dir->name)) {
+			return (*negated && !(dir->flags & DIRECTIVE_FILTER)) ? NULL : dir;
+		}
+	}
+	
+	return NULL;
+}
+
+/* AddPrinter and CriticalPrinter */
+static int directive_add(struct script *script, struct script_line const *line) {
+	connect_printer(line->value);
+	return -1;
+}
+
+static int directive_default(struct script *script, struct script_line const *line) {
+	default_printer(line->value);
+	return -1;
+}
+
+static int directive_delete(struct script *script, struct script_line const *line) {
+	disconnect_by_expr(line->value);
+	return -1;
+}
+
+static int directive_group(struct script *script, struct script_line const *line) {
+	define_group(line->value);
+	return -1;
+}
+
+static int directive_budget(struct script *script, struct script_line const *line) {
+	set_budget(line->value);
+	return -1;
+}
+
+static int directive_exit(struct script *script, struct script_line const *line) {
+	run_schedule();
+	log_printf("Line %u:\tExit used\n", line->lnum);
+	log_record(line->lnum, line->name, NULL, "ok", 0);
+	
+	return -1;
+}
+
+static int directive_subnet(struct script *script, struct script_line const *line) {
+	return subnet_match(script, line->subnet);
+}
+
+static int directive_env(struct script *script, struct script_line const *line) {
+	return envvar_compare(line->value);
+}
+
+/* NetBIOS, Username, IPAddress, Site, OU and OSVersion */
+static int directive_fact(struct script *script, struct script_line const *line) {
+	return fact_compare(userenv[line->directive->fact].directive, line->value);
+}
+
+/* Returns the values of the fact tested by the named filter directive,
+ * resolving it if this is the first time it has been used. Returns NULL if
+ * the directive isn't a known fact.
+*/
+static char **get_fact(char const *directive) {
+	unsigned int fnum;
+	
+	for(fnum = 0; userenv[fnum].directive; fnum++) {
+		if(ncase_match(directive, userenv[fnum].directive)) {
+			if(!userenv[fnum].values) {
+				DWORD start = GetTickCount();
+				
+				if(replaying()) {
+					userenv[fnum].values = replay_values("fact", userenv[fnum].directive);
+				}else{
+					userenv[fnum].values = userenv[fnum].resolve();
+				}
+				
+				record_call("fact", userenv[fnum].directive, TRUE, ERROR_SUCCESS, start, userenv[fnum].values);
+			}
+			
+			return userenv[fnum].values;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Returns the values of a fact by its index in userenv, for walk_next() */
+static char **fact_values(unsigned int fact) {
+	return get_fact(userenv[fact].directive);
+}
+
+/* Compare the values of a fact against an expression
+ * Returns 1 if any value matches, zero otherwise.
+*/
+static int fact_compare(char const *directive, char const *expr) {
+	char **values = get_fact(directive);
+	unsigned int vnum;
+	
+	for(vnum = 0; values[vnum]; vnum++) {
+		if(expr_compare(values[vnum], expr)) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Compare an environment variable against an expression, the value is the
+ * variable name followed by whitespace and the expression.
+ * Returns 1 upon match, zero if the variable is unset or doesn't match.
+*/
+static int envvar_compare(char const *value) {
+	size_t nlen = strcspn(value, WHITESPACE);
+	char const *expr = value+nlen+strspn(value+nlen, WHITESPACE);
+	char *vname = allocate(nlen+1), *vbuf = NULL;
+	DWORD size = 0, rsize, start = GetTickCount();
+	int ret = 0;
+	
+	strncpy(vname, value, nlen);
+	vname[nlen] = '\0';
+	
+	if(batch_planning) {
+		char const *vvalue = batch_getenv(vname);
+		
+		ret = vvalue ? expr_compare(vvalue, expr) : 0;
+		goto ENVVAR_COMPARE_END;
+	}
+	
+	if(replaying()) {
+		struct replay_call *call = replay_find("env", vname);
+		
+		ret = call && call->ok && call->values[0] ? expr_compare(call->values[0], expr) : 0;
+		goto ENVVAR_COMPARE_END;
+	}
+	
+	while((rsize = GetEnvironmentVariable(vname, vbuf, size)) >= size) {
+		if(rsize == 0) {
+			record_call("env", vname, FALSE, GetLastError(), start, NULL);
+			goto ENVVAR_COMPARE_END;
+		}
+		
+		free(vbuf);
+		vbuf = allocate(size = rsize);
+	}
+	
+	char *values[] = {vbuf, NULL};
+	
+	record_call("env", vname, TRUE, ERROR_SUCCESS, start, values);
+	ret = expr_compare(vbuf, expr);
+	
+	ENVVAR_COMPARE_END:
+	free(vbuf);
+	free(vname);
+	return ret;
+}
+
+/* NetBIOS name of the computer */
+static char **env_nbname(void) {
+	char buf[MAX_COMPUTERNAME_LENGTH+1];
+	DWORD size = sizeof(buf);
+	
+	if(!GetComputerName(buf, &size)) {
+		return single_list(NULL);
+	}
+	
+	return single_list(buf);
+}
+
+/* Name of the user running the program */
+static char **env_username(void) {
+	char *buf = NULL, **ret;
+	DWORD size = 0;
+	
+	while(!GetUserName(buf, &size)) {
+		if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+			free(buf);
+			return single_list(NULL);
+		}
+		
+		free(buf);
+		buf = allocate(size);
+	}
+	
+	ret = single_list(buf);
+	free(buf);
+	return ret;
+}
+
+/* Local IPv4 and IPv6 addresses, in their usual string form */
+static char **env_ipaddr(void) {
+	char **ret, buf[64];
+	unsigned int anum, count = 0;
+	
+	load_local_addrs();
+	
+	ret = allocate(sizeof(char*) * (local_addr_count+1));
+	
+	for(anum = 0; anum < local_addr_count; anum++) {
+		struct sockaddr *addr = (struct sockaddr*)&(local_addrs[anum]);
+		DWORD size = sizeof(buf);
+		int alen = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		
+		if(WSAAddressToString(addr, alen, NULL, buf, &size) == 0) {
+			ret[count++] = copy_string(buf);
+		}
+	}
+	
+	ret[count] = NULL;
+	return ret;
+}
+
+/* Active Directory site of the computer */
+static char **env_site(void) {
+	char *site, **ret;
+	
+	if(DsGetSiteName(NULL, &site) != ERROR_SUCCESS) {
+		return single_list(NULL);
+	}
+	
+	ret = single_list(site);
+	NetApiBufferFree(site);
+	return ret;
+}
+
+/* Distinguished name of the OU containing the computer object, e.g.
+ * "OU=Lab,OU=Workstations,DC=example,DC=com"
+*/
+static char **env_ou(void) {
+	char *buf = NULL, *ou, **ret;
+	ULONG size = 0;
+	
+	while(!GetComputerObjectName(NameFullyQualifiedDN, buf, &size)) {
+		if(GetLastError() != ERROR_INSUFFICIENT_BUFFER && GetLastError() != ERROR_MORE_DATA) {
+			free(buf);
+			return single_list(NULL);
+		}
+		
+		free(buf);
+		buf = allocate(size+1);
+	}
+	
+	/* Skip the CN= of the computer itself, commas in RDNs are escaped */
+	
+	for(ou = buf; ou[0] != '\0' && ou[0] != ','; ou++) {
+		if(ou[0] == '\\' && ou[1] != '\0') {
+			ou++;
+		}
+	}
+	
+	ret = single_list(ou[0] == ',' ? ou+1 : NULL);
+	free(buf);
+	return ret;
+}
+
+/* Windows version as "major.minor.build" */
+static char **env_osver(void) {
+	HMODULE ntdll = GetModuleHandle("ntdll.dll");
+	rtl_get_version get_version = ntdll ? (rtl_get_version)GetProcAddress(ntdll, "RtlGetVersion") : NULL;
+	OSVERSIONINFOW wver;
+	OSVERSIONINFO osver;
+	char buf[64];
+	
+	wver.dwOSVersionInfoSize = sizeof(wver);
+	if(get_version && get_version(&wver) == 0) {
+		sprintf(buf, "%lu.%lu.%lu", wver.dwMajorVersion, wver.dwMinorVersion, wver.dwBuildNumber & 0xFFFF);
+		return single_list(buf);
+	}
+	
+	osver.dwOSVersionInfoSize = sizeof(osver);
+	if(!GetVersionEx(&osver)) {
+		return single_list(NULL);
+	}
+	
+	sprintf(buf, "%lu.%lu.%lu", osver.dwMajorVersion, osver.dwMinorVersion, osver.dwBuildNumber & 0xFFFF);
+	return single_list(buf);
+}
+
+/* Initialise winsock if it hasn't been already
+ * Returns 1 on success, zero on failure.
+*/
+static int winsock_init(void) {
+	static int status = -1;
+	WSADATA wsdata;
+	
+	if(status == -1) {
+		status = WSAStartup(MAKEWORD(2,2), &wsdata) == 0;
+	}
+	
+	return status;
+}
+
+/* Read the local IPv4/IPv6 addresses into the local_addrs array, only the
+ * first call does anything.
+*/
+static void load_local_addrs(void) {
+	static int loaded = 0;
+	int families[] = {AF_INET, AF_INET6}, fnum;
+	char buf[4096], **saved;
+	DWORD start = GetTickCount();
+	
+	if(loaded) {
+		return;
+	}
+	
+	loaded = 1;
+	
+	if(!winsock_init()) {
+		return;
+	}
+	
+	if(replaying()) {
+		unsigned int anum;
+		
+		saved = replay_values("addrs", NULL);
+		
+		for(anum = 0; saved[anum]; anum++) {
+			local_addr_count++;
+		}
+		
+		local_addrs = allocate(sizeof(*local_addrs) * (local_addr_count+1));
+		local_addr_count = 0;
+		
+		for(anum = 0; saved[anum]; anum++) {
+			struct sockaddr_storage *addr = &(local_addrs[local_addr_count]);
+			int alen = sizeof(*addr);
+			
+			memset(addr, 0, sizeof(*addr));
+			
+			if(WSAStringToAddress(saved[anum], strchr(saved[anum], ':') ? AF_INET6 : AF_INET, NULL, (struct sockaddr*)addr, &alen) == 0) {
+				local_addr_count++;
+			}
+		}
+		
+		free_list(saved);
+		return;
+	}
+	
+	for(fnum = 0; fnum < 2; fnum++) {
+		SOCKET_ADDRESS_LIST *list = (SOCKET_ADDRESS_LIST*)buf;
+		SOCKET sock = socket(families[fnum], SOCK_DGRAM, 0);
+		DWORD size;
+		int anum;
+		
+		if(sock == INVALID_SOCKET) {
+			continue;
+		}
+		
+		if(WSAIoctl(sock, SIO_ADDRESS_LIST_QUERY, NULL, 0, buf, sizeof(buf), &size, NULL, NULL) == 0) {
+			struct sockaddr_storage *addrs = allocate(sizeof(*addrs) * (local_addr_count+list->iAddressCount+1));
+			
+			memcpy(addrs, local_addrs, sizeof(*addrs) * local_addr_count);
+			free(local_addrs);
+			local_addrs = addrs;
+			
+			for(anum = 0; anum < list->iAddressCount; anum++) {
+				int alen = list->Address[anum].iSockaddrLength;
+				
+				if(alen > (int)sizeof(*addrs)) {
+					continue;
+				}
+				
+				memset(&(local_addrs[local_addr_count]), 0, sizeof(*addrs));
+				memcpy(&(local_addrs[local_addr_count++]), list->Address[anum].lpSockaddr, alen);
+			}
+		}
+		
+		closesocket(sock);
+	}
+	
+	if(record_fh) {
+		saved = env_ipaddr();
+		record_call("addrs", NULL, TRUE, ERROR_SUCCESS, start, saved);
+		free_list(saved);
+	}
+}
+
+/* Allocate memory, see oom_reserve. If there's still no memory once the
+ * reserve has been freed, waits for other threads to free some.
+*/
+static void *allocate(unsigned int size) {
+	void *ptr;
+	
+	while(!(ptr = malloc(size))) {
+		if(InterlockedExchange(&oom_released, 1) == 0) {
+			free(oom_reserve);
+			oom_reserve = NULL;
+			
+			show_error("Out of memory! Failed to allocate %u bytes, the rest of this operation is skipped", size);
+		}else{
+			Sleep(100);
+		}
+	}
+	
+	return ptr;
+}
+
+/* Returns a copy of a string in a newly allocated buffer */
+static char *copy_string(char const *str) {
+	char *ret = allocate(strlen(str)+1);
+	
+	strcpy(ret, str);
+	return ret;
+}
+
+/* Append a copy of a string to a list */
+static void list_add(struct str_list *list, char const *str) {
+	if(list->count == list->alloc) {
+		char **items = allocate(sizeof(char*) * (list->alloc += 16));
+		
+		memcpy(items, list->items, sizeof(char*) * list->count);
+		free(list->items);
+		list->items = items;
+	}
+	
+	list->items[list->count++] = copy_string(str);
+}
+
+/* Find a string in a list, ignoring case
+ * Returns the index of the string, or -1 if it isn't in the list.
+*/
+static int list_find(struct str_list *list, char const *str) {
+	unsigned int inum;
+	
+	for(inum = 0; inum < list->count; inum++) {
+		if(ncase_match(str, list->items[inum])) {
+			return inum;
+		}
+	}
+	
+	return -1;
+}
+
+/* Remove a string from a list, preserving the order of the others */
+static void list_remove(struct str_list *list, unsigned int index) {
+	free(list->items[index]);
+	memmove(list->items+index, list->items+index+1, sizeof(char*) * (list->count - index - 1));
+	list->count--;
+}
+
+/* Returns a NULL-terminated list containing a copy of the supplied string, or
+ * an empty list if the string is NULL.
+*/
+static char **single_list(char const *str) {
+	char **ret = allocate(sizeof(char*) * 2);
+	
+	ret[0] = str ? copy_string(str) : NULL;
+	ret[1] = NULL;
+	return ret;
+}
+
+/* Returns a copy of a NULL-terminated list of strings */
+static char **copy_list(char **list) {
+	unsigned int count = 0, n;
+	char **ret;
+	
+	while(list[count]) {
+		count++;
+	}
+	
+	ret = allocate(sizeof(char*) * (count+1));
+	
+	for(n = 0; n < count; n++) {
+		ret[n] = copy_string(list[n]);
+	}
+	
+	ret[count] = NULL;
+	return ret;
+}
+
+/* Free a NULL-terminated list of strings, which may itself be NULL */
+static void free_list(char **list) {
+	unsigned int n;
+	
+	for(n = 0; list && list[n]; n++) {
+		free(list[n]);
+	}
+	
+	free(list);
+}
+
+/* Call func with a pointer to each item of an array, using up to MAX_WORKERS
+ * threads. Items are started in array order.
+*/
+static void parallel_for(void *items, size_t size, unsigned int count, void (*func)(void*)) {
+	struct parallel_job job;
+	HANDLE threads[MAX_WORKERS];
+	unsigned int tnum, tcount = 0;
+	
+	if(spooler == &explain_spooler) {
+		explain_parallel(items, size, count, func);
+		return;
+	}
+	
+	job.items = items;
+	job.size = size;
+	job.count = count;
+	job.func = func;
+	job.next = 0;
+	
+	for(tnum = 1; tnum < count && tnum < MAX_WORKERS; tnum++) {
+		threads[tcount] = CreateThread(NULL, 0, &parallel_worker, &job, 0, NULL);
+		if(threads[tcount]) {
+			tcount++;
+		}
+	}
+	
+	parallel_worker(&job);
+	
+	if(tcount) {
+		WaitForMultipleObjects(tcount, threads, TRUE, INFINITE);
+	}
+	
+	for(tnum = 0; tnum < tcount; tnum++) {
+		CloseHandle(threads[tnum]);
+	}
+}
+
+/* Thread function for parallel_for(), takes items until none are left */
+static DWORD WINAPI parallel_worker(LPVOID arg) {
+	struct parallel_job *job = arg;
+	LONG inum;
+	
+	while((inum = InterlockedIncrement(&(job->next)) - 1) < (LONG)job->count) {
+		job->func(job->items + job->size * inum);
+	}
+	
+	return 0;
+}
+
+static void show_error(const char *fmt, ...) {
+	char msg[1024];
+	
+	va_list argv;
+	va_start(argv, fmt);
+	vsnprintf(msg, 1024, fmt, argv);
+	va_end(argv);
+	
+	if(log_pipe) {
+		log_printf("%s\n", msg);
+	}else{
+		if(callbacks.error) {
+			callbacks.error(callbacks.data, msg);
+		}
+		
+		if(result_fh) {
+			fprintf(result_fh, "%s\n", msg);
+		}
+	}
+	
+	errors_occured = 1;
+}
+
+/* Write human-readable output through the output callback, or to the client
+ * of the agent while it's carrying out a command.
+ *
+ * -explain prints its own output with explain_printf() instead, the output of
+ * the calls it only pretends to make would be misleading.
+*/
+static void log_printf(char const *fmt, ...) {
+	va_list argv;
+	
+	if(spooler == &explain_spooler) {
+		return;
+	}
+	
+	va_start(argv, fmt);
+	log_vprintf(fmt, argv);
+	va_end(argv);
+}
+
+static void explain_printf(char const *fmt, ...) {
+	va_list argv;
+	
+	va_start(argv, fmt);
+	log_vprintf(fmt, argv);
+	va_end(argv);
+}
+
+static void log_vprintf(char const *fmt, va_list argv) {
+	va_list copy;
+	
+	if(log_pipe || callbacks.output) {
+		int len;
+		
+		va_copy(copy, argv);
+		len = _vscprintf(fmt, copy);
+		va_end(copy);
+		
+		if(len >= 0) {
+			char *text = allocate(len+1);
+			DWORD wlen;
+			
+			va_copy(copy, argv);
+			vsprintf(text, fmt, copy);
+			va_end(copy);
+			
+			if(log_pipe) {
+				WriteFile(log_pipe, text, len, &wlen, NULL);
+			}else{
+				callbacks.output(callbacks.data, text);
+			}
+			
+			free(text);
+		}
+	}
+	
+	if(result_fh) {
+		va_copy(copy, argv);
+		vfprintf(result_fh, fmt, copy);
+		va_end(copy);
+	}
+}
+
+/* Pass a record of a directive to the result callback and write it to the
+ * JSON-lines stream, if one was opened. The lnum is zero for operations which
+ * aren't part of a script and the target may be NULL.
+*/
+static void log_record(unsigned int lnum, char const *action, char const *target, char const *result, DWORD duration) {
+	if(spooler == &explain_spooler) {
+		return;
+	}
+	
+	if(callbacks.result) {
+		struct np_result record = {lnum, action, target, result, duration};
+		
+		callbacks.result(callbacks.data, &record);
+	}
+	
+	if(!json_log) {
+		return;
+	}
+	
+	if(lnum) {
+		fprintf(json_log, "{\"line\":%u,\"action\":", lnum);
+	}else{
+		fprintf(json_log, "{\"line\":null,\"action\":");
+	}
+	
+	log_json_string(action);
+	fprintf(json_log, ",\"target\":");
+	log_json_string(target);
+	fprintf(json_log, ",\"result\":");
+	log_json_string(result);
+	fprintf(json_log, ",\"duration_ms\":%lu}\n", (unsigned long)duration);
+}
+
+/* Write a string to the JSON-lines stream as a JSON string, the string is
+ * converted from the ANSI codepage as a whole (so double-byte characters are
+ * kept together) and non-ASCII characters are escaped as UTF-16, characters
+ * outside the BMP as a surrogate pair.
+*/
+static void log_json_string(char const *str) {
+	WCHAR *wstr;
+	int len, wnum;
+	
+	if(!str) {
+		fputs("null", json_log);
+		return;
+	}
+	
+	fputc('"', json_log);
+	
+	/* If the string can't be converted its non-ASCII bytes are replaced */
+	
+	if((len = MultiByteToWideChar(CP_ACP, 0, str, -1, NULL, 0)) > 0) {
+		wstr = allocate(sizeof(WCHAR) * len);
+		MultiByteToWideChar(CP_ACP, 0, str, -1, wstr, len);
+	}else{
+		len = strlen(str)+1;
+		wstr = allocate(sizeof(WCHAR) * len);
+		
+		for(wnum = 0; wnum < len; wnum++) {
+			wstr[wnum] = (unsigned char)str[wnum] < 0x80 ? (WCHAR)str[wnum] : 0xFFFD;
+		}
+	}
+	
+	for(wnum = 0; wstr[wnum] != 0; wnum++) {
+		unsigned int c = wstr[wnum];
+		
+		if(c == '"' || c == '\\') {
+			fprintf(json_log, "\\%c", c);
+		}else if(c < 0x20) {
+			fprintf(json_log, "\\u%04x", c);
+		}else if(c < 0x80) {
+			fputc(c, json_log);
+		}else if(c >= 0xD800 && c < 0xDC00 && wstr[wnum+1] >= 0xDC00 && wstr[wnum+1] < 0xE000) {
+			fprintf(json_log, "\\u%04x\\u%04x", c, (unsigned int)wstr[wnum+1]);
+			wnum++;
+		}else if(c >= 0xD800 && c < 0xE000) {
+			fputs("\\ufffd", json_log);
+		}else{
+			fprintf(json_log, "\\u%04x", c);
+		}
+	}
+	
+	free(wstr);
+	fputc('"', json_log);
+}
+
+/* Flush any buffered output */
+static void log_flush(void) {
+	if(callbacks.flush) {
+		callbacks.flush(callbacks.data);
+	}
+	
+	if(json_log) {
+		fflush(json_log);
+	}
+	
+	if(record_fh) {
+		fflush(record_fh);
+	}
+}
+
+/* Library interface, see libnetprinters.h */
+
+/* Start an operation, allocating the memory reserve again if it was used up
+ * Returns 1 if the operation can go ahead, zero if there's still no memory.
+*/
+static int op_start(void) {
+	errors_occured = 0;
+	
+	if(oom_released) {
+		if(!(oom_reserve = malloc(OOM_RESERVE))) {
+			show_error("Out of memory!");
+			return 0;
+		}
+		
+		oom_released = 0;
+	}
+	
+	return 1;
+}
+
+/* Returns the status of an operation, errors it reported are added to those
+ * from before it started.
+*/
+static int op_status(int errors_before) {
+	int status = errors_occured ? NP_ERRORS : 0;
+	
+	errors_occured |= errors_before;
+	return status;
+}
+
+void np_init(struct np_callbacks const *cb) {
+	static int initialised = 0;
+	
+	if(!initialised) {
+		InitializeCriticalSection(&stats_lock);
+		InitializeCriticalSection(&record_lock);
+		InitializeCriticalSection(&replay_lock);
+		InitializeCriticalSection(&explain_lock);
+		
+		directive_init();
+		initialised = 1;
+	}
+	
+	if(cb) {
+		callbacks = *cb;
+	}else{
+		memset(&callbacks, 0, sizeof(callbacks));
+	}
+}
+
+void np_finish(void) {
+	stats_save();
+	log_flush();
+	
+	if(json_log) {
+		fclose(json_log);
+		json_log = NULL;
+	}
+	
+	if(record_fh) {
+		fclose(record_fh);
+		record_fh = NULL;
+	}
+}
+
+int np_connect(char const * const *printers, unsigned int count) {
+	int errors_before = errors_occured;
+	unsigned int pnum;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	for(pnum = 0; pnum < count; pnum++) {
+		char *printer = copy_string(printers[pnum]);
+		
+		connect_printer(printer);
+		free(printer);
+	}
+	
+	flush_connections();
+	return op_status(errors_before);
+}
+
+int np_set_default(char const *printer) {
+	int errors_before = errors_occured;
+	char *buf;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	buf = copy_string(printer);
+	default_printer(buf);
+	free(buf);
+	
+	return op_status(errors_before);
+}
+
+int np_disconnect(char const *expr) {
+	int errors_before = errors_occured;
+	char *buf;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	buf = copy_string(expr);
+	disconnect_by_expr(buf);
+	free(buf);
+	
+	return op_status(errors_before);
+}
+
+int np_list(char const *expr) {
+	int errors_before = errors_occured;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	list_printers(expr);
+	
+	return op_status(errors_before);
+}
+
+int np_stats(void) {
+	int errors_before = errors_occured;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	stats_print();
+	
+	return op_status(errors_before);
+}
+
+char **np_printers(void) {
+	return get_printers();
+}
+
+void np_free_list(char **list) {
+	free_list(list);
+}
+
+int np_exec_script(char const *filename) {
+	int errors_before = errors_occured, exit_used;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	exit_used = exec_script(filename);
+	
+	return op_status(errors_before) | (exit_used ? NP_EXIT : 0);
+}
+
+int np_explain_script(char const *filename) {
+	int errors_before = errors_occured, exit_used;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	exit_used = explain_script(filename);
+	
+	return op_status(errors_before) | (exit_used ? NP_EXIT : 0);
+}
+
+int np_run_batch(char const *filename) {
+	int errors_before = errors_occured;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	run_batch(filename);
+	
+	return op_status(errors_before);
+}
+
+int np_run_agent(char const *filename) {
+	int errors_before = errors_occured;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	run_agent(filename);
+	
+	return op_status(errors_before);
+}
+
+int np_watch(void) {
+	int errors_before = errors_occured;
+	
+	if(!op_start()) {
+		return op_status(errors_before);
+	}
+	
+	if(spooler == &replay_spooler) {
+		show_error("Printer connections can't be watched while replaying spooler calls");
+	}else{
+		log_flush();
+		watch_printers();
+	}
+	
+	return op_status(errors_before);
+}
+
+int np_agent_query(char const *cmd) {
+	return agent_query(cmd);
+}
+
+int np_set_list_fields(char const *spec) {
+	return set_list_fields(spec);
+}
+
+void np_set_list_csv(int csv) {
+	list_csv = csv;
+}
+
+void np_set_watch(int watch) {
+	watch_mode = watch;
+}
+
+int np_set_budget(unsigned int seconds) {
+	if(seconds > 86400) {
+		show_error("Invalid budget: %u seconds", seconds);
+		return 0;
+	}
+	
+	budget = seconds * 1000;
+	budget_arg = 1;
+	
+	return 1;
+}
+
+int np_json_log(char const *filename) {
+	if(json_log) {
+		fclose(json_log);
+	}
+	
+	if(!(json_log = fopen(filename, "w"))) {
+		show_error("Can't open %s: %s", filename, strerror(errno));
+		return 0;
+	}
+	
+	return 1;
+}
+
+int np_record(char const *filename) {
+	return record_open(filename);
+}
+
+int np_replay(char const *filename) {
+	return replay_load(filename);
+}
+
+void np_set_replay_fast(int fast) {
+	replay_fast = fast;
+}
+
+void np_set_registry_list(int registry) {
+	registry_list = registry;
+}
@@ -0,0 +1,135 @@
+/* NetPrinters - Library interface
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LIBNETPRINTERS_H
+#define LIBNETPRINTERS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NP_VERSION "v2.2"
+
+/* Status flags returned by the operations below
+ * If memory runs out the library reports it through the error callback and
+ * skips the rest of the operation, which returns NP_ERRORS.
+*/
+#define NP_ERRORS	1	/* An error was reported through the error callback */
+#define NP_EXIT		2	/* The script used the Exit directive */
+
+/* Outcome of a directive or operation, the same as a record written by -j */
+struct np_result {
+	unsigned int line;	/* Line of the script, zero for operations */
+	char const *action;	/* Directive name, e.g. AddPrinter */
+	char const *target;	/* Printer or expression, may be NULL */
+	char const *result;	/* "ok", or what happened instead */
+	unsigned long duration;	/* Milliseconds */
+};
+
+/* Functions the library passes its output to, any of which may be NULL to
+ * discard it. The data pointer is passed to each of them.
+ *
+ * output is given human-readable text (not always whole lines), error is given
+ * one message at a time without a newline and flush is called whenever the
+ * output should be made visible, e.g. before waiting for something.
+*/
+struct np_callbacks {
+	void (*output)(void *data, char const *text);
+	void (*error)(void *data, char const *message);
+	void (*result)(void *data, struct np_result const *result);
+	void (*flush)(void *data);
+	
+	void *data;
+};
+
+/* The library keeps its state (e.g. statistics, ServerGroups and the
+ * connections it has made) between calls and must only be used by one thread
+ * at a time. np_init() must be called first and may be called again to change
+ * the callbacks, np_finish() saves the statistics and closes any files opened
+ * by np_json_log() or np_record().
+*/
+void np_init(struct np_callbacks const *cb);
+void np_finish(void);
+
+/* Printer operations, these return zero or NP_ERRORS
+ * np_connect() makes all the connections in parallel.
+*/
+int np_connect(char const * const *printers, unsigned int count);
+int np_set_default(char const *printer);
+int np_disconnect(char const *expr);
+int np_list(char const *expr);
+int np_stats(void);
+
+/* Returns a NULL-terminated list of the connected printers, or NULL on error.
+ * The list must be freed with np_free_list().
+*/
+char **np_printers(void);
+void np_free_list(char **list);
+
+/* Script operations, these return a combination of the status flags
+ * np_run_agent() and np_watch() only return once they've stopped.
+ * np_explain_script() prints what np_exec_script() would do without changing
+ * any printer connections.
+*/
+int np_exec_script(char const *filename);
+int np_explain_script(char const *filename);
+int np_run_batch(char const *filename);
+int np_run_agent(char const *filename);
+int np_watch(void);
+
+/* Send a command to the resident agent of this session, returns the agent's
+ * status or 1 if it can't be reached.
+*/
+int np_agent_query(char const *cmd);
+
+/* Settings, these return 1 on success and zero on error
+ * np_set_watch() makes later scripts run the way np_watch() needs them to.
+ * np_set_replay_fast() makes replayed calls return without waiting.
+ * np_set_registry_list() makes the connected printers be read from the user's
+ * registry when it agrees with the connections made, instead of the spooler.
+ * np_set_budget() sets the budget of each later script run, a budget of zero
+ * removes it, and a Budget directive is ignored once np_set_budget() has been
+ * used.
+*/
+int np_set_list_fields(char const *spec);
+void np_set_list_csv(int csv);
+void np_set_watch(int watch);
+int np_set_budget(unsigned int seconds);
+int np_json_log(char const *filename);
+int np_record(char const *filename);
+int np_replay(char const *filename);
+void np_set_replay_fast(int fast);
+void np_set_registry_list(int registry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !LIBNETPRINTERS_H */
@@ -28,44 +28,33 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+
 #include <windows.h>
-#include <winsock2.h>
-#include <lm.h>
-#include <security.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
-#define VERSION "v2.1"
-#define WHITESPACE "\r\n\t "
+#include "libnetprinters.h"
 
 #define ARGN_IS(arg) (strcmp(argv[argn], arg) == 0)
 
 static void print_usage(void);
-static char **get_printers(void);
-static char *win32_strerr(DWORD errnum);
-static void list_printers(void);
-static void connect_printer(char *printer);
-static void default_printer(char *printer);
-static void disconnect_printer(char *printer);
-static void disconnect_by_expr(char *expr);
-static void exec_script(char const *filename);
-static void load_env(void);
-static int expr_compare(char const *str, char const *expr);
-static int ncase_match(char const *str1, char const *str2);
-static void *allocate(unsigned int size);
+static void flush_queued(void);
+static void print_output(void *data, char const *text);
+static void print_error(void *data, char const *message);
+static void print_flush(void *data);
 static void show_error(const char *fmt, ...);
 static void do_exit(int status);
 
-static struct {
-	char username[1024];
-	char nbname[1024];
-} userenv = {{'\0'},{'\0'}};
-
 static int errors_pause = 0;
 static int errors_occured = 0;
 
+/* Printers given to consecutive -c arguments, which are connected together */
+static char const **queued = NULL;
+static unsigned int queued_count = 0;
+
+static struct np_callbacks callbacks = {&print_output, &print_error, NULL, &print_flush, NULL};
+
 static void print_usage(void) {
 	printf("Usage: netprinters.exe <arguments>\n");
 	printf("Arguments:\n\n");
@@ -73,270 +62,62 @@ static void print_usage(void) {
 	printf("-c <UNC path>\tConnect to a printer\n");
 	printf("-d <UNC path>\tSet default printer\n");
 	printf("-r <expression>\tDelete any matching printer connections\n");
-	printf("-l\t\tList connected printers\n");
+	printf("-l [expression]\tList connected printers (matching the expression)\n");
+	printf("-f <fields>\tFields listed by -l: server,share,driver,status,jobs,port\n");
+	printf("-csv\t\tList printers as CSV\n");
+	printf("-stats\t\tShow latency statistics for each print server\n");
 	printf("-s <filename>\tExecute a netprinters script\n");
+	printf("-explain <file>\tShow what a script would do without changing anything\n");
+	printf("-b <seconds>\tTime budget for the script, important directives first\n");
+	printf("-batch <file>\tExecute a script for every logged on user\n");
 	printf("-p\t\tPause before exiting if errors occur\n");
+	printf("-w\t\tKeep re-applying the printer connections when they change\n");
+	printf("-a <filename>\tExecute a script and run as this session's agent\n");
+	printf("-q <command>\tSend a command (list, add, remove, reapply) to the agent\n");
+	printf("-j <filename>\tWrite a JSON record of each directive to a file\n");
+	printf("-record <file>\tRecord every spooler call to a file\n");
+	printf("-replay <file>\tReplay recorded spooler calls instead of using the spooler\n");
+	printf("-fast\t\tReplay calls without waiting as long as they took\n");
+	printf("-reg\t\tRead the connected printers from the registry\n");
 }
 
-/* Returns a NULL-terminated list of connected printers obtained from the
- * EnumPrinters() win32 call, or NULL on error.
-*/
-static char **get_printers(void) {
-	PRINTER_INFO_4 *printers = NULL;
-	DWORD size = 0, count, n;
-	char **retbuf = NULL;
-	
-	while(!EnumPrinters(PRINTER_ENUM_CONNECTIONS, NULL, 4, (void*)printers, size, &size, &count)) {
-		if(GetLastError() != 122 && GetLastError() != 1784) {
-			show_error("Can't fetch printers: %s", win32_strerr(GetLastError()));
-			goto GET_PRINTERS_END;
-		}
-		
-		free(printers);
-		printers = allocate(size);
+/* Make the connections queued by -c arguments */
+static void flush_queued(void) {
+	if(queued_count) {
+		errors_occured |= np_connect(queued, queued_count) & NP_ERRORS;
+		queued_count = 0;
 	}
-	
-	retbuf = allocate(sizeof(char*) * (count+1));
-	retbuf[count] = NULL;
-	
-	for(n = 0; n < count; n++) {
-		char *pname = printers[n].pPrinterName;
-		
-		retbuf[n] = allocate(strlen(pname)+1);
-		strcpy(retbuf[n], pname);
-	}
-	
-	GET_PRINTERS_END:
-	free(printers);
-	return retbuf;
 }
 
-/* Equvilent of the strerr() function, using windows's backwards FormatMessage
- * API call.
- *
- * Returns string stored in static buffer
-*/
-static char *win32_strerr(DWORD errnum) {
-	static char buf[1024] = {'\0'};
-	
-	FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, errnum, 0, buf, 1023, NULL);
-	buf[strcspn(buf, "\r\n")] = '\0';
-	return buf;	
+static void print_output(void *data, char const *text) {
+	fputs(text, stdout);
 }
 
-/* List printers to stdout */
-static void list_printers(void) {
-	char **printers = get_printers();
-	unsigned int pnum = 0;
-	
-	while(printers[pnum]) {
-		puts(printers[pnum]);
-		free(printers[pnum]);
-		
-		pnum++;
-	}
-	
-	free(printers);
-}
-
-/* Connect to a network printer */
-static void connect_printer(char *printer) {
-	if(AddPrinterConnection((char*)printer)) {
-		printf("Added printer:\t\t%s\n", printer);
-	}else{
-		show_error("Can't connect to printer %s: %s", printer, win32_strerr(GetLastError()));
-	}
-}
-
-/* Set default printer */
-static void default_printer(char *printer) {
-	if(SetDefaultPrinter(printer)) {
-		printf("Set default printer:\t%s\n", printer);
-	}else{
-		show_error("Can't set printer %s as default: %s", printer, win32_strerr(GetLastError()));
-	}
-}
-
-/* Disconnect from a printer */
-static void disconnect_printer(char *printer) {
-	if(DeletePrinterConnection(printer)) {
-		printf("Disconnected from:\t%s\n", printer);
-	}else{
-		show_error("Can't disconnect from printer %s: %s", printer, win32_strerr(GetLastError()));
-	}
-}
-
-/* Disconnect from any printers matching the supplied expression */
-static void disconnect_by_expr(char *expr) {
-	char **printers = get_printers();
-	unsigned int pnum = 0;
-	
-	while(printers[pnum]) {
-		char *pname = printers[pnum++];
-		
-		if(expr_compare(pname, expr)) {
-			disconnect_printer(pname);
-		}
-		
-		free(pname);
-	}
-	
-	free(printers);
-}
-
-/* Parse and execute a NetPrinters script */
-static void exec_script(char const *filename) {
-	FILE *fh = fopen(filename, "r");
-	if(!fh) {
-		show_error("Can't open script %s: %s", filename, win32_strerr(GetLastError()));
-		return;
-	}
-	
-	char buf[1024];
-	unsigned int lnum = 1;
-	int sblock = 0;
-	
-	while(fgets(buf, 1024, fh)) {
-		char *name = buf+strspn(buf, WHITESPACE);
-		char *value = name+strcspn(name, WHITESPACE);
-		
-		if(value[0] != '\0') {
-			value[0] = '\0';
-			value++;
-			value += strspn(value, WHITESPACE);
-			value[strcspn(value, "\r\n")] = '\0';
-		}
-		
-		if(name[0] == '\0') {
-			sblock = 0;
-		}
-		if(name[0] == '#' || name[0] == '\0' || sblock) {
-			lnum++;
-			continue;
-		}
-		
-		if(ncase_match(name, "AddPrinter")) {
-			connect_printer(value);
-		}else if(ncase_match(name, "DefaultPrinter")) {
-			default_printer(value);
-		}else if(ncase_match(name, "DeletePrinter")) {
-			disconnect_by_expr(value);
-		}else if(ncase_match(name, "Exit")) {
-			printf("Line %u:\tExit used\n", lnum);
-			do_exit(0);
-		}else if(ncase_match(name, "NetBIOS")) {
-			if(!expr_compare(userenv.nbname, value)) {
-				sblock = 1;
-			}
-		}else if(ncase_match(name, "!NetBIOS")) {
-			if(expr_compare(userenv.nbname, value)) {
-				sblock = 1;
-			}
-		}else if(ncase_match(name, "Username")) {
-			if(!expr_compare(userenv.username, value)) {
-				sblock = 1;
-			}
-		}else if(ncase_match(name, "!Username")) {
-			if(expr_compare(userenv.username, value)) {
-				sblock = 1;
-			}
-		}else{
-			show_error("Unknown directive %s at line %u", name, lnum);
-		}
-		
-		lnum++;
-	}
-	
-	fclose(fh);
-}
-
-/* Read the environment information into the userenv structure */
-static void load_env(void) {
-	DWORD bsize;
-	
-	bsize = sizeof(userenv.nbname)-1;
-	GetComputerName(userenv.nbname, &bsize);
-	
-	bsize = sizeof(userenv.username)-1;
-	GetUserName(userenv.username, &bsize);
-}
-
-/* Compare the supplied string and expression
- * Returns 1 upon match, zero otherwise.
-*/
-static int expr_compare(char const *str, char const *expr) {
-	while(1) {
-		if(expr[0] == '\0' && str[0] != '\0') {
-			return 0;
-		}
-		if(str[0] == '\0') {
-			if(expr[0] == '\0' || expr[0] == '*') {
-				break;
-			}
-			
-			return 0;
-		}
-		
-		if(expr[0] == '*') {
-			if(expr[1] == str[0]) {
-				expr += 2;
-			}
-			str++;
-			
-			continue;
-		}
-		if(expr[0] == '?' && str[0] != '\0') {
-			expr++;
-			str++;
-			
-			continue;
-		}
-		if(expr[0] == '#' && isdigit(str[0])) {
-			expr++;
-			str++;
-			
-			continue;
-		}
-		if(tolower(expr[0]) == tolower(str[0])) {
-			expr++;
-			str++;
-			
-			continue;
-		}
-		
-		return 0;
-	}
+static void print_error(void *data, char const *message) {
+	fflush(stdout);
+	fprintf(stderr, "%s\n", message);
+	fflush(stderr);
 	
-	return 1;
+	errors_occured = 1;
 }
 
-/* Compare two strings, ignoring case
- * Returns 1 if they match, zero otherwise.
-*/
-static int ncase_match(char const *str1, char const *str2) {
-	size_t pos = 0;
-	
-	while(tolower(str1[pos]) == tolower(str2[pos])) {
-		if(str1[pos] == '\0') {
-			return 1;
-		}
-		
-		pos++;
-	}
-	
-	return 0;
+static void print_flush(void *data) {
+	fflush(stdout);
+	fflush(stderr);
 }
 
 int main(int argc, char** argv) {
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
+	setvbuf(stdout, NULL, _IOFBF, 16384);
+	setvbuf(stderr, NULL, _IOFBF, 4096);
+	
+	np_init(&callbacks);
 	
 	if(argc < 2) {
 		print_usage();
 		return 1;
 	}
 	
-	printf("NetPrinters " VERSION "\n");
+	printf("NetPrinters " NP_VERSION "\n");
 	printf("Copyright (C) 2008 Daniel Collins\n\n");
 	
     	if(LOBYTE(LOWORD(GetVersion())) < 5) {
@@ -344,43 +125,163 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 	
-	load_env();
+	if(!(queued = malloc(sizeof(char*) * argc))) {
+		show_error("Out of memory!");
+		return 1;
+	}
 	
-	int argn = 1;
+	int argn = 1, watch_mode = 0;
 	while(argn < argc) {
+		if(!ARGN_IS("-c") && !ARGN_IS("-p") && !ARGN_IS("-j") && !ARGN_IS("-w") && !ARGN_IS("-f") && !ARGN_IS("-csv") && !ARGN_IS("-b")) {
+			flush_queued();
+		}
+		
 		if(ARGN_IS("-c")) {
 			if((argn + 1) == argc) {
 				show_error("-c requires an argument");
 				do_exit(1);
 			}
 			
-			connect_printer(argv[++argn]);
+			queued[queued_count++] = argv[++argn];
 		}else if(ARGN_IS("-d")) {
 			if((argn + 1) == argc) {
 				show_error("-d requires an argument");
 				do_exit(1);
 			}
 			
-			default_printer(argv[++argn]);
+			errors_occured |= np_set_default(argv[++argn]) & NP_ERRORS;
 		}else if(ARGN_IS("-r")) {
 			if((argn + 1) == argc) {
 				show_error("-r requires an argument");
 				do_exit(1);
 			}
 			
-			disconnect_by_expr(argv[++argn]);
+			errors_occured |= np_disconnect(argv[++argn]) & NP_ERRORS;
 		}else if(ARGN_IS("-l")) {
-			list_printers();
+			if((argn + 1) < argc && argv[argn+1][0] != '-') {
+				np_list(argv[++argn]);
+			}else{
+				np_list(NULL);
+			}
+			
+			do_exit(0);
+		}else if(ARGN_IS("-f")) {
+			if((argn + 1) == argc) {
+				show_error("-f requires an argument");
+				do_exit(1);
+			}
+			
+			if(!np_set_list_fields(argv[++argn])) {
+				do_exit(1);
+			}
+		}else if(ARGN_IS("-csv")) {
+			np_set_list_csv(1);
+		}else if(ARGN_IS("-stats")) {
+			np_stats();
 			do_exit(0);
 		}else if(ARGN_IS("-s")) {
+			int status;
+			
 			if((argn + 1) == argc) {
 				show_error("-s requires an argument");
 				do_exit(1);
 			}
 			
-			exec_script(argv[++argn]);
+			status = np_exec_script(argv[++argn]);
+			errors_occured |= status & NP_ERRORS;
+			
+			if(status & NP_EXIT) {
+				do_exit(0);
+			}
+		}else if(ARGN_IS("-explain")) {
+			int status;
+			
+			if((argn + 1) == argc) {
+				show_error("-explain requires an argument");
+				do_exit(1);
+			}
+			
+			status = np_explain_script(argv[++argn]);
+			errors_occured |= status & NP_ERRORS;
+			
+			if(status & NP_EXIT) {
+				do_exit(0);
+			}
+		}else if(ARGN_IS("-b")) {
+			char *end;
+			unsigned long seconds;
+			
+			if((argn + 1) == argc) {
+				show_error("-b requires an argument");
+				do_exit(1);
+			}
+			
+			seconds = strtoul(argv[++argn], &end, 10);
+			
+			if(argv[argn][0] < '0' || argv[argn][0] > '9' || *end != '\0' || seconds == 0 || seconds > 86400) {
+				show_error("Invalid budget: %s", argv[argn]);
+				do_exit(1);
+			}
+			
+			np_set_budget(seconds);
+		}else if(ARGN_IS("-batch")) {
+			if((argn + 1) == argc) {
+				show_error("-batch requires an argument");
+				do_exit(1);
+			}
+			
+			errors_occured |= np_run_batch(argv[++argn]) & NP_ERRORS;
+		}else if(ARGN_IS("-record")) {
+			if((argn + 1) == argc) {
+				show_error("-record requires an argument");
+				do_exit(1);
+			}
+			
+			if(!np_record(argv[++argn])) {
+				do_exit(1);
+			}
+		}else if(ARGN_IS("-replay")) {
+			if((argn + 1) == argc) {
+				show_error("-replay requires an argument");
+				do_exit(1);
+			}
+			
+			if(!np_replay(argv[++argn])) {
+				do_exit(1);
+			}
+		}else if(ARGN_IS("-fast")) {
+			np_set_replay_fast(1);
+		}else if(ARGN_IS("-reg")) {
+			np_set_registry_list(1);
 		}else if(ARGN_IS("-p")) {
 			errors_pause = 1;
+		}else if(ARGN_IS("-w")) {
+			np_set_watch(1);
+			watch_mode = 1;
+		}else if(ARGN_IS("-a")) {
+			if((argn + 1) == argc) {
+				show_error("-a requires an argument");
+				do_exit(1);
+			}
+			
+			np_run_agent(argv[++argn]);
+			do_exit(1);
+		}else if(ARGN_IS("-q")) {
+			if((argn + 1) == argc) {
+				show_error("-q requires an argument");
+				do_exit(1);
+			}
+			
+			do_exit(np_agent_query(argv[++argn]));
+		}else if(ARGN_IS("-j")) {
+			if((argn + 1) == argc) {
+				show_error("-j requires an argument");
+				do_exit(1);
+			}
+			
+			if(!np_json_log(argv[++argn])) {
+				do_exit(1);
+			}
 		}else{
 			show_error("Unknown argument: %s", argv[argn]);
 			do_exit(1);
@@ -389,18 +290,14 @@ int main(int argc, char** argv) {
 		argn++;
 	}
 	
-	do_exit(errors_occured);
-	return 0;
-}
-
-static void *allocate(unsigned int size) {
-	void *ptr = malloc(size);
-	if(!ptr) {
-		show_error("Out of memory! Failed to allocate %u bytes", size);
-		do_exit(1);
+	flush_queued();
+	
+	if(watch_mode) {
+		errors_occured |= np_watch() & NP_ERRORS;
 	}
 	
-	return ptr;
+	do_exit(errors_occured);
+	return 0;
 }
 
 static void show_error(const char *fmt, ...) {
@@ -411,13 +308,15 @@ static void show_error(const char *fmt, ...) {
 	vsnprintf(msg, 1024, fmt, argv);
 	va_end(argv);
 	
-	fprintf(stderr, "%s\n", msg);
-	errors_occured = 1;
+	print_error(NULL, msg);
 }
 
 static void do_exit(int status) {
+	np_finish();
+	
 	if(errors_pause && errors_occured) {
 		putchar('\n');
+		fflush(stdout);
 		system("pause");
 	}
 	
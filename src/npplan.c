@@ -0,0 +1,851 @@
+/* NetPrinters - Offline plan evaluator
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Evaluates a NetPrinters script for every row of a CSV file describing users
+ * and computers, without a print spooler, and prints the printer connections,
+ * deletions and default printers each row would get. This is a POSIX program
+ * for checking scripts on build servers, it isn't part of netprinters.exe.
+ *
+ * The first row of the CSV file names the columns. Columns named after a fact
+ * (NetBIOS, Username, IPAddress, Site, OU or OSVersion, Hostname is the same
+ * as NetBIOS) give the values of that fact, several values can be separated
+ * with semicolons. Any other column is an environment variable for Env
+ * filters. Facts without a column never match.
+ *
+ * Scripts are split into lines and blocks, and the blocks visited, by the same
+ * code as in netprinters.exe (expr.c and script.c), so a plan only differs
+ * from what netprinters.exe would do where a fact comes from the CSV file.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define WHITESPACE "\r\n\t "
+
+#include "expr.c"
+#include "script.c"
+
+#define ARGN_IS(arg) (strcmp(argv[argn], arg) == 0)
+
+/* Types of plan action, the names are printed in the plan */
+#define PLAN_ADD	0
+#define PLAN_DEFAULT	1
+#define PLAN_DELETE	2
+#define PLAN_EXIT	3
+
+/* Kinds of directive, see directives[] */
+#define DIRECTIVE_COMMAND	0	/* A PLAN_ type is in the action field */
+#define DIRECTIVE_FACT		1
+#define DIRECTIVE_ENV		2
+#define DIRECTIVE_SUBNET	3
+#define DIRECTIVE_IGNORED	4	/* Doesn't affect the plan (e.g. ServerGroup) */
+
+#define FACT_COUNT 6
+
+/* Entry in the table of script directives, each script line points to its
+ * entry (or NULL if the directive is unknown) like in libnetprinters.c.
+*/
+struct directive {
+	char const *name;
+	int kind;
+	int action;
+	int fact;	/* Fact tested by a DIRECTIVE_FACT directive, or -1 */
+};
+
+/* Subnet of a Subnet directive, kept in the subnet field of its line. Each
+ * row's addresses are compared with it directly rather than through the
+ * prefix tree libnetprinters.c builds for the local addresses.
+*/
+struct subnet_node {
+	int family;	/* 0 if the subnet is invalid */
+	unsigned char addr[16];
+	int plen;
+};
+
+struct plan_action {
+	int type;
+	char *target;
+	unsigned int lnum;
+	int matched;	/* Used by plan_diff() */
+};
+
+struct plan {
+	struct plan_action *actions;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+/* Row of the CSV file and the plans evaluated for it */
+struct plan_row {
+	unsigned int lnum;
+	char **cells;
+	unsigned int cell_count;	/* May be fewer than column_count */
+	char **facts[FACT_COUNT];	/* See row_fact() */
+	
+	struct plan plan;
+	struct plan old_plan;
+};
+
+/* Work shared between the threads evaluating the rows */
+struct plan_job {
+	struct plan_row *rows;
+	unsigned int count;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static void print_usage(void);
+static struct script *load_script(char const *filename);
+static struct directive const *directive_find(char const *name, int *negated);
+static struct subnet_node *subnet_parse(char const *value);
+static char **load_csv(FILE *fh, unsigned int *lnum);
+static char *csv_field(char const **pos);
+static void *plan_worker(void *arg);
+static void plan_eval(struct script *script, struct plan_row *row, struct plan *plan);
+static int plan_block(struct script *script, struct script_block *block, struct plan_row *row, struct plan *plan);
+static char const *row_cell(struct plan_row *row, int column);
+static char **row_fact(struct plan_row *row, unsigned int fact);
+static char **resolve_fact(unsigned int fact);
+static int fact_compare(struct plan_row *row, int fact, char const *expr);
+static int envvar_compare(struct plan_row *row, char const *value);
+static int subnet_compare(struct plan_row *row, struct subnet_node const *subnet);
+static void plan_add(struct plan *plan, int type, char const *target, unsigned int lnum);
+static void plan_print(struct plan_row *row, struct plan *plan, char const *prefix, int unmatched);
+static int plan_diff(struct plan_row *row);
+static char *row_label(struct plan_row *row);
+static void *allocate(unsigned int size);
+static char *copy_string(char const *str);
+static void show_error(const char *fmt, ...);
+
+static char const *fact_names[FACT_COUNT] = {"NetBIOS", "Username", "IPAddress", "Site", "OU", "OSVersion"};
+static char const *action_names[] = {"AddPrinter", "DefaultPrinter", "DeletePrinter", "Exit"};
+
+/* The directives of libnetprinters.c, facts are numbered as in fact_names */
+static struct directive const directives[] = {
+	{"AddPrinter",		DIRECTIVE_COMMAND,	PLAN_ADD,	-1},
+	{"CriticalPrinter",	DIRECTIVE_COMMAND,	PLAN_ADD,	-1},
+	{"DefaultPrinter",	DIRECTIVE_COMMAND,	PLAN_DEFAULT,	-1},
+	{"DeletePrinter",	DIRECTIVE_COMMAND,	PLAN_DELETE,	-1},
+	{"Exit",		DIRECTIVE_COMMAND,	PLAN_EXIT,	-1},
+	{"ServerGroup",		DIRECTIVE_IGNORED,	0,		-1},
+	{"Budget",		DIRECTIVE_IGNORED,	0,		-1},
+	{"Subnet",		DIRECTIVE_SUBNET,	0,		-1},
+	{"Env",			DIRECTIVE_ENV,		0,		-1},
+	{"NetBIOS",		DIRECTIVE_FACT,		0,		0},
+	{"Username",		DIRECTIVE_FACT,		0,		1},
+	{"IPAddress",		DIRECTIVE_FACT,		0,		2},
+	{"Site",		DIRECTIVE_FACT,		0,		3},
+	{"OU",			DIRECTIVE_FACT,		0,		4},
+	{"OSVersion",		DIRECTIVE_FACT,		0,		5},
+	{NULL, 0, 0, -1}
+};
+
+/* Column names from the first row of the CSV file, and the column giving each
+ * fact (-1 if there isn't one).
+*/
+static char **columns = NULL;
+static unsigned int column_count = 0;
+static int fact_columns[FACT_COUNT];
+
+static struct script *new_script = NULL, *old_script = NULL;
+
+/* Row being evaluated by each thread, for resolve_fact() */
+static pthread_key_t row_key;
+
+static void print_usage(void) {
+	printf("Usage: npplan [-t <threads>] [-diff <old script>] <script> <csv file>\n\n");
+	
+	printf("Prints the plan of each row of the CSV file as tab separated lines of\n");
+	printf("row, action, target and script line. With -diff only the actions which\n");
+	printf("differ from the old script are printed, preceded by + or -.\n");
+}
+
+int main(int argc, char** argv) {
+	struct plan_row *rows = NULL;
+	unsigned int row_count = 0, row_alloc = 0, lnum = 1, cnum, rnum, changed = 0;
+	char const *diff_file = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *tids;
+	struct plan_job job;
+	char **cells;
+	FILE *fh;
+	
+	int argn = 1, err;
+	while(argn < argc && argv[argn][0] == '-') {
+		if(ARGN_IS("-t") && argn + 1 < argc) {
+			threads = atol(argv[++argn]);
+		}else if(ARGN_IS("-diff") && argn + 1 < argc) {
+			diff_file = argv[++argn];
+		}else{
+			print_usage();
+			return 1;
+		}
+		
+		argn++;
+	}
+	
+	if(argn + 2 != argc) {
+		print_usage();
+		return 1;
+	}
+	
+	if(!(new_script = load_script(argv[argn])) || (diff_file && !(old_script = load_script(diff_file)))) {
+		return 1;
+	}
+	
+	if(!(fh = fopen(argv[argn+1], "r"))) {
+		show_error("Can't open %s: %s", argv[argn+1], strerror(errno));
+		return 1;
+	}
+	
+	if(!(columns = load_csv(fh, &lnum))) {
+		show_error("%s is empty", argv[argn+1]);
+		return 1;
+	}
+	
+	for(column_count = 0; columns[column_count]; column_count++) {}
+	
+	for(cnum = 0; cnum < FACT_COUNT; cnum++) {
+		fact_columns[cnum] = -1;
+	}
+	
+	for(cnum = 0; cnum < column_count; cnum++) {
+		unsigned int fnum;
+		
+		for(fnum = 0; fnum < FACT_COUNT; fnum++) {
+			if(ncase_match(columns[cnum], fact_names[fnum]) || (fnum == 0 && ncase_match(columns[cnum], "Hostname"))) {
+				fact_columns[fnum] = cnum;
+			}
+		}
+	}
+	
+	while((cells = load_csv(fh, &lnum))) {
+		if(row_count == row_alloc) {
+			struct plan_row *r;
+			
+			row_alloc = row_alloc ? row_alloc * 2 : 256;
+			r = allocate(sizeof(struct plan_row) * row_alloc);
+			
+			memcpy(r, rows, sizeof(struct plan_row) * row_count);
+			free(rows);
+			rows = r;
+		}
+		
+		memset(&(rows[row_count]), 0, sizeof(struct plan_row));
+		rows[row_count].lnum = lnum-1;
+		rows[row_count].cells = cells;
+		
+		for(cnum = 0; cells[cnum]; cnum++) {}
+		rows[row_count].cell_count = cnum;
+		
+		row_count++;
+	}
+	
+	fclose(fh);
+	
+	/* Evaluate the rows in parallel, then print them in order */
+	
+	job.rows = rows;
+	job.count = row_count;
+	job.next = 0;
+	pthread_mutex_init(&(job.lock), NULL);
+	pthread_key_create(&row_key, NULL);
+	
+	if(threads < 1) {
+		threads = 1;
+	}
+	
+	tids = allocate(sizeof(pthread_t) * threads);
+	
+	for(rnum = 0; rnum < (unsigned long)threads; rnum++) {
+		if((err = pthread_create(&(tids[rnum]), NULL, &plan_worker, &job)) != 0) {
+			show_error("Can't create thread: %s", strerror(err));
+			return 1;
+		}
+	}
+	
+	for(rnum = 0; rnum < (unsigned long)threads; rnum++) {
+		pthread_join(tids[rnum], NULL);
+	}
+	
+	for(rnum = 0; rnum < row_count; rnum++) {
+		if(old_script) {
+			changed += plan_diff(&(rows[rnum]));
+		}else{
+			plan_print(&(rows[rnum]), &(rows[rnum].plan), "", 0);
+		}
+	}
+	
+	fflush(stdout);
+	
+	if(old_script) {
+		fprintf(stderr, "%u of %u rows changed\n", changed, row_count);
+	}else{
+		fprintf(stderr, "Evaluated %u rows\n", row_count);
+	}
+	
+	return 0;
+}
+
+/* Read a script into memory and index its blocks, as load_script() in
+ * libnetprinters.c does.
+ *
+ * Returns NULL if the script can't be opened.
+*/
+static struct script *load_script(char const *filename) {
+	FILE *fh = fopen(filename, "r");
+	
+	if(!fh) {
+		show_error("Can't open script %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	
+	struct script *script = allocate(sizeof(struct script));
+	unsigned int lnum = 1, alloc = 0;
+	char buf[1024];
+	
+	memset(script, 0, sizeof(*script));
+	
+	while(fgets(buf, 1024, fh)) {
+		char *name, *value;
+		
+		split_line(buf, &name, &value);
+		
+		if(name[0] == '#') {
+			lnum++;
+			continue;
+		}
+		
+		if(script->count == alloc) {
+			struct script_line *lines = allocate(sizeof(struct script_line) * (alloc += 64));
+			
+			memcpy(lines, script->lines, sizeof(struct script_line) * script->count);
+			free(script->lines);
+			script->lines = lines;
+		}
+		
+		struct script_line *line = &(script->lines[script->count++]);
+		
+		line->lnum = lnum++;
+		line->name = copy_string(name);
+		line->value = copy_string(value);
+		line->subnet = NULL;
+		line->directive = directive_find(name, &(line->negated));
+		line->fact = (line->directive && !line->negated) ? line->directive->fact : -1;
+		
+		if(name[0] != '\0' && !line->directive) {
+			show_error("Unknown directive %s at line %u of %s", name, line->lnum, filename);
+		}else if(line->directive && line->directive->kind == DIRECTIVE_SUBNET) {
+			line->subnet = subnet_parse(value);
+			
+			if(!line->subnet->family) {
+				show_error("Invalid subnet %s at line %u of %s", value, line->lnum, filename);
+			}
+		}
+	}
+	
+	fclose(fh);
+	
+	script_index(script, FACT_COUNT);
+	return script;
+}
+
+/* Look up a directive by name, a filter may be prefixed with ! to negate it
+ * which sets negated. Returns NULL if the directive is unknown.
+*/
+static struct directive const *directive_find(char const *name, int *negated) {
+	struct directive const *dir;
+	
+	*negated = (name[0] == '!');
+	
+	for(dir = directives; dir->name; dir++) {
+		if(ncase_match(name + *negated, dir->name)) {
+			return (*negated && (dir->kind == DIRECTIVE_COMMAND || dir->kind == DIRECTIVE_IGNORED)) ? NULL : dir;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Parse the subnet of a Subnet directive in CIDR notation, the family of the
+ * subnet returned is zero if it's invalid.
+*/
+static struct subnet_node *subnet_parse(char const *value) {
+	struct subnet_node *subnet = allocate(sizeof(struct subnet_node));
+	char abuf[64], *slash;
+	int maxlen;
+	
+	memset(subnet, 0, sizeof(*subnet));
+	
+	if(strlen(value) >= sizeof(abuf)) {
+		return subnet;
+	}
+	
+	strcpy(abuf, value);
+	slash = strchr(abuf, '/');
+	if(slash) {
+		*(slash++) = '\0';
+	}
+	
+	subnet->family = strchr(abuf, ':') ? AF_INET6 : AF_INET;
+	maxlen = subnet->family == AF_INET6 ? 128 : 32;
+	
+	if(inet_pton(subnet->family, abuf, subnet->addr) != 1) {
+		subnet->family = 0;
+		return subnet;
+	}
+	
+	subnet->plen = maxlen;
+	if(slash) {
+		char *end;
+		
+		subnet->plen = strtol(slash, &end, 10);
+		if(slash[0] == '\0' || end[0] != '\0' || subnet->plen < 0 || subnet->plen > maxlen) {
+			subnet->family = 0;
+		}
+	}
+	
+	return subnet;
+}
+
+/* Read a row from a CSV file, fields may be quoted with double quotes (which
+ * are doubled inside them) but can't span lines.
+ *
+ * Returns a NULL-terminated list of the fields, or NULL at the end of the file.
+*/
+static char **load_csv(FILE *fh, unsigned int *lnum) {
+	char buf[4096], **cells;
+	char const *pos = buf;
+	unsigned int count = 0, alloc = 8;
+	
+	do {
+		if(!fgets(buf, sizeof(buf), fh)) {
+			return NULL;
+		}
+		
+		(*lnum)++;
+		buf[strcspn(buf, "\r\n")] = '\0';
+	} while(buf[0] == '\0');
+	
+	cells = allocate(sizeof(char*) * alloc);
+	
+	do {
+		if(count+1 == alloc) {
+			char **c = allocate(sizeof(char*) * (alloc *= 2));
+			
+			memcpy(c, cells, sizeof(char*) * count);
+			free(cells);
+			cells = c;
+		}
+		
+		cells[count++] = csv_field(&pos);
+	} while(*(pos++) == ',');
+	
+	cells[count] = NULL;
+	return cells;
+}
+
+/* Copy a CSV field, leaving the position at the comma or end of line after it */
+static char *csv_field(char const **pos) {
+	char const *src = *pos + strspn(*pos, " \t");
+	char *field = allocate(strlen(src)+1), *dest = field;
+	
+	if(src[0] == '"') {
+		for(src++; src[0] != '\0'; src++) {
+			if(src[0] == '"' && src[1] == '"') {
+				*(dest++) = *(src++);
+			}else if(src[0] == '"') {
+				src++;
+				break;
+			}else{
+				*(dest++) = src[0];
+			}
+		}
+		
+		src += strcspn(src, ",");
+	}else{
+		while(src[0] != '\0' && src[0] != ',') {
+			*(dest++) = *(src++);
+		}
+		
+		while(dest > field && (dest[-1] == ' ' || dest[-1] == '\t')) {
+			dest--;
+		}
+	}
+	
+	*dest = '\0';
+	*pos = src;
+	
+	return field;
+}
+
+/* Thread which evaluates rows until none are left */
+static void *plan_worker(void *arg) {
+	struct plan_job *job = arg;
+	unsigned int fnum, vnum;
+	
+	for(;;) {
+		struct plan_row *row;
+		
+		pthread_mutex_lock(&(job->lock));
+		row = job->next < job->count ? &(job->rows[job->next++]) : NULL;
+		pthread_mutex_unlock(&(job->lock));
+		
+		if(!row) {
+			return NULL;
+		}
+		
+		pthread_setspecific(row_key, row);
+		plan_eval(new_script, row, &(row->plan));
+		
+		if(old_script) {
+			plan_eval(old_script, row, &(row->old_plan));
+		}
+		
+		for(fnum = 0; fnum < FACT_COUNT; fnum++) {
+			for(vnum = 0; row->facts[fnum] && row->facts[fnum][vnum]; vnum++) {
+				free(row->facts[fnum][vnum]);
+			}
+			
+			free(row->facts[fnum]);
+			row->facts[fnum] = NULL;
+		}
+	}
+}
+
+/* Evaluate a script for a row the way run_script() would, visiting the blocks
+ * through the index and adding the command directives which would be carried
+ * out to a plan.
+*/
+static void plan_eval(struct script *script, struct plan_row *row, struct plan *plan) {
+	struct block_walk walk;
+	unsigned int bnum;
+	int exit_used = 0;
+	
+	walk_start(&walk, script, &resolve_fact);
+	
+	while(!exit_used && (bnum = walk_next(&walk)) != UINT_MAX) {
+		exit_used = plan_block(script, &(script->blocks[bnum]), row, plan);
+	}
+	
+	walk_free(&walk);
+}
+
+/* Evaluate the lines of a block until a filter evaluates false, the way
+ * run_block() would.
+ *
+ * Returns 1 if the Exit directive was used, zero otherwise.
+*/
+static int plan_block(struct script *script, struct script_block *block, struct plan_row *row, struct plan *plan) {
+	unsigned int lnum;
+	
+	for(lnum = block->start; lnum < block->end; lnum++) {
+		struct script_line *line = &(script->lines[lnum]);
+		struct directive const *dir = line->directive;
+		int filter = -1;
+		
+		if(!dir) {
+			continue;
+		}
+		
+		if(dir->kind == DIRECTIVE_COMMAND) {
+			plan_add(plan, dir->action, dir->action == PLAN_EXIT ? NULL : line->value, line->lnum);
+			
+			if(dir->action == PLAN_EXIT) {
+				return 1;
+			}
+		}else if(dir->kind == DIRECTIVE_FACT) {
+			filter = fact_compare(row, dir->fact, line->value);
+		}else if(dir->kind == DIRECTIVE_ENV) {
+			filter = envvar_compare(row, line->value);
+		}else if(dir->kind == DIRECTIVE_SUBNET) {
+			filter = subnet_compare(row, line->subnet);
+		}
+		
+		if(filter != -1 && line->negated) {
+			filter = !filter;
+		}
+		
+		if(filter == 0) {
+			break;
+		}
+	}
+	
+	return 0;
+}
+
+/* Returns a cell of a row, or NULL if the column is -1 or the row doesn't
+ * have that many cells.
+*/
+static char const *row_cell(struct plan_row *row, int column) {
+	if(column < 0 || (unsigned int)column >= row->cell_count) {
+		return NULL;
+	}
+	
+	return row->cells[column];
+}
+
+/* Returns the values of a fact for a row, which are split from its cell at
+ * semicolons the first time they're needed. A fact without a cell has no
+ * values.
+*/
+static char **row_fact(struct plan_row *row, unsigned int fact) {
+	char const *cell = row_cell(row, fact_columns[fact]);
+	char *values, *value, *save, **list;
+	unsigned int count = 0;
+	
+	if(row->facts[fact]) {
+		return row->facts[fact];
+	}
+	
+	values = copy_string(cell ? cell : "");
+	list = allocate(sizeof(char*) * (strlen(values) / 2 + 2));
+	
+	/* Rows are evaluated by several threads, so strtok() can't be used */
+	
+	for(value = strtok_r(values, ";", &save); value; value = strtok_r(NULL, ";", &save)) {
+		size_t len;
+		
+		value += strspn(value, " ");
+		len = strlen(value);
+		
+		while(len > 0 && value[len-1] == ' ') {
+			value[--len] = '\0';
+		}
+		
+		if(len > 0) {
+			list[count++] = copy_string(value);
+		}
+	}
+	
+	list[count] = NULL;
+	free(values);
+	
+	return (row->facts[fact] = list);
+}
+
+/* Returns the values of a fact for the row being evaluated by this thread,
+ * for walk_next().
+*/
+static char **resolve_fact(unsigned int fact) {
+	return row_fact(pthread_getspecific(row_key), fact);
+}
+
+/* Check if any of the values of a fact in a row match an expression */
+static int fact_compare(struct plan_row *row, int fact, char const *expr) {
+	char **values = row_fact(row, fact);
+	struct expr_filter filter;
+	unsigned int vnum;
+	int ret = 0;
+	
+	expr_prepare(&filter, expr);
+	
+	for(vnum = 0; values[vnum] && !ret; vnum++) {
+		ret = expr_match(&filter, values[vnum]);
+	}
+	
+	expr_free(&filter);
+	return ret;
+}
+
+/* Check if the variable named by an Env directive is a column of the row and
+ * matches its expression.
+*/
+static int envvar_compare(struct plan_row *row, char const *value) {
+	size_t nlen = strcspn(value, WHITESPACE);
+	char const *expr = value+nlen+strspn(value+nlen, WHITESPACE);
+	unsigned int cnum;
+	
+	for(cnum = 0; cnum < column_count && cnum < row->cell_count; cnum++) {
+		if(strlen(columns[cnum]) == nlen && strncasecmp(columns[cnum], value, nlen) == 0) {
+			return expr_compare(row->cells[cnum], expr);
+		}
+	}
+	
+	return 0;
+}
+
+/* Check if any of the IPAddress values of a row is within a subnet */
+static int subnet_compare(struct plan_row *row, struct subnet_node const *subnet) {
+	char **values = row_fact(row, 2);
+	unsigned int vnum;
+	
+	if(!subnet->family) {
+		return 0;
+	}
+	
+	for(vnum = 0; values[vnum]; vnum++) {
+		unsigned char addr[16];
+		int bit;
+		
+		if((strchr(values[vnum], ':') ? AF_INET6 : AF_INET) != subnet->family || inet_pton(subnet->family, values[vnum], addr) != 1) {
+			continue;
+		}
+		
+		for(bit = 0; bit < subnet->plen; bit++) {
+			if(((addr[bit / 8] ^ subnet->addr[bit / 8]) >> (7 - bit % 8)) & 1) {
+				break;
+			}
+		}
+		
+		if(bit == subnet->plen) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+static void plan_add(struct plan *plan, int type, char const *target, unsigned int lnum) {
+	if(plan->count == plan->alloc) {
+		struct plan_action *actions = allocate(sizeof(struct plan_action) * (plan->alloc += 8));
+		
+		memcpy(actions, plan->actions, sizeof(struct plan_action) * plan->count);
+		free(plan->actions);
+		plan->actions = actions;
+	}
+	
+	struct plan_action *action = &(plan->actions[plan->count++]);
+	
+	action->type = type;
+	action->target = target ? copy_string(target) : NULL;
+	action->lnum = lnum;
+	action->matched = 0;
+}
+
+/* Print the actions of a plan, or only those not matched by plan_diff() */
+static void plan_print(struct plan_row *row, struct plan *plan, char const *prefix, int unmatched) {
+	char *label = row_label(row);
+	unsigned int anum;
+	
+	for(anum = 0; anum < plan->count; anum++) {
+		struct plan_action *action = &(plan->actions[anum]);
+		
+		if(!unmatched || !action->matched) {
+			printf("%s%s\t%s\t%s\t%u\n", prefix, label, action_names[action->type], action->target ? action->target : "", action->lnum);
+		}
+	}
+	
+	free(label);
+}
+
+/* Print the differences between the plans of a row, actions are matched by
+ * type and target regardless of their order.
+ *
+ * Returns 1 if the plans differ, zero otherwise.
+*/
+static int plan_diff(struct plan_row *row) {
+	unsigned int nnum, onum, changes = 0;
+	
+	for(nnum = 0; nnum < row->plan.count; nnum++) {
+		struct plan_action *naction = &(row->plan.actions[nnum]);
+		
+		for(onum = 0; onum < row->old_plan.count; onum++) {
+			struct plan_action *oaction = &(row->old_plan.actions[onum]);
+			
+			if(!oaction->matched && oaction->type == naction->type && (naction->type == PLAN_EXIT || ncase_match(oaction->target, naction->target))) {
+				oaction->matched = 1;
+				naction->matched = 1;
+				break;
+			}
+		}
+		
+		changes += !naction->matched;
+	}
+	
+	for(onum = 0; onum < row->old_plan.count; onum++) {
+		changes += !row->old_plan.actions[onum].matched;
+	}
+	
+	if(changes) {
+		plan_print(row, &(row->old_plan), "-", 1);
+		plan_print(row, &(row->plan), "+", 1);
+	}
+	
+	return changes > 0;
+}
+
+/* Returns the Username@NetBIOS of a row, or its line number if it doesn't
+ * have either.
+*/
+static char *row_label(struct plan_row *row) {
+	char const *user = row_cell(row, fact_columns[1]);
+	char const *host = row_cell(row, fact_columns[0]);
+	char *label;
+	
+	if(!user && !host) {
+		label = allocate(32);
+		sprintf(label, "row %u", row->lnum);
+	}else{
+		label = allocate((user ? strlen(user) : 0) + (host ? strlen(host) : 0) + 2);
+		sprintf(label, "%s%s%s", user ? user : "", user && host ? "@" : "", host ? host : "");
+	}
+	
+	return label;
+}
+
+static void *allocate(unsigned int size) {
+	void *ptr = malloc(size);
+	if(!ptr) {
+		show_error("Out of memory! Failed to allocate %u bytes", size);
+		exit(1);
+	}
+	
+	return ptr;
+}
+
+static char *copy_string(char const *str) {
+	char *copy = allocate(strlen(str)+1);
+	
+	strcpy(copy, str);
+	return copy;
+}
+
+static void show_error(const char *fmt, ...) {
+	va_list argv;
+	
+	fflush(stdout);
+	
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	
+	fputc('\n', stderr);
+}
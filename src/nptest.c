@@ -0,0 +1,1198 @@
+/* NetPrinters - Benchmarks and differential tests
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Benchmarks and differential tests of the functions shared with the library
+ * through expr.c and script.c. Like npplan this is a POSIX program which runs
+ * on the build machine, it's built and run by "make bench" and "make fuzz".
+ *
+ * bench times the functions against printer names and expressions like the
+ * ones found on print servers and terminal servers. fuzz compares them with
+ * simple reference implementations over random inputs and prints any input
+ * they disagree on, the exit status is 1 if there were any.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
+
+#define WHITESPACE "\r\n\t "
+
+#include "expr.c"
+#include "script.c"
+
+#define ARGN_IS(arg) (strcmp(argv[argn], arg) == 0)
+
+#define BENCH_ROUNDS 200
+#define FUZZ_CASES 3000000
+
+/* Rows of the CSV file generated by check_plan(), and the number of threads
+ * its single threaded plan is compared with.
+*/
+#define PLAN_ROWS 100000
+#define PLAN_THREADS 8
+#define PLAN_SCRIPT "nptest-plan.np"
+#define PLAN_CSV "nptest-plan.csv"
+
+/* Number of printer names generated for the benchmarks, and size of the
+ * script parsed by them.
+*/
+#define CORPUS_NAMES 2000
+#define CORPUS_LINES 20000
+
+/* Facts used by the scripts generated by fuzz_index() and bench_index() */
+#define FACT_COUNT 3
+
+/* Kinds of event compared by fuzz_index() */
+#define EVENT_RESOLVE	0
+#define EVENT_ADD	1
+#define EVENT_EXIT	2
+
+static void print_usage(void);
+static void make_corpus(void);
+static double bench_start(void);
+static void bench_report(char const *name, double start, unsigned long calls);
+static void bench_expr(unsigned long rounds);
+static void bench_prepared(unsigned long rounds);
+static void bench_ncase(unsigned long rounds);
+static void bench_split(unsigned long rounds);
+static void bench_index(unsigned long rounds);
+static unsigned long fuzz_expr(unsigned long cases);
+static unsigned long fuzz_prefilter(unsigned long cases);
+static unsigned long fuzz_find(unsigned long cases);
+static unsigned long fuzz_ncase(unsigned long cases);
+static unsigned long fuzz_split(unsigned long cases);
+static unsigned long fuzz_index(unsigned long scripts);
+static unsigned long check_plan(char const *npplan, unsigned long rows);
+static char *run_plan(char const *npplan, unsigned int threads);
+static struct script *random_script(void);
+static void add_line(struct script *script, unsigned int *alloc, char const *name, char const *value);
+static void free_script(struct script *script);
+static int run_block(struct script *script, struct script_block *block);
+static char **resolve_fact(unsigned int fact);
+static void add_event(int kind, unsigned int arg);
+static void fuzz_failed(char const *check, char const *a, char const *b, char const *detail);
+static int ref_compare(char const *str, char const *expr);
+static int ref_ncase(char const *str1, char const *str2);
+static void random_string(char *buf, size_t max, char const *alphabet);
+static void mutate_string(char *buf, size_t max, char const *from, char const *alphabet);
+static unsigned long rng_next(void);
+static void *allocate(unsigned int size);
+static char *copy_string(char const *str);
+static void show_error(const char *fmt, ...);
+
+static char const *servers[] = {
+	"PRINTSRV01", "printsrv02", "PrintSrv03", "PRN-HQ-01", "prn-hq-02",
+	"rds-host07", "RDS-HOST12", "srv-dc2.corp.example.com", "FS-BRANCH-LON", NULL
+};
+
+static char const *shares[] = {
+	"HP LaserJet 4250 Floor 3", "HP-LJ-M605-Finance", "Canon iR-ADV C5235",
+	"Kyocera_TASKalfa_3252ci", "Xerox WorkCentre 7855 (Reception)", "PDF",
+	"Zebra ZT410 Labels", "Brother HL-L6400DW", "MFP-2F-East", "Plotter A0", NULL
+};
+
+/* Expressions of the kinds used by DeletePrinter and DefaultPrinter */
+static char const *patterns[] = {
+	"\\\\printsrv01\\*",
+	"\\\\PRINTSRV##\\HP*",
+	"\\\\rds-host??\\*",
+	"*(redirected *)",
+	"*Floor 3",
+	"*canon*",
+	"\\\\prn-hq-01\\Kyocera_TASKalfa_3252ci",
+	"\\\\*\\PDF",
+	"*",
+	NULL
+};
+
+/* Values of the facts for fuzz_index() and bench_index(), and which of them
+ * have been resolved.
+*/
+static char *fact_values[FACT_COUNT][4];
+static int facts_resolved[FACT_COUNT];
+
+/* Facts resolved and directives carried out by run_block() */
+static unsigned int *events = NULL;
+static unsigned int event_count = 0, event_alloc = 0;
+
+static char *names[CORPUS_NAMES];
+static char *script_text = NULL;
+static size_t script_len = 0;
+
+static unsigned long rng_state = 2463534242UL;
+
+/* Keeps the results of benchmarked calls so they aren't optimised away */
+static volatile unsigned long bench_sink = 0;
+
+static void print_usage(void) {
+	printf("Usage: nptest bench [<rounds>]\n");
+	printf("       nptest fuzz [<cases>] [<seed>]\n");
+	printf("       nptest plan <npplan> [<rows>]\n");
+}
+
+int main(int argc, char** argv) {
+	unsigned long count, failures = 0;
+	int argn = 1;
+	
+	if(argn == argc) {
+		print_usage();
+		return 1;
+	}
+	
+	if(ARGN_IS("bench") && argc <= 3) {
+		count = argc == 3 ? strtoul(argv[2], NULL, 10) : BENCH_ROUNDS;
+		
+		make_corpus();
+		
+		bench_expr(count);
+		bench_prepared(count);
+		bench_ncase(count);
+		bench_split(count);
+		bench_index(count);
+		
+		return 0;
+	}
+	
+	if(ARGN_IS("fuzz") && argc <= 4) {
+		count = argc >= 3 ? strtoul(argv[2], NULL, 10) : FUZZ_CASES;
+		
+		if(argc == 4) {
+			rng_state = strtoul(argv[3], NULL, 10) & 0xFFFFFFFFUL;
+		}
+		
+		if(rng_state == 0) {
+			rng_state = 1;
+		}
+		
+		printf("Seed %lu, %lu cases of each check\n", rng_state, count);
+		
+		failures += fuzz_expr(count);
+		failures += fuzz_prefilter(count);
+		failures += fuzz_find(count);
+		failures += fuzz_ncase(count);
+		failures += fuzz_split(count);
+		failures += fuzz_index(count / 300);
+		
+		if(failures) {
+			printf("%lu failures\n", failures);
+			return 1;
+		}
+		
+		printf("No failures\n");
+		return 0;
+	}
+	
+	if(ARGN_IS("plan") && (argc == 3 || argc == 4)) {
+		count = argc == 4 ? strtoul(argv[3], NULL, 10) : PLAN_ROWS;
+		
+		if(check_plan(argv[2], count)) {
+			return 1;
+		}
+		
+		printf("No failures\n");
+		return 0;
+	}
+	
+	print_usage();
+	return 1;
+}
+
+/* Generate the printer names and the script used by the benchmarks, mixing
+ * print server connections with the redirected printers of a terminal server.
+*/
+static void make_corpus(void) {
+	unsigned int server_count = 0, share_count = 0, nnum, lnum;
+	size_t alloc = CORPUS_LINES * 64, len;
+	char buf[256];
+	
+	while(servers[server_count]) {
+		server_count++;
+	}
+	
+	while(shares[share_count]) {
+		share_count++;
+	}
+	
+	for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+		char const *server = servers[rng_next() % server_count];
+		char const *share = shares[rng_next() % share_count];
+		
+		if(nnum % 3 == 0) {
+			snprintf(buf, sizeof(buf), "\\\\%s\\%s (redirected %lu)", server, share, rng_next() % 40);
+		}else{
+			snprintf(buf, sizeof(buf), "\\\\%s\\%s", server, share);
+		}
+		
+		names[nnum] = copy_string(buf);
+	}
+	
+	script_text = allocate(alloc);
+	script_len = 0;
+	
+	for(lnum = 0; lnum < CORPUS_LINES; lnum++) {
+		switch(lnum % 8) {
+			case 0:
+				len = snprintf(buf, sizeof(buf), "\r\n# Computers in room %u\r\n", lnum);
+				break;
+			
+			case 1:
+				len = snprintf(buf, sizeof(buf), "NetBIOS PC%04u\r\n", lnum);
+				break;
+			
+			case 2:
+				len = snprintf(buf, sizeof(buf), "\tUsername\tadm*\r\n");
+				break;
+			
+			case 5:
+				len = snprintf(buf, sizeof(buf), "DefaultPrinter %s\r\n", names[lnum % CORPUS_NAMES]);
+				break;
+			
+			case 7:
+				len = snprintf(buf, sizeof(buf), "DeletePrinter %s\r\n", patterns[lnum % 4]);
+				break;
+			
+			default:
+				len = snprintf(buf, sizeof(buf), "AddPrinter %s\r\n", names[lnum % CORPUS_NAMES]);
+				break;
+		}
+		
+		if(script_len + len + 1 > alloc) {
+			break;
+		}
+		
+		memcpy(script_text + script_len, buf, len+1);
+		script_len += len;
+	}
+}
+
+/* Returns the current time in seconds for bench_report() */
+static double bench_start(void) {
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench_report(char const *name, double start, unsigned long calls) {
+	double secs = bench_start() - start;
+	
+	printf("%-24s %10lu calls %8.1f ns/call %8.2f M/s\n", name, calls, secs * 1e9 / calls, calls / secs / 1e6);
+}
+
+/* Every name against every pattern */
+static void bench_expr(unsigned long rounds) {
+	unsigned long round, calls = 0, hits = 0;
+	unsigned int pnum, nnum;
+	double start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		for(pnum = 0; patterns[pnum]; pnum++) {
+			for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+				hits += expr_compare(names[nnum], patterns[pnum]);
+				calls++;
+			}
+		}
+	}
+	
+	bench_report("expr_compare", start, calls);
+	bench_sink += hits;
+}
+
+/* The same with the expressions prepared by expr_prepare(), as they are when
+ * a DeletePrinter expression is matched against every connection.
+*/
+static void bench_prepared(unsigned long rounds) {
+	unsigned long round, calls = 0, hits = 0;
+	unsigned int pnum, nnum;
+	struct expr_filter filter;
+	double start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		for(pnum = 0; patterns[pnum]; pnum++) {
+			expr_prepare(&filter, patterns[pnum]);
+			
+			for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+				hits += expr_match(&filter, names[nnum]);
+				calls++;
+			}
+			
+			expr_free(&filter);
+		}
+	}
+	
+	bench_report("expr_match", start, calls);
+	bench_sink += hits;
+}
+
+/* Every name against a name which differs only by case (as when looking up a
+ * printer in the list of connections) and against the next name.
+*/
+static void bench_ncase(unsigned long rounds) {
+	unsigned long round, calls = 0, hits = 0;
+	unsigned int nnum;
+	char *upper[CORPUS_NAMES];
+	double start;
+	
+	for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+		size_t pos;
+		
+		upper[nnum] = copy_string(names[nnum]);
+		
+		for(pos = 0; upper[nnum][pos]; pos++) {
+			upper[nnum][pos] = toupper((unsigned char)upper[nnum][pos]);
+		}
+	}
+	
+	start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+			hits += ncase_match(names[nnum], upper[nnum]);
+			hits += ncase_match(names[nnum], names[(nnum+1) % CORPUS_NAMES]);
+			calls += 2;
+		}
+	}
+	
+	bench_report("ncase_match", start, calls);
+	bench_sink += hits;
+	
+	for(nnum = 0; nnum < CORPUS_NAMES; nnum++) {
+		free(upper[nnum]);
+	}
+}
+
+/* Split every line of the script, copying each line into a buffer first as
+ * fgets() does for load_script().
+*/
+static void bench_split(unsigned long rounds) {
+	unsigned long round, calls = 0;
+	char buf[1024], *name, *value;
+	double start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		char const *line = script_text;
+		
+		while(line[0]) {
+			size_t len = strcspn(line, "\n");
+			
+			if(line[len]) {
+				len++;
+			}
+			
+			memcpy(buf, line, len);
+			buf[len] = '\0';
+			line += len;
+			
+			split_line(buf, &name, &value);
+			bench_sink += name[0] + value[0];
+			calls++;
+		}
+	}
+	
+	bench_report("split_line", start, calls);
+}
+
+/* Visit the blocks of a script with 5000 computers through the index and by
+ * evaluating the first line of every block, as before the index was added.
+*/
+static void bench_index(unsigned long rounds) {
+	struct script *script = allocate(sizeof(struct script));
+	unsigned long round, calls = 0;
+	unsigned int alloc = 0, bnum;
+	char buf[32];
+	double start;
+	
+	memset(script, 0, sizeof(*script));
+	
+	for(bnum = 0; bnum < 5000; bnum++) {
+		snprintf(buf, sizeof(buf), "PC%04u", bnum);
+		add_line(script, &alloc, "F0", buf);
+		add_line(script, &alloc, "Add", names[bnum % CORPUS_NAMES]);
+		add_line(script, &alloc, "", "");
+		
+		if(bnum % 500 == 0) {
+			add_line(script, &alloc, "F1", "adm*");
+			add_line(script, &alloc, "Add", names[bnum % CORPUS_NAMES]);
+			add_line(script, &alloc, "", "");
+		}
+	}
+	
+	script_index(script, FACT_COUNT);
+	
+	fact_values[0][0] = "pc4242";
+	fact_values[0][1] = NULL;
+	fact_values[1][0] = "administrator";
+	fact_values[1][1] = NULL;
+	fact_values[2][0] = NULL;
+	
+	start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		struct block_walk walk;
+		
+		walk_start(&walk, script, &resolve_fact);
+		
+		while((bnum = walk_next(&walk)) != UINT_MAX) {
+			bench_sink += bnum;
+		}
+		
+		walk_free(&walk);
+		calls++;
+	}
+	
+	bench_report("walk_next (script)", start, calls);
+	start = bench_start();
+	
+	for(round = 0; round < rounds; round++) {
+		for(bnum = 0; bnum < script->block_count; bnum++) {
+			struct script_line *line = &(script->lines[script->blocks[bnum].start]);
+			
+			bench_sink += expr_compare(fact_values[line->fact][0], line->value);
+		}
+	}
+	
+	bench_report("sequential (script)", start, rounds);
+	free_script(script);
+}
+
+/* expr_compare() against ref_compare(), half of the expressions are made
+ * from the string so that a good number of them match.
+*/
+static unsigned long fuzz_expr(unsigned long cases) {
+	unsigned long cnum, failures = 0, matched = 0;
+	char str[24], expr[16];
+	
+	for(cnum = 0; cnum < cases; cnum++) {
+		int result, expect;
+		
+		random_string(str, sizeof(str), "aAbB1\\-x9#");
+		
+		if(cnum % 2) {
+			mutate_string(expr, sizeof(expr), str, "aB1*?#");
+		}else{
+			random_string(expr, sizeof(expr), "aAbB1\\*?#");
+		}
+		
+		result = expr_compare(str, expr);
+		expect = ref_compare(str, expr);
+		matched += expect;
+		
+		if(result != expect) {
+			fuzz_failed("expr_compare", str, expr, expect ? "should match" : "shouldn't match");
+			failures++;
+		}
+	}
+	
+	printf("expr_compare:\t%lu cases, %lu matching, %lu failures\n", cases, matched, failures);
+	return failures;
+}
+
+/* expr_match() against expr_compare(), using strings long enough for the
+ * literal parts of the expressions to be compared 16 characters at a time.
+*/
+static unsigned long fuzz_prefilter(unsigned long cases) {
+	unsigned long cnum, failures = 0, matched = 0;
+	char str[64], expr[64];
+	
+	for(cnum = 0; cnum < cases; cnum++) {
+		struct expr_filter filter;
+		int result, expect;
+		
+		random_string(str, sizeof(str), "aAbBcC1\\-\xfc#");
+		
+		if(cnum % 4) {
+			mutate_string(expr, sizeof(expr), str, "aC1\xdc*?#");
+		}else{
+			random_string(expr, sizeof(expr), "aAbBcC1\\-\xfc*?#");
+		}
+		
+		expr_prepare(&filter, expr);
+		result = expr_match(&filter, str);
+		expect = expr_compare(str, expr);
+		expr_free(&filter);
+		
+		matched += expect;
+		
+		if(result != expect) {
+			fuzz_failed("expr_match", str, expr, expect ? "should match" : "shouldn't match");
+			failures++;
+		}
+	}
+	
+	printf("expr_match:\t%lu cases, %lu matching, %lu failures\n", cases, matched, failures);
+	return failures;
+}
+
+/* ncase_find() against checking every position with ref_ncase() */
+static unsigned long fuzz_find(unsigned long cases) {
+	unsigned long cnum, failures = 0, found = 0;
+	char str[64], lower[24];
+	
+	for(cnum = 0; cnum < cases; cnum++) {
+		char const *result, *expect = NULL;
+		size_t slen, len, pos;
+		char sub[24];
+		
+		random_string(str, sizeof(str), "aAbB\\\xe4");
+		slen = strlen(str);
+		
+		/* Look for part of the string, changed a little some of the time */
+		
+		pos = slen ? rng_next() % slen : 0;
+		len = 1 + rng_next() % (sizeof(lower)-1);
+		
+		snprintf(sub, sizeof(sub), "%.*s", (int)len, str+pos);
+		
+		if(cnum % 3 == 0 || sub[0] == '\0') {
+			mutate_string(lower, sizeof(lower), sub[0] ? sub : "ab", "aB");
+		}else{
+			strcpy(lower, sub);
+		}
+		
+		if(!(len = strlen(lower))) {
+			continue;
+		}
+		
+		for(pos = 0; lower[pos]; pos++) {
+			lower[pos] = tolower((unsigned char)lower[pos]);
+		}
+		
+		for(pos = 0; !expect && pos+len <= slen; pos++) {
+			memcpy(sub, str+pos, len);
+			sub[len] = '\0';
+			
+			if(ref_ncase(sub, lower)) {
+				expect = str+pos;
+			}
+		}
+		
+		result = ncase_find(str, slen, lower, len);
+		found += expect != NULL;
+		
+		if(result != expect) {
+			fuzz_failed("ncase_find", str, lower, expect ? "should be found" : "shouldn't be found");
+			failures++;
+		}
+	}
+	
+	printf("ncase_find:\t%lu cases, %lu found, %lu failures\n", cases, found, failures);
+	return failures;
+}
+
+/* ncase_match() against ref_ncase(), including characters outside ASCII */
+static unsigned long fuzz_ncase(unsigned long cases) {
+	unsigned long cnum, failures = 0, matched = 0;
+	char str1[24], str2[24];
+	
+	for(cnum = 0; cnum < cases; cnum++) {
+		int result, expect;
+		
+		random_string(str1, sizeof(str1), "aAbBzZ@[`{\\\xc4\xe4\xff");
+		
+		if(cnum % 2) {
+			mutate_string(str2, sizeof(str2), str1, "aBz\xe4");
+		}else{
+			random_string(str2, sizeof(str2), "aAbBzZ@[`{\\\xc4\xe4\xff");
+		}
+		
+		result = ncase_match(str1, str2);
+		expect = ref_ncase(str1, str2);
+		matched += expect;
+		
+		if(result != expect) {
+			fuzz_failed("ncase_match", str1, str2, expect ? "should match" : "shouldn't match");
+			failures++;
+		}
+	}
+	
+	printf("ncase_match:\t%lu cases, %lu matching, %lu failures\n", cases, matched, failures);
+	return failures;
+}
+
+/* split_line() against splitting the line a character at a time */
+static unsigned long fuzz_split(unsigned long cases) {
+	unsigned long cnum, failures = 0;
+	char line[32], buf[32], *name, *value;
+	
+	for(cnum = 0; cnum < cases; cnum++) {
+		char expect_name[32], expect_value[32];
+		size_t pos = 0, nlen = 0, vlen = 0;
+		
+		random_string(line, sizeof(line), "ab#!* \t\t\r\n");
+		strcpy(buf, line);
+		
+		while(line[pos] && strchr(WHITESPACE, line[pos])) {
+			pos++;
+		}
+		
+		while(line[pos] && !strchr(WHITESPACE, line[pos])) {
+			expect_name[nlen++] = line[pos++];
+		}
+		
+		if(line[pos]) {
+			pos++;
+		}
+		
+		while(line[pos] && strchr(WHITESPACE, line[pos])) {
+			pos++;
+		}
+		
+		while(line[pos] && line[pos] != '\r' && line[pos] != '\n') {
+			expect_value[vlen++] = line[pos++];
+		}
+		
+		expect_name[nlen] = '\0';
+		expect_value[vlen] = '\0';
+		
+		split_line(buf, &name, &value);
+		
+		if(strcmp(name, expect_name) != 0 || strcmp(value, expect_value) != 0) {
+			fuzz_failed("split_line", line, "", "wrong name or value");
+			failures++;
+		}
+	}
+	
+	printf("split_line:\t%lu cases, %lu failures\n", cases, failures);
+	return failures;
+}
+
+/* Execute random scripts through the block index, and by evaluating every
+ * block in order, for random fact values. The facts resolved and directives
+ * carried out must be the same and happen in the same order.
+*/
+static unsigned long fuzz_index(unsigned long scripts) {
+	static char const *values[] = {"pc1", "PC2", "admin", "ad", "x1", ""};
+	unsigned long snum, failures = 0, indexed = 0;
+	
+	for(snum = 0; snum < scripts; snum++) {
+		struct script *script = random_script();
+		unsigned int *expect, expect_count, bnum, fnum, vnum;
+		struct block_walk walk;
+		
+		for(fnum = 0; fnum < FACT_COUNT; fnum++) {
+			unsigned int count = rng_next() % 4;
+			
+			for(vnum = 0; vnum < count; vnum++) {
+				fact_values[fnum][vnum] = (char*)values[rng_next() % 6];
+			}
+			
+			fact_values[fnum][vnum] = NULL;
+			facts_resolved[fnum] = 0;
+		}
+		
+		event_count = 0;
+		
+		for(bnum = 0; bnum < script->block_count; bnum++) {
+			if(run_block(script, &(script->blocks[bnum]))) {
+				break;
+			}
+		}
+		
+		expect = events;
+		expect_count = event_count;
+		
+		events = NULL;
+		event_count = event_alloc = 0;
+		
+		for(fnum = 0; fnum < FACT_COUNT; fnum++) {
+			facts_resolved[fnum] = 0;
+		}
+		
+		walk_start(&walk, script, &resolve_fact);
+		
+		while((bnum = walk_next(&walk)) != UINT_MAX) {
+			if(run_block(script, &(script->blocks[bnum]))) {
+				break;
+			}
+		}
+		
+		walk_free(&walk);
+		
+		indexed += script->block_count - script->general_count;
+		
+		if(event_count != expect_count || (event_count && memcmp(events, expect, sizeof(unsigned int) * event_count) != 0)) {
+			char desc[64];
+			
+			snprintf(desc, sizeof(desc), "%u lines", script->count);
+			fuzz_failed("block index", script->lines[0].name, script->lines[0].value, desc);
+			failures++;
+		}
+		
+		free(expect);
+		free_script(script);
+	}
+	
+	printf("block index:\t%lu scripts, %lu indexed blocks, %lu failures\n", scripts, indexed, failures);
+	return failures;
+}
+
+/* Generate a script of up to 20 blocks, most lines are filters on the facts
+ * (F0, F1 and F2, or !F0 etc.) with literal, prefix or wildcard values and the
+ * others are Add (with the line number) and Exit.
+*/
+static struct script *random_script(void) {
+	static char const *values[] = {"pc1", "PC2", "admin", "ad", "x1", "p*", "ad*", "*", "PC**", "pc?", "*1", "a*n", "#", ""};
+	struct script *script = allocate(sizeof(struct script));
+	unsigned int alloc = 0, blocks = 1 + rng_next() % 20, bnum, lnum;
+	char name[8], value[16];
+	
+	memset(script, 0, sizeof(*script));
+	
+	for(bnum = 0; bnum < blocks; bnum++) {
+		unsigned int lines = 1 + rng_next() % 4;
+		
+		for(lnum = 0; lnum < lines; lnum++) {
+			unsigned int kind = rng_next() % 10;
+			
+			if(kind < 6) {
+				snprintf(name, sizeof(name), "%sF%lu", kind == 0 ? "!" : "", rng_next() % FACT_COUNT);
+				add_line(script, &alloc, name, values[rng_next() % 14]);
+			}else if(kind < 9 || rng_next() % 4) {
+				snprintf(value, sizeof(value), "%u", script->count+1);
+				add_line(script, &alloc, "Add", value);
+			}else{
+				add_line(script, &alloc, "Exit", "");
+			}
+		}
+		
+		do {
+			add_line(script, &alloc, "", "");
+		} while(rng_next() % 4 == 0);
+	}
+	
+	script_index(script, FACT_COUNT);
+	return script;
+}
+
+/* Add a line to a script, as load_script() does */
+static void add_line(struct script *script, unsigned int *alloc, char const *name, char const *value) {
+	struct script_line *line;
+	
+	if(script->count == *alloc) {
+		struct script_line *lines = allocate(sizeof(struct script_line) * (*alloc += 64));
+		
+		memcpy(lines, script->lines, sizeof(struct script_line) * script->count);
+		free(script->lines);
+		script->lines = lines;
+	}
+	
+	line = &(script->lines[script->count++]);
+	
+	memset(line, 0, sizeof(*line));
+	line->lnum = script->count;
+	line->name = copy_string(name);
+	line->value = copy_string(value);
+	line->negated = name[0] == '!';
+	line->fact = (name[0] == 'F') ? name[1] - '0' : -1;
+}
+
+static void free_script(struct script *script) {
+	unsigned int lnum;
+	
+	for(lnum = 0; lnum < script->count; lnum++) {
+		free(script->lines[lnum].name);
+		free(script->lines[lnum].value);
+	}
+	
+	for(lnum = 0; lnum < script->index_size; lnum++) {
+		while(script->index[lnum]) {
+			struct block_key *key = script->index[lnum];
+			
+			script->index[lnum] = key->next;
+			free(key->key);
+			free(key);
+		}
+	}
+	
+	free(script->lines);
+	free(script->blocks);
+	free(script->general);
+	free(script->index);
+	free(script->fact_first);
+	free(script);
+}
+
+/* Execute the lines of a block of a generated script until a filter is false,
+ * as run_block() in libnetprinters.c does. Returns 1 if Exit was used.
+*/
+static int run_block(struct script *script, struct script_block *block) {
+	unsigned int lnum, vnum;
+	
+	for(lnum = block->start; lnum < block->end; lnum++) {
+		struct script_line *line = &(script->lines[lnum]);
+		char *name = line->name + line->negated, **values;
+		int filter = 0;
+		
+		if(name[0] == 'F') {
+			values = resolve_fact(name[1] - '0');
+			
+			for(vnum = 0; values[vnum] && !filter; vnum++) {
+				filter = expr_compare(values[vnum], line->value);
+			}
+			
+			if(filter == line->negated) {
+				break;
+			}
+		}else if(strcmp(name, "Add") == 0) {
+			add_event(EVENT_ADD, line->lnum);
+		}else{
+			add_event(EVENT_EXIT, line->lnum);
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Returns the values of a fact, recording an event the first time */
+static char **resolve_fact(unsigned int fact) {
+	if(!facts_resolved[fact]) {
+		facts_resolved[fact] = 1;
+		add_event(EVENT_RESOLVE, fact);
+	}
+	
+	return fact_values[fact];
+}
+
+static void add_event(int kind, unsigned int arg) {
+	if(event_count == event_alloc) {
+		unsigned int *e = allocate(sizeof(unsigned int) * (event_alloc += 16));
+		
+		memcpy(e, events, sizeof(unsigned int) * event_count);
+		free(events);
+		events = e;
+	}
+	
+	events[event_count++] = arg*4 + kind;
+}
+
+/* Run npplan on a random script and a CSV file of rows with several values
+ * in each fact column, once with one thread and once with PLAN_THREADS. The
+ * rows are evaluated independently, so the plans must be the same.
+*/
+static unsigned long check_plan(char const *npplan, unsigned long rows) {
+	static char const *filters[] = {
+		"NetBIOS PC0#1*", "!NetBIOS LAB*", "NetBIOS ALT##", "Username u1*", "!Username u2?", "IPAddress 10.1.*",
+		"Subnet 10.2.0.0/16", "Subnet fd00::/120", "!Subnet 10.3.128.0/17", "OU ou=#*", "Env DEPT sales", "!Env DEPT *e*"
+	};
+	unsigned long rnum, lnum = 1, failures = 0;
+	unsigned int bnum, fnum;
+	char *single, *multi, *spos, *mpos;
+	FILE *fh;
+	
+	if(!(fh = fopen(PLAN_SCRIPT, "w"))) {
+		show_error("Can't create %s", PLAN_SCRIPT);
+		return 1;
+	}
+	
+	for(bnum = 0; bnum < 40; bnum++) {
+		for(fnum = rng_next() % 3; fnum > 0; fnum--) {
+			fprintf(fh, "%s\n", filters[rng_next() % 12]);
+		}
+		
+		switch(rng_next() % 8) {
+			case 0:
+				fprintf(fh, "DeletePrinter \\\\srv\\p%lu*\n", rng_next() % 10);
+				break;
+			
+			case 1:
+				fprintf(fh, "DefaultPrinter \\\\srv\\p%u\n", bnum);
+				break;
+			
+			default:
+				fprintf(fh, "AddPrinter \\\\srv\\p%u\n", bnum);
+				break;
+		}
+		
+		fprintf(fh, "\n");
+	}
+	
+	fprintf(fh, "NetBIOS PC000##\nExit\n\nAddPrinter \\\\srv\\last\n");
+	fclose(fh);
+	
+	if(!(fh = fopen(PLAN_CSV, "w"))) {
+		show_error("Can't create %s", PLAN_CSV);
+		return 1;
+	}
+	
+	fprintf(fh, "NetBIOS,Username,IPAddress,OU,DEPT\n");
+	
+	for(rnum = 0; rnum < rows; rnum++) {
+		fprintf(fh, "PC%05lu;ALT%02lu;LAB%lu,", rnum, rng_next() % 100, rng_next() % 10);
+		fprintf(fh, "u%lu;u%lu,", rng_next() % 300, rng_next() % 300);
+		fprintf(fh, "10.%lu.%lu.%lu; fd00::%lx,", 1 + rng_next() % 3, rng_next() % 256, rng_next() % 256, rng_next() % 512);
+		fprintf(fh, "ou=%lu;ou=x,%s\n", rng_next() % 20, (rng_next() % 2) ? "sales" : "eng");
+	}
+	
+	fclose(fh);
+	
+	single = run_plan(npplan, 1);
+	multi = run_plan(npplan, PLAN_THREADS);
+	
+	remove(PLAN_SCRIPT);
+	remove(PLAN_CSV);
+	
+	if(!single || !multi) {
+		return 1;
+	}
+	
+	/* Compare the plans line by line */
+	
+	for(spos = single, mpos = multi; *spos || *mpos; lnum++) {
+		size_t slen = strcspn(spos, "\n"), mlen = strcspn(mpos, "\n");
+		
+		if(slen != mlen || strncmp(spos, mpos, slen) != 0) {
+			char sline[256], mline[256], desc[64];
+			
+			snprintf(sline, sizeof(sline), "%.*s", (int)slen, spos);
+			snprintf(mline, sizeof(mline), "%.*s", (int)mlen, mpos);
+			snprintf(desc, sizeof(desc), "line %lu", lnum);
+			fuzz_failed("plan threads", sline, mline, desc);
+			failures++;
+		}
+		
+		spos += slen + (spos[slen] == '\n');
+		mpos += mlen + (mpos[mlen] == '\n');
+	}
+	
+	printf("plan threads:\t%lu rows, %lu lines, %lu failures\n", rows, lnum-1, failures);
+	
+	free(single);
+	free(multi);
+	
+	return failures;
+}
+
+/* Returns the output of npplan with a number of threads for the files written
+ * by check_plan(), or NULL if it fails.
+*/
+static char *run_plan(char const *npplan, unsigned int threads) {
+	char cmd[1024], *buf = NULL;
+	size_t len = 0, alloc = 0, rlen;
+	FILE *fh;
+	
+	snprintf(cmd, sizeof(cmd), "%s -t %u %s %s", npplan, threads, PLAN_SCRIPT, PLAN_CSV);
+	
+	if(!(fh = popen(cmd, "r"))) {
+		show_error("Can't run %s", cmd);
+		return NULL;
+	}
+	
+	do {
+		if(alloc - len < 65536) {
+			char *b = allocate(alloc = alloc ? alloc * 2 : 1048576);
+			
+			memcpy(b, buf, len);
+			free(buf);
+			buf = b;
+		}
+		
+		rlen = fread(buf+len, 1, alloc-len-1, fh);
+		len += rlen;
+	} while(rlen > 0);
+	
+	buf[len] = '\0';
+	
+	if(pclose(fh) != 0) {
+		show_error("%s failed", cmd);
+		free(buf);
+		return NULL;
+	}
+	
+	return buf;
+}
+
+/* Print the inputs of a failed check with the unprintable characters escaped,
+ * only the first few failures of each run are printed.
+*/
+static void fuzz_failed(char const *check, char const *a, char const *b, char const *detail) {
+	static unsigned int printed = 0;
+	char const *args[2] = {a, b};
+	unsigned int anum;
+	
+	if(printed++ >= 20) {
+		return;
+	}
+	
+	printf("FAILED %s:", check);
+	
+	for(anum = 0; anum < 2; anum++) {
+		char const *c;
+		
+		printf(" \"");
+		
+		for(c = args[anum]; *c; c++) {
+			if(isprint((unsigned char)*c) && *c != '\\' && *c != '"') {
+				putchar(*c);
+			}else{
+				printf("\\x%02x", (unsigned char)*c);
+			}
+		}
+		
+		printf("\"");
+	}
+	
+	printf(" (%s)\n", detail);
+}
+
+/* Reference expression matcher, a direct recursive implementation of the
+ * wildcards documented in ReadMe.html.
+*/
+static int ref_compare(char const *str, char const *expr) {
+	if(expr[0] == '\0') {
+		return str[0] == '\0';
+	}
+	
+	if(expr[0] == '*') {
+		return ref_compare(str, expr+1) || (str[0] != '\0' && ref_compare(str+1, expr));
+	}
+	
+	if(str[0] == '\0') {
+		return 0;
+	}
+	
+	if(expr[0] == '?') {
+		return ref_compare(str+1, expr+1);
+	}
+	
+	if(expr[0] == '#') {
+		return (isdigit((unsigned char)str[0]) || str[0] == '#') && ref_compare(str+1, expr+1);
+	}
+	
+	return tolower((unsigned char)str[0]) == tolower((unsigned char)expr[0]) && ref_compare(str+1, expr+1);
+}
+
+static int ref_ncase(char const *str1, char const *str2) {
+	size_t len = strlen(str1), pos;
+	
+	if(strlen(str2) != len) {
+		return 0;
+	}
+	
+	for(pos = 0; pos < len; pos++) {
+		if(tolower((unsigned char)str1[pos]) != tolower((unsigned char)str2[pos])) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/* Fill a buffer with up to max-1 random characters from an alphabet */
+static void random_string(char *buf, size_t max, char const *alphabet) {
+	size_t len = rng_next() % max, alen = strlen(alphabet), pos;
+	
+	for(pos = 0; pos < len; pos++) {
+		buf[pos] = alphabet[rng_next() % alen];
+	}
+	
+	buf[len] = '\0';
+}
+
+/* Copy a string, changing the case of some characters and replacing,
+ * inserting or removing others with characters from an alphabet.
+*/
+static void mutate_string(char *buf, size_t max, char const *from, char const *alphabet) {
+	size_t len = 0, alen = strlen(alphabet);
+	
+	for(; *from && len < max-1; from++) {
+		switch(rng_next() % 8) {
+			case 0:
+				buf[len++] = alphabet[rng_next() % alen];
+				break;
+			
+			case 1:
+				buf[len++] = alphabet[rng_next() % alen];
+				
+				if(len < max-1) {
+					buf[len++] = *from;
+				}
+				
+				break;
+			
+			case 2:
+				break;
+			
+			case 3:
+				buf[len++] = isupper((unsigned char)*from) ? tolower((unsigned char)*from) : toupper((unsigned char)*from);
+				break;
+			
+			default:
+				buf[len++] = *from;
+				break;
+		}
+	}
+	
+	buf[len] = '\0';
+}
+
+/* xorshift32, so each seed gives the same cases everywhere */
+static unsigned long rng_next(void) {
+	rng_state ^= (rng_state << 13) & 0xFFFFFFFFUL;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= (rng_state << 5) & 0xFFFFFFFFUL;
+	
+	return rng_state;
+}
+
+static void *allocate(unsigned int size) {
+	void *ptr = malloc(size);
+	if(!ptr) {
+		show_error("Out of memory! Failed to allocate %u bytes", size);
+		exit(1);
+	}
+	
+	return ptr;
+}
+
+static char *copy_string(char const *str) {
+	char *copy = allocate(strlen(str)+1);
+	
+	strcpy(copy, str);
+	return copy;
+}
+
+static void show_error(const char *fmt, ...) {
+	va_list argv;
+	
+	fflush(stdout);
+	
+	va_start(argv, fmt);
+	vfprintf(stderr, fmt, argv);
+	va_end(argv);
+	
+	fputc('\n', stderr);
+}
@@ -0,0 +1,398 @@
+/* NetPrinters - Script parsing and block index
+ * Copyright (C) 2008 Daniel Collins <solemnwarning@solemnwarning.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *	* Redistributions of source code must retain the above copyright
+ *	  notice, this list of conditions and the following disclaimer.
+ *
+ *	* Redistributions in binary form must reproduce the above copyright
+ *	  notice, this list of conditions and the following disclaimer in the
+ *	  documentation and/or other materials provided with the distribution.
+ *
+ *	* Neither the name of the author nor the names of its contributors may
+ *	  be used to endorse or promote products derived from this software
+ *	  without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* This file is included by libnetprinters.c and by nptest, which builds it on
+ * the build machine, so it mustn't use any Windows APIs. The including file
+ * must define WHITESPACE and allocate(), and include expr.c first.
+ *
+ * Facts are numbered by the including file, libnetprinters.c numbers them by
+ * their position in userenv.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+struct script_line {
+	unsigned int lnum;
+	char *name;
+	char *value;
+	struct subnet_node *subnet;
+	
+	struct directive const *directive;	/* NULL if unknown */
+	int negated;
+	int fact;	/* Fact tested by a filter which isn't negated, or -1 */
+};
+
+/* Block of consecutive lines (without a blank line between them) in a script,
+ * lines are indexes into the lines array.
+*/
+struct script_block {
+	unsigned int start;
+	unsigned int end;	/* One past the last line */
+};
+
+/* Entry in the index of blocks which begin with a fact filter whose value is
+ * literal or a prefix followed by *, see script_index().
+*/
+struct block_key {
+	unsigned int fact;
+	char *key;		/* Lowercase value, without the * */
+	int prefix;
+	unsigned int block;
+	
+	struct block_key *next;
+};
+
+/* Blocks indexed under a fact which match its values, see index_lookup() */
+struct fact_blocks {
+	int resolved;
+	unsigned int *blocks;	/* In script order */
+	unsigned int count;
+	unsigned int next;
+};
+
+/* A script read into memory by load_script(), comment lines are omitted but
+ * blank lines are kept as they separate blocks.
+*/
+struct script {
+	struct script_line *lines;
+	unsigned int count;
+	
+	struct subnet_node *subnets[2];	/* IPv4, IPv6 */
+	int subnets_resolved;
+	
+	struct script_block *blocks;
+	unsigned int block_count;
+	
+	unsigned int *general;		/* Blocks which aren't indexed, in order */
+	unsigned int general_count;
+	
+	struct block_key **index;	/* Hash table of the other blocks */
+	unsigned int index_size;	/* Power of two */
+	
+	unsigned int fact_count;
+	unsigned int *fact_first;	/* First block indexed under each fact */
+};
+
+/* Blocks of a script being visited by walk_next() */
+struct block_walk {
+	struct script *script;
+	char **(*resolve)(unsigned int fact);
+	
+	struct fact_blocks *found;	/* For each fact */
+	unsigned int pos;		/* Blocks before this one have been visited */
+	unsigned int gnum;		/* Next entry of script->general */
+};
+
+static void split_line(char *buf, char **name, char **value);
+static void script_index(struct script *script, unsigned int fact_count);
+static int index_fact(struct script_line const *line, size_t *klen);
+static unsigned long index_hash(unsigned int fact, int prefix, char const *key, size_t len);
+static void index_lookup(struct script *script, unsigned int fact, char **values, struct fact_blocks *found);
+static int block_cmp(void const *a, void const *b);
+static void walk_start(struct block_walk *walk, struct script *script, char **(*resolve)(unsigned int fact));
+static unsigned int walk_next(struct block_walk *walk);
+static void walk_free(struct block_walk *walk);
+
+/* Split a line of a script into the directive name and its value in place,
+ * the value is empty if there isn't one and the name is empty for a blank
+ * line.
+*/
+static void split_line(char *buf, char **name, char **value) {
+	*name = buf+strspn(buf, WHITESPACE);
+	*value = *name+strcspn(*name, WHITESPACE);
+	
+	if((*value)[0] != '\0') {
+		(*value)[0] = '\0';
+		(*value)++;
+		*value += strspn(*value, WHITESPACE);
+		(*value)[strcspn(*value, "\r\n")] = '\0';
+	}
+}
+
+/* Split a script into blocks and index the blocks which begin with a filter
+ * on a fact whose value is literal (e.g. NetBIOS PC042) or a prefix followed
+ * by * (e.g. Username adm*).
+*/
+static void script_index(struct script *script, unsigned int fact_count) {
+	unsigned int lnum, bnum, fnum, indexed = 0;
+	
+	script->blocks = allocate(sizeof(struct script_block) * (script->count+1));
+	script->block_count = 0;
+	
+	for(lnum = 0; lnum < script->count; lnum++) {
+		if(script->lines[lnum].name[0] == '\0') {
+			continue;
+		}
+		
+		if(lnum == 0 || script->lines[lnum-1].name[0] == '\0') {
+			script->blocks[script->block_count].start = lnum;
+			script->block_count++;
+		}
+		
+		script->blocks[script->block_count-1].end = lnum+1;
+	}
+	
+	script->fact_count = fact_count;
+	script->fact_first = allocate(sizeof(unsigned int) * fact_count);
+	
+	for(fnum = 0; fnum < fact_count; fnum++) {
+		script->fact_first[fnum] = UINT_MAX;
+	}
+	
+	for(bnum = 0; bnum < script->block_count; bnum++) {
+		struct script_line *line = &(script->lines[script->blocks[bnum].start]);
+		size_t klen;
+		
+		if(index_fact(line, &klen) >= 0) {
+			indexed++;
+		}
+	}
+	
+	for(script->index_size = 16; script->index_size < indexed*2; script->index_size *= 2) {}
+	
+	script->index = allocate(sizeof(struct block_key*) * script->index_size);
+	memset(script->index, 0, sizeof(struct block_key*) * script->index_size);
+	
+	script->general = allocate(sizeof(unsigned int) * (script->block_count+1));
+	script->general_count = 0;
+	
+	for(bnum = 0; bnum < script->block_count; bnum++) {
+		struct script_line *line = &(script->lines[script->blocks[bnum].start]);
+		struct block_key *key;
+		unsigned long hash;
+		size_t klen;
+		int fact;
+		
+		if((fact = index_fact(line, &klen)) < 0) {
+			script->general[script->general_count++] = bnum;
+			continue;
+		}
+		
+		key = allocate(sizeof(struct block_key));
+		key->fact = fact;
+		key->key = fold_copy(line->value, klen);
+		key->prefix = line->value[klen] == '*';
+		key->block = bnum;
+		
+		hash = index_hash(key->fact, key->prefix, key->key, klen) & (script->index_size-1);
+		key->next = script->index[hash];
+		script->index[hash] = key;
+		
+		if(bnum < script->fact_first[fact]) {
+			script->fact_first[fact] = bnum;
+		}
+	}
+}
+
+/* Check if a line is a filter on a fact which can be indexed, returns the
+ * fact and sets the length of the value before any trailing *, or returns -1.
+*/
+static int index_fact(struct script_line const *line, size_t *klen) {
+	size_t len = strcspn(line->value, "*?#");
+	
+	if(line->fact < 0 || line->value[len + strspn(line->value+len, "*")] != '\0') {
+		return -1;
+	}
+	
+	*klen = len;
+	return line->fact;
+}
+
+/* FNV-1a hash of an index key */
+static unsigned long index_hash(unsigned int fact, int prefix, char const *key, size_t len) {
+	unsigned long hash = 2166136261UL;
+	size_t cnum;
+	
+	hash = ((hash ^ (fact*2 + !!prefix)) * 16777619UL) & 0xFFFFFFFFUL;
+	
+	for(cnum = 0; cnum < len; cnum++) {
+		hash = ((hash ^ (unsigned char)key[cnum]) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	
+	return hash;
+}
+
+/* Find the blocks indexed under a fact whose key matches any of its values,
+ * either exactly or as a prefix.
+*/
+static void index_lookup(struct script *script, unsigned int fact, char **values, struct fact_blocks *found) {
+	unsigned int vnum, alloc = 0, bnum;
+	
+	found->resolved = 1;
+	
+	for(vnum = 0; values[vnum]; vnum++) {
+		size_t vlen = strlen(values[vnum]), len;
+		char *folded = fold_copy(values[vnum], vlen);
+		
+		/* Every prefix of the value, then the value itself */
+		
+		for(len = 0; len <= vlen+1; len++) {
+			int prefix = len <= vlen;
+			size_t klen = prefix ? len : vlen;
+			struct block_key *key = script->index[index_hash(fact, prefix, folded, klen) & (script->index_size-1)];
+			
+			for(; key; key = key->next) {
+				if(key->fact != fact || key->prefix != prefix || strlen(key->key) != klen || strncmp(key->key, folded, klen) != 0) {
+					continue;
+				}
+				
+				if(found->count == alloc) {
+					unsigned int *blocks = allocate(sizeof(unsigned int) * (alloc += 16));
+					
+					memcpy(blocks, found->blocks, sizeof(unsigned int) * found->count);
+					free(found->blocks);
+					found->blocks = blocks;
+				}
+				
+				found->blocks[found->count++] = key->block;
+			}
+		}
+		
+		free(folded);
+	}
+	
+	/* A block found through several values is only executed once */
+	
+	if(found->count) {
+		qsort(found->blocks, found->count, sizeof(unsigned int), &block_cmp);
+	}
+	
+	for(bnum = 0, vnum = 0; vnum < found->count; vnum++) {
+		if(bnum == 0 || found->blocks[bnum-1] != found->blocks[vnum]) {
+			found->blocks[bnum++] = found->blocks[vnum];
+		}
+	}
+	
+	found->count = bnum;
+}
+
+/* qsort() comparison function for block numbers */
+static int block_cmp(void const *a, void const *b) {
+	unsigned int ba = *(unsigned int const*)a, bb = *(unsigned int const*)b;
+	
+	return ba < bb ? -1 : (ba > bb);
+}
+
+/* Start visiting the blocks of a script with walk_next(), resolve is called
+ * for the values of a fact the first time they're needed.
+*/
+static void walk_start(struct block_walk *walk, struct script *script, char **(*resolve)(unsigned int fact)) {
+	walk->script = script;
+	walk->resolve = resolve;
+	
+	walk->found = allocate(sizeof(struct fact_blocks) * script->fact_count);
+	memset(walk->found, 0, sizeof(struct fact_blocks) * script->fact_count);
+	
+	walk->pos = 0;
+	walk->gnum = 0;
+}
+
+/* Returns the next block of a script to execute, or UINT_MAX if there are
+ * none left.
+ *
+ * Blocks which begin with a filter on a fact with a literal or prefix value
+ * are looked up in the script's index by the values of the fact, so they're
+ * only visited if that filter matches. The other blocks are visited in order,
+ * each fact is resolved when the first block indexed under it would be
+ * reached, as it would be by evaluating every block.
+*/
+static unsigned int walk_next(struct block_walk *walk) {
+	struct script *script = walk->script;
+	struct fact_blocks *found = walk->found;
+	unsigned int fnum, bnum = UINT_MAX;
+	
+	while(walk->gnum < script->general_count && script->general[walk->gnum] < walk->pos) {
+		walk->gnum++;
+	}
+	
+	if(walk->gnum < script->general_count) {
+		bnum = script->general[walk->gnum];
+	}
+	
+	for(fnum = 0; fnum < script->fact_count; fnum++) {
+		struct fact_blocks *fb = &(found[fnum]);
+		
+		while(fb->next < fb->count && fb->blocks[fb->next] < walk->pos) {
+			fb->next++;
+		}
+		
+		if(fb->next < fb->count && fb->blocks[fb->next] < bnum) {
+			bnum = fb->blocks[fb->next];
+		}
+	}
+	
+	/* Resolve the facts whose first indexed block comes before the next
+	 * block found so far, earliest first.
+	*/
+	
+	for(;;) {
+		unsigned int first = UINT_MAX, ffirst = 0;
+		
+		for(fnum = 0; fnum < script->fact_count; fnum++) {
+			if(!found[fnum].resolved && script->fact_first[fnum] < first) {
+				first = script->fact_first[fnum];
+				ffirst = fnum;
+			}
+		}
+		
+		if(first >= bnum) {
+			break;
+		}
+		
+		index_lookup(script, ffirst, walk->resolve(ffirst), &(found[ffirst]));
+		
+		while(found[ffirst].next < found[ffirst].count && found[ffirst].blocks[found[ffirst].next] < walk->pos) {
+			found[ffirst].next++;
+		}
+		
+		if(found[ffirst].next < found[ffirst].count && found[ffirst].blocks[found[ffirst].next] < bnum) {
+			bnum = found[ffirst].blocks[found[ffirst].next];
+		}
+	}
+	
+	if(bnum != UINT_MAX) {
+		walk->pos = bnum+1;
+	}
+	
+	return bnum;
+}
+
+/* Free the lists of blocks found by walk_next() */
+static void walk_free(struct block_walk *walk) {
+	unsigned int fnum;
+	
+	for(fnum = 0; fnum < walk->script->fact_count; fnum++) {
+		free(walk->found[fnum].blocks);
+	}
+	
+	free(walk->found);
+}